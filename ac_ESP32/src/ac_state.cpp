@@ -0,0 +1,98 @@
+#include "ac_state.h"
+
+#include <IRac.h>
+#include <IRutils.h>
+#include <Preferences.h>
+
+#include "ir_codec.h"
+#include "log.h"
+
+static IRac *ac = nullptr;
+
+static void saveProfile() {
+  Preferences acPrefs;
+  acPrefs.begin("ac", false);
+  acPrefs.putShort("protocol", ac->next.protocol);
+  acPrefs.putShort("model", ac->next.model);
+  acPrefs.end();
+}
+
+void acBegin(uint16_t sendPin) {
+  ac = new IRac(sendPin);
+  Preferences acPrefs;
+  acPrefs.begin("ac", true);
+  ac->next.protocol = (decode_type_t)acPrefs.getShort("protocol", decode_type_t::UNKNOWN);
+  ac->next.model = acPrefs.getShort("model", -1);
+  acPrefs.end();
+  LOG_I("[AC] Profile: %s\n", typeToString(ac->next.protocol).c_str());
+}
+
+bool acEncodeCapture(const decode_results &r, std::vector<uint8_t> &blob,
+                     stdAc::state_t &profile, bool &hasProfile) {
+  hasProfile = false;
+  if (r.decode_type == decode_type_t::UNKNOWN || r.overflow) return false;
+
+  if (hasACState(r.decode_type)) {
+    irEncodeProtocol(r.decode_type, r.bits, r.state, r.bits / 8, blob);
+  } else {
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++) bytes[i] = r.value >> (8 * i);
+    irEncodeProtocol(r.decode_type, r.bits, bytes, sizeof(bytes), blob);
+  }
+
+  // Any learned frame from a supported AC tells us which protocol and
+  // model to synthesize for stateful requests.
+  hasProfile = IRac::isProtocolSupported(r.decode_type) &&
+               IRAcUtils::decodeToState(&r, &profile);
+  return true;
+}
+
+void acLearnProfile(const stdAc::state_t &profile) {
+  if (!ac) return;
+  ac->next = profile;
+  saveProfile();
+}
+
+bool acSendProtocol(IRsend &irsend, const uint16_t *words, uint16_t count) {
+  if (count < 3) return false;
+  decode_type_t type = (decode_type_t)words[0];
+  uint16_t bits = words[1], nbytes = words[2];
+  if (nbytes > kStateSizeMax || count < 3 + (nbytes + 1) / 2) return false;
+
+  uint8_t bytes[kStateSizeMax];
+  for (uint16_t i = 0; i < nbytes; i++) bytes[i] = words[3 + i / 2] >> ((i & 1) * 8);
+  if (hasACState(type)) return irsend.send(type, bytes, nbytes);
+
+  uint64_t value = 0;
+  for (uint16_t i = 0; i < nbytes && i < 8; i++) value |= (uint64_t)bytes[i] << (8 * i);
+  return irsend.send(type, value, bits);
+}
+
+bool acApply(JsonObjectConst req) {
+  if (!ac) return false;
+  stdAc::state_t &st = ac->next;
+  if (req.containsKey("protocol")) {
+    st.protocol = strToDecodeType(req["protocol"] | "");
+    st.model = req["model"] | -1;
+    saveProfile();
+  }
+  if (!IRac::isProtocolSupported(st.protocol)) return false;
+
+  if (req.containsKey("power")) st.power = req["power"] | st.power;
+  if (req.containsKey("mode")) st.mode = IRac::strToOpmode(req["mode"] | "", st.mode);
+  if (req.containsKey("temp")) st.degrees = req["temp"] | st.degrees;
+  if (req.containsKey("fan")) st.fanspeed = IRac::strToFanspeed(req["fan"] | "", st.fanspeed);
+  if (req.containsKey("swing")) st.swingv = IRac::strToSwingV(req["swing"] | "", st.swingv);
+  st.celsius = true;
+  return true;
+}
+
+bool acNextState(stdAc::state_t &out) {
+  if (!ac || !IRac::isProtocolSupported(ac->next.protocol)) return false;
+  out = ac->next;
+  return true;
+}
+
+bool acSendState(const stdAc::state_t &st) {
+  return ac && ac->sendAc(st);
+}
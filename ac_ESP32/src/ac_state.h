@@ -0,0 +1,37 @@
+#pragma once
+
+#include <ArduinoJson.h>
+#include <IRac.h>
+#include <IRrecv.h>
+#include <IRsend.h>
+#include <vector>
+
+// Send step that transmits the synthesized AC state instead of a stored command.
+const char kAcStateStep[] = "@ac";
+
+// Restores the AC profile (protocol and model) remembered from learning.
+void acBegin(uint16_t sendPin);
+
+// The functions below are split by task. Encoding captures and sending
+// run on the IR task and touch no shared state; the AC profile and the
+// next state belong to the network task, which hands the IR task a copy.
+
+// Encodes a capture the library recognized as a kIrProtocolVersion blob.
+// Returns false for unknown or truncated captures, which stay raw. A frame
+// from a supported AC also fills `profile` and sets `hasProfile`.
+bool acEncodeCapture(const decode_results &r, std::vector<uint8_t> &blob,
+                     stdAc::state_t &profile, bool &hasProfile);
+
+// Sends a stored protocol command, `words` as decoded by irDecode().
+bool acSendProtocol(IRsend &irsend, const uint16_t *words, uint16_t count);
+bool acSendState(const stdAc::state_t &st);
+
+// Makes a learned frame's protocol and model the one to synthesize for
+// stateful requests.
+void acLearnProfile(const stdAc::state_t &profile);
+
+// Merges {"protocol", "model", "power", "mode", "temp", "fan", "swing"}
+// into the next AC state. Omitted fields keep their last value.
+bool acApply(JsonObjectConst req);
+// Copies the next AC state, false when no supported protocol is set.
+bool acNextState(stdAc::state_t &out);
@@ -0,0 +1,73 @@
+#include "buttons.h"
+
+#include <Arduino.h>
+
+static const uint8_t kMaxButtons = 4;
+static const uint8_t kEdgeQueue = 16;  // Power of two
+
+struct ButtonEdge {
+  uint8_t  index;
+  uint32_t ms;
+};
+
+static const int *buttonPins;
+static uint8_t buttonCount = 0;
+
+// Written only by the ISR (head) and only by buttonsPoll() (tail).
+static volatile ButtonEdge edges[kEdgeQueue];
+static volatile uint8_t edgeHead = 0;
+static volatile uint8_t edgeTail = 0;
+
+static bool     pressed[kMaxButtons];   // Settled level
+static uint32_t pressStart[kMaxButtons];
+static bool     settling[kMaxButtons];  // Edges since the last settled level
+static uint32_t firstEdge[kMaxButtons]; // Of the burst now settling
+static uint32_t lastEdge[kMaxButtons];
+
+static void IRAM_ATTR onEdge(void *arg) {
+  uint8_t index = (uint8_t)(uintptr_t)arg;
+  uint8_t next = (edgeHead + 1) & (kEdgeQueue - 1);
+  if (next == edgeTail) return;  // Full, drop the edge
+  volatile ButtonEdge &e = edges[edgeHead];
+  e.index = index;
+  e.ms = millis();
+  edgeHead = next;
+}
+
+void buttonsBegin(const int *pins, uint8_t count) {
+  buttonPins = pins;
+  buttonCount = count < kMaxButtons ? count : kMaxButtons;
+  for (uint8_t i = 0; i < buttonCount; i++) {
+    pressed[i] = false;
+    settling[i] = false;
+    attachInterruptArg(digitalPinToInterrupt(pins[i]), onEdge, (void *)(uintptr_t)i, CHANGE);
+  }
+}
+
+bool buttonsPoll(ButtonEvent &ev) {
+  while (edgeTail != edgeHead) {
+    uint8_t i = edges[edgeTail].index;
+    uint32_t ms = edges[edgeTail].ms;
+    edgeTail = (edgeTail + 1) & (kEdgeQueue - 1);
+    if (!settling[i]) firstEdge[i] = ms;
+    settling[i] = true;
+    lastEdge[i] = ms;
+  }
+
+  // Times run from the first edge of a burst, when the button moved.
+  for (uint8_t i = 0; i < buttonCount; i++) {
+    if (!settling[i] || millis() - lastEdge[i] < kButtonDebounceMs) continue;
+    settling[i] = false;
+    bool level = digitalRead(buttonPins[i]) == LOW;
+    if (level == pressed[i]) continue;  // A glitch, or a press too short to count
+    pressed[i] = level;
+    if (level) {
+      pressStart[i] = firstEdge[i];
+    } else {
+      ev.index = i;
+      ev.heldMs = firstEdge[i] - pressStart[i];
+      return true;
+    }
+  }
+  return false;
+}
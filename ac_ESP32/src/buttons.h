@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifndef kButtonDebounceMs
+#define kButtonDebounceMs 30
+#endif
+
+struct ButtonEvent {
+  uint8_t  index;
+  uint32_t heldMs;  // Press duration, reported on release
+};
+
+// Edges are captured by a CHANGE interrupt on every pin and queued for
+// buttonsPoll(). A level counts once the pin has had no edge for
+// kButtonDebounceMs; it is read back then, so a glitch while held and a
+// bouncing release each settle to one state. Releases become events.
+void buttonsBegin(const int *pins, uint8_t count);
+bool buttonsPoll(ButtonEvent &ev);
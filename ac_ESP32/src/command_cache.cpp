@@ -0,0 +1,127 @@
+#include "command_cache.h"
+
+#include <SPIFFS.h>
+#include <vector>
+
+static const uint32_t kCacheMagic = 0x33524941;  // "AIR3", bump when the image layout changes
+static const char *kSlots[2] = { "/lib0.bin", "/lib1.bin" };
+static const char *kLogPath = "/lib.log";
+
+struct CacheHeader {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t version;
+  uint32_t hash;
+  uint32_t commands;
+  uint32_t indexBytes;
+  uint32_t arenaBytes;
+};
+
+static uint32_t currentSeq = 0;
+static CacheStats stats = {0, 0, 0};
+
+bool cacheBegin() {
+  if (!SPIFFS.begin(true)) return false;
+  File log = SPIFFS.open(kLogPath, "r");
+  if (log) {
+    stats.logBytes = log.size();
+    log.close();
+  }
+  return true;
+}
+
+// Reads a slot header and checks the commit word written after the data.
+static bool readSlot(const char *path, CacheHeader &hdr) {
+  File f = SPIFFS.open(path, "r");
+  if (!f) return false;
+  uint32_t commit = 0;
+  bool ok = f.read((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr) &&
+            hdr.magic == kCacheMagic &&
+            f.size() == sizeof(hdr) + hdr.indexBytes + hdr.arenaBytes + sizeof(commit) &&
+            f.seek(f.size() - sizeof(commit)) &&
+            f.read((uint8_t *)&commit, sizeof(commit)) == sizeof(commit) &&
+            commit == (kCacheMagic ^ hdr.seq);
+  f.close();
+  return ok;
+}
+
+bool cacheLoad(CommandStore &store, uint32_t &version, uint32_t &hash) {
+  CacheHeader hdr[2];
+  bool ok[2] = { readSlot(kSlots[0], hdr[0]), readSlot(kSlots[1], hdr[1]) };
+  int slot = ok[0] && (!ok[1] || hdr[0].seq > hdr[1].seq) ? 0 : 1;
+  if (!ok[slot]) return false;
+
+  void *index, *arena;
+  if (!store.restore(hdr[slot].commands, hdr[slot].arenaBytes, index, arena)) return false;
+  File f = SPIFFS.open(kSlots[slot], "r");
+  f.seek(sizeof(CacheHeader));
+  bool read = f.read((uint8_t *)index, hdr[slot].indexBytes) == hdr[slot].indexBytes &&
+              f.read((uint8_t *)arena, hdr[slot].arenaBytes) == hdr[slot].arenaBytes;
+  f.close();
+  if (!read || !store.verify()) {
+    store.reset();
+    return false;
+  }
+
+  currentSeq = hdr[slot].seq;
+  version = hdr[slot].version;
+  hash = hdr[slot].hash;
+  return true;
+}
+
+bool cacheSave(CommandStore &store, uint32_t version, uint32_t hash, size_t logical) {
+  store.compact();
+  CacheHeader hdr = {
+    kCacheMagic, currentSeq + 1, version, hash, store.size(),
+    (uint32_t)store.indexBytes(), (uint32_t)store.arenaUsed()
+  };
+  uint32_t commit = kCacheMagic ^ hdr.seq;
+
+  File f = SPIFFS.open(kSlots[hdr.seq & 1], "w");
+  if (!f) return false;
+  size_t written = f.write((const uint8_t *)&hdr, sizeof(hdr));
+  written += f.write((const uint8_t *)store.indexData(), hdr.indexBytes);
+  written += f.write((const uint8_t *)store.arenaData(), hdr.arenaBytes);
+  written += f.write((const uint8_t *)&commit, sizeof(commit));
+  f.close();
+
+  stats.logicalBytes += logical;
+  stats.flashBytes += written;
+  if (written != sizeof(hdr) + hdr.indexBytes + hdr.arenaBytes + sizeof(commit)) return false;
+
+  currentSeq = hdr.seq;
+  SPIFFS.remove(kLogPath);
+  stats.logBytes = 0;
+  return true;
+}
+
+bool cacheAppend(const uint8_t *delta, size_t len) {
+  File f = SPIFFS.open(kLogPath, "a");
+  if (!f || len > 0xFFFF) return false;
+  uint8_t prefix[2] = { (uint8_t)(len & 0xFF), (uint8_t)(len >> 8) };
+  size_t written = f.write(prefix, sizeof(prefix)) + f.write(delta, len);
+  f.close();
+
+  stats.logicalBytes += len;
+  stats.flashBytes += written;
+  stats.logBytes += written;
+  return written == sizeof(prefix) + len;
+}
+
+void cacheReplay(void (*apply)(const uint8_t *delta, size_t len)) {
+  File f = SPIFFS.open(kLogPath, "r");
+  if (!f) return;
+  std::vector<uint8_t> buf;
+  uint8_t prefix[2];
+  while (f.read(prefix, sizeof(prefix)) == sizeof(prefix)) {
+    size_t len = prefix[0] | (prefix[1] << 8);
+    buf.resize(len);
+    if (f.read(buf.data(), len) != len) break;  // Torn final record
+    apply(buf.data(), len);
+  }
+  f.close();
+}
+
+bool cacheNeedsCompaction() { return stats.logBytes > kCacheLogLimit; }
+
+CacheStats cacheStats() { return stats; }
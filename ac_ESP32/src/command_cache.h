@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "command_store.h"
+
+#ifndef kCacheLogLimit
+#define kCacheLogLimit 8192  // Delta log size that triggers a new image
+#endif
+
+// On-flash copy of the command library. The store's index and arena are
+// written as-is to one of two image slots, the newer valid slot wins at
+// boot, so a torn write never loses the previous library. Deltas received
+// after the image are appended to a log and replayed on load until the
+// log grows past kCacheLogLimit and a fresh image replaces it.
+struct CacheStats {
+  uint32_t logicalBytes;  // Library bytes received from the backend
+  uint32_t flashBytes;    // Bytes written to flash for them
+  uint32_t logBytes;      // Current size of the delta log
+};
+
+bool cacheBegin();
+
+// Loads the newest image into `store`. Version and hash stay zero when
+// nothing valid is cached.
+bool cacheLoad(CommandStore &store, uint32_t &version, uint32_t &hash);
+
+// Compacts `store`, writes it to the spare slot and starts a new log.
+// `logical` is the size of the message that produced this state.
+bool cacheSave(CommandStore &store, uint32_t version, uint32_t hash, size_t logical);
+
+bool cacheAppend(const uint8_t *delta, size_t len);
+void cacheReplay(void (*apply)(const uint8_t *delta, size_t len));
+bool cacheNeedsCompaction();
+
+CacheStats cacheStats();
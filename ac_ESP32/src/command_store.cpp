@@ -0,0 +1,345 @@
+#include "command_store.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "library_frame.h"
+
+static size_t align2(size_t n) { return (n + 1) & ~(size_t)1; }
+
+static int compareName(const char *a, size_t aLen, const char *b, size_t bLen) {
+  int c = memcmp(a, b, aLen < bLen ? aLen : bLen);
+  if (c) return c;
+  return aLen < bLen ? -1 : aLen > bLen ? 1 : 0;
+}
+
+CommandStore::~CommandStore() { free(block); }
+
+bool CommandStore::begin(size_t arenaBytes, uint16_t maxCommands) {
+  free(block);
+  size_t indexBytes = align2(sizeof(Entry) * maxCommands);
+  block = (uint8_t *)malloc(indexBytes + arenaBytes);
+  if (!block) return false;
+  entries = (Entry *)block;
+  arena = block + indexBytes;
+  arenaSize = arenaBytes;
+  capacity = maxCommands;
+  reset();
+  return true;
+}
+
+void CommandStore::reset() {
+  used = 0;
+  live = 0;
+  count = 0;
+  evicted = 0;
+}
+
+size_t CommandStore::timingBytes(const Entry &e) const {
+  return e.flags & kResident ? e.pulses * sizeof(uint16_t) : 0;
+}
+
+size_t CommandStore::entryBytes(const Entry &e) const {
+  return align2(timingBytes(e) + e.nameLen);
+}
+
+const char *CommandStore::nameOf(const Entry &e) const {
+  return (const char *)arena + e.offset + timingBytes(e);
+}
+
+int CommandStore::search(const char *name, size_t nameLen, bool &found) const {
+  int lo = 0, hi = count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    const Entry &e = entries[mid];
+    int c = compareName(nameOf(e), e.nameLen, name, nameLen);
+    if (c == 0) {
+      found = true;
+      return mid;
+    }
+    if (c < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  found = false;
+  return lo;
+}
+
+uint32_t CommandStore::append(size_t bytes) {
+  if (used + bytes > arenaSize) {
+    // Evicting everything would still leave the names; if that is not
+    // enough, keep what is cached.
+    size_t names = 0;
+    for (uint16_t i = 0; i < count; i++) names += align2(entries[i].nameLen);
+    if (names + bytes > arenaSize) return UINT32_MAX;
+    while (live + bytes > arenaSize && evict()) {}
+    compact();
+  }
+  if (used + bytes > arenaSize) return UINT32_MAX;
+  uint32_t offset = used;
+  used += bytes;
+  live += bytes;
+  return offset;
+}
+
+// Drops the timings of the coldest resident command, leaving its name
+// where the timings ended so compact() reclaims them.
+bool CommandStore::evict() {
+  int victim = -1;
+  for (uint16_t i = 0; i < count; i++) {
+    const Entry &e = entries[i];
+    if ((e.flags & (kResident | kBusy)) != kResident) continue;
+    if (victim < 0) {
+      victim = i;
+      continue;
+    }
+    const Entry &v = entries[victim];
+    bool pinned = e.hits >= kStorePinHits, vPinned = v.hits >= kStorePinHits;
+    if (pinned != vPinned ? !pinned : e.lastUse < v.lastUse) victim = i;
+  }
+  if (victim < 0) return false;
+  Entry &e = entries[victim];
+  live -= entryBytes(e);
+  e.offset += timingBytes(e);
+  e.flags &= ~kResident;
+  live += entryBytes(e);
+  evicted++;
+  return true;
+}
+
+void CommandStore::removeAt(int pos) {
+  live -= entryBytes(entries[pos]);
+  memmove(&entries[pos], &entries[pos + 1], (count - pos - 1) * sizeof(Entry));
+  count--;
+}
+
+void CommandStore::insertAt(int pos, const Entry &e) {
+  memmove(&entries[pos + 1], &entries[pos], (count - pos) * sizeof(Entry));
+  entries[pos] = e;
+  count++;
+}
+
+uint16_t *CommandStore::put(const char *name, size_t nameLen, uint16_t pulses,
+                            uint8_t format) {
+  if (!block || nameLen > 255) return nullptr;
+  bool found;
+  int pos = search(name, nameLen, found);
+  Entry e = {0, 0, 0, pulses, (uint8_t)nameLen, format, 0, kResident};
+  if (found) {
+    e.lastUse = entries[pos].lastUse;
+    e.hits = entries[pos].hits;
+  } else if (count >= capacity) {
+    return nullptr;
+  }
+
+  // A replaced command goes only once the new copy has room, so a failed
+  // put leaves it in place. append() may evict or move it, but it keeps
+  // its slot in the index.
+  size_t bytes = pulses * sizeof(uint16_t);
+  e.offset = append(align2(bytes + nameLen));
+  if (e.offset == UINT32_MAX) return nullptr;
+  memcpy(arena + e.offset + bytes, name, nameLen);
+  if (found) removeAt(pos);
+  insertAt(pos, e);
+  return (uint16_t *)(arena + e.offset);
+}
+
+uint32_t CommandStore::seal(const char *name, size_t nameLen, const CommandStore *history) {
+  bool found;
+  int pos = search(name, nameLen, found);
+  if (!found || !(entries[pos].flags & kResident)) return 0;
+  Entry &e = entries[pos];
+  CommandView cmd = at(pos);
+  e.hash = libraryEntryHash(cmd.name, cmd.nameLen, cmd.timings, cmd.count);
+  if (history) {
+    int from = history->search(name, nameLen, found);
+    if (found) {
+      e.lastUse = history->entries[from].lastUse;
+      e.hits = history->entries[from].hits;
+      if (history->tick > tick) tick = history->tick;
+    }
+  }
+  return e.hash;
+}
+
+bool CommandStore::remove(const char *name, size_t nameLen) {
+  bool found;
+  int pos = search(name, nameLen, found);
+  if (found) removeAt(pos);
+  return found;
+}
+
+bool CommandStore::rename(const char *from, size_t fromLen, const char *to, size_t toLen) {
+  bool found;
+  if (toLen > 255) return false;
+  int pos = search(from, fromLen, found);
+  // The hash covers the name, so it cannot be redone without the timings.
+  if (!found || !(entries[pos].flags & kResident)) return false;
+  if (compareName(from, fromLen, to, toLen) == 0) return true;
+  pos = search(to, toLen, found);
+  if (found) removeAt(pos);
+
+  // The copy may compact or evict, so the source is marked to stay and
+  // looked up again afterwards.
+  pos = search(from, fromLen, found);
+  entries[pos].flags |= kBusy;
+  size_t bytes = entries[pos].pulses * sizeof(uint16_t);
+  uint32_t offset = append(align2(bytes + toLen));
+  pos = search(from, fromLen, found);
+  Entry e = entries[pos];
+  entries[pos].flags &= ~kBusy;
+  if (offset == UINT32_MAX) return false;
+  memcpy(arena + offset, arena + e.offset, bytes);
+  memcpy(arena + offset + bytes, to, toLen);
+  removeAt(pos);
+  e.offset = offset;
+  e.nameLen = toLen;
+  e.flags = kResident;
+  e.hash = libraryEntryHash(to, toLen, (const uint16_t *)(arena + offset), e.pulses);
+  insertAt(search(to, toLen, found), e);
+  return true;
+}
+
+bool CommandStore::find(const char *name, size_t nameLen, CommandView &out) const {
+  bool found;
+  int pos = search(name, nameLen, found);
+  if (!found || !(entries[pos].flags & kResident)) return false;
+  out = at(pos);
+  return true;
+}
+
+bool CommandStore::known(const char *name, size_t nameLen) const {
+  bool found;
+  search(name, nameLen, found);
+  return found;
+}
+
+uint32_t CommandStore::hashOf(const char *name, size_t nameLen) const {
+  bool found;
+  int pos = search(name, nameLen, found);
+  return found ? entries[pos].hash : 0;
+}
+
+void CommandStore::touch(const char *name, size_t nameLen) const {
+  bool found;
+  int pos = search(name, nameLen, found);
+  if (!found) return;
+  // The IR task may be reading this copy. It never looks at the stamps,
+  // but they are stored atomically so no plain write lands in an entry
+  // another task is reading.
+  Entry &e = entries[pos];
+  __atomic_store_n(&e.lastUse, ++tick, __ATOMIC_RELAXED);
+  if (e.hits < kStorePinHits) __atomic_store_n(&e.hits, e.hits + 1, __ATOMIC_RELAXED);
+}
+
+CommandView CommandStore::at(uint16_t i) const {
+  const Entry &e = entries[i];
+  return {nameOf(e), e.nameLen, (const uint16_t *)(arena + e.offset), e.pulses, e.format};
+}
+
+void CommandStore::compact() {
+  // Slide live entries down in arena order. Entries below `floor` have
+  // already moved; the lowest offset at or above it is the next to go.
+  size_t cursor = 0;
+  uint32_t floor = 0;
+  for (uint16_t moved = 0; moved < count; moved++) {
+    int next = -1;
+    for (uint16_t i = 0; i < count; i++) {
+      if (entries[i].offset >= floor &&
+          (next < 0 || entries[i].offset < entries[next].offset)) {
+        next = i;
+      }
+    }
+    Entry &e = entries[next];
+    size_t bytes = entryBytes(e);
+    floor = e.offset + 1;
+    memmove(arena + cursor, arena + e.offset, bytes);
+    e.offset = cursor;
+    cursor += bytes;
+  }
+  used = cursor;
+  live = cursor;
+}
+
+bool CommandStore::restore(uint16_t commands, size_t usedBytes,
+                           void *&index, void *&arenaOut) {
+  reset();
+  if (!block || commands > capacity || usedBytes > arenaSize) return false;
+  count = commands;
+  used = usedBytes;
+  index = entries;
+  arenaOut = arena;
+  return true;
+}
+
+bool CommandStore::verify() {
+  size_t sum = 0;
+  tick = 0;
+  for (uint16_t i = 0; i < count; i++) {
+    size_t bytes = entryBytes(entries[i]);
+    if (entries[i].offset + bytes > used || (entries[i].flags & ~kResident)) {
+      reset();
+      return false;
+    }
+    sum += bytes;
+    if (entries[i].lastUse > tick) tick = entries[i].lastUse;
+  }
+  live = sum;
+  return true;
+}
+
+bool CommandStore::copyFrom(const CommandStore &other) {
+  if (!block || other.count > capacity || other.used > arenaSize) return false;
+  memcpy(entries, other.entries, other.count * sizeof(Entry));
+  memcpy(arena, other.arena, other.used);
+  count = other.count;
+  used = other.used;
+  live = other.live;
+  evicted = 0;
+  tick = other.tick;
+  return true;
+}
+
+CommandStoreStats CommandStore::stats() const {
+  CommandStoreStats s;
+  s.arenaBytes = arenaSize;
+  s.usedBytes = used;
+  s.liveBytes = live;
+  s.commands = count;
+  s.resident = 0;
+  s.pinned = 0;
+  for (uint16_t i = 0; i < count; i++) {
+    if (!(entries[i].flags & kResident)) continue;
+    s.resident++;
+    if (entries[i].hits >= kStorePinHits) s.pinned++;
+  }
+  s.maxCommands = capacity;
+  s.evicted = evicted;
+  s.fragmentation = used ? (used - live) * 100 / used : 0;
+  return s;
+}
+
+bool CommandLibrary::begin(size_t arenaBytes, uint16_t maxCommands) {
+  pins[0].store(0);
+  pins[1].store(0);
+  return stores[0].begin(arenaBytes, maxCommands) && stores[1].begin(arenaBytes, maxCommands);
+}
+
+const CommandStore &CommandLibrary::pin(uint8_t &slot) {
+  // The pin only counts if the copy was still live after taking it;
+  // otherwise edit() may already be writing to it.
+  for (;;) {
+    slot = current.load();
+    pins[slot].fetch_add(1);
+    if (current.load() == slot) return stores[slot];
+    pins[slot].fetch_sub(1);
+  }
+}
+
+CommandStore *CommandLibrary::edit(bool seed) {
+  uint8_t spare = current.load() ^ 1;
+  if (pins[spare].load()) return nullptr;
+  CommandStore &s = stores[spare];
+  if (seed) s.copyFrom(stores[spare ^ 1]);
+  else s.reset();
+  return &s;
+}
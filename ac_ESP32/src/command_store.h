@@ -0,0 +1,169 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ir_codec.h"
+
+// CommandLibrary holds two stores, each one allocation of the arena plus
+// 20 bytes of index per command: about 74 KB of heap at the defaults.
+// Libraries larger than the arena stay whole, with cold commands evicted
+// to their names and fetched back on use. Evicted commands keep their
+// index entry, so kStoreMaxCommands is the most a library can hold.
+#ifndef kStoreArenaBytes
+#define kStoreArenaBytes 32768
+#endif
+
+#ifndef kStoreMaxCommands
+#define kStoreMaxCommands 256
+#endif
+
+#ifndef kStorePinHits
+#define kStorePinHits 8  // Uses after which a command is evicted last
+#endif
+
+struct CommandView {
+  const char     *name;
+  uint8_t         nameLen;
+  const uint16_t *timings;  // Raw timings, or protocol words (see ir_codec.h)
+  uint16_t        count;
+  uint8_t         format;   // kIrCodecVersion or kIrProtocolVersion
+};
+
+struct CommandStoreStats {
+  size_t   arenaBytes;  // Capacity for names and timings
+  size_t   usedBytes;   // Append cursor, live plus dead
+  size_t   liveBytes;
+  uint16_t commands;    // Every command of the library
+  uint16_t resident;    // Those with their timings in the arena
+  uint16_t pinned;      // Resident ones used kStorePinHits times
+  uint16_t maxCommands;
+  uint16_t evicted;     // Timings dropped since this copy was seeded
+  uint8_t  fragmentation;  // Dead share of used bytes, percent
+};
+
+// Command library in a single allocation: a name-sorted index followed by
+// an append-only arena holding each command's timings and then its name.
+// Replaced or removed entries leave dead bytes behind until compact() runs,
+// which put() does on its own when the arena fills up.
+//
+// The arena is a budget, not a limit on the library. When compacting
+// does not free enough, put() evicts the timings of the least recently
+// used command and keeps only its name and hash, so the index still
+// lists the whole library. Commands used kStorePinHits times go only
+// after every other one. find() misses an evicted command; known()
+// does not, and the caller fetches the timings and put()s them back.
+class CommandStore {
+public:
+  ~CommandStore();
+
+  bool begin(size_t arenaBytes = kStoreArenaBytes,
+             uint16_t maxCommands = kStoreMaxCommands);
+  void reset();
+
+  // Adds or replaces `name` and returns room for `count` words, or
+  // nullptr when the index is full or the command alone outgrows the
+  // arena. A replaced command keeps its use history, and its old copy
+  // when the put fails.
+  uint16_t *put(const char *name, size_t nameLen, uint16_t count,
+                uint8_t format = kIrCodecVersion);
+  // Hashes the timings written after put() (see libraryEntryHash()) and
+  // returns the hash. `history` passes on the command's uses from the copy
+  // being replaced, so a reload evicts the same commands it would have.
+  uint32_t seal(const char *name, size_t nameLen, const CommandStore *history = nullptr);
+  bool remove(const char *name, size_t nameLen);
+  bool rename(const char *from, size_t fromLen, const char *to, size_t toLen);
+  bool find(const char *name, size_t nameLen, CommandView &out) const;
+
+  // Evicted commands included. The hash is the one seal() recorded.
+  bool known(const char *name, size_t nameLen) const;
+  uint32_t hashOf(const char *name, size_t nameLen) const;
+
+  // Records a use for eviction. Uses are bookkeeping rather than contents,
+  // so they go on the copy readers pin, with atomic stores; network task
+  // only.
+  void touch(const char *name, size_t nameLen) const;
+
+  uint16_t size() const { return count; }
+
+  void compact();
+  CommandStoreStats stats() const;
+
+  // Replaces the contents with a copy of `other`, which must fit.
+  bool copyFrom(const CommandStore &other);
+
+  // Raw regions for the flash cache. Reading the same bytes back through
+  // restore() gives a usable store without parsing anything.
+  const void *indexData() const { return entries; }
+  size_t indexBytes() const { return count * sizeof(Entry); }
+  const void *arenaData() const { return arena; }
+  size_t arenaUsed() const { return used; }
+
+  // Sizes the store for an image and returns where its index and arena go.
+  // Call verify() once the bytes are in place.
+  bool restore(uint16_t commands, size_t usedBytes, void *&index, void *&arenaOut);
+  bool verify();
+
+private:
+  enum : uint8_t { kResident = 1, kBusy = 2 };  // Entry::flags
+
+  struct Entry {
+    uint32_t offset;
+    uint32_t hash;
+    uint32_t lastUse;  // tick of the last touch()
+    uint16_t pulses;
+    uint8_t  nameLen;
+    uint8_t  format;
+    uint8_t  hits;     // Saturates at kStorePinHits
+    uint8_t  flags;
+  };
+
+  int search(const char *name, size_t nameLen, bool &found) const;
+  void removeAt(int pos);
+  void insertAt(int pos, const Entry &e);
+  uint32_t append(size_t bytes);
+  bool evict();
+  size_t timingBytes(const Entry &e) const;
+  size_t entryBytes(const Entry &e) const;
+  const char *nameOf(const Entry &e) const;
+  CommandView at(uint16_t i) const;
+
+  uint8_t *block = nullptr;
+  Entry   *entries = nullptr;
+  uint8_t *arena = nullptr;
+  size_t   arenaSize = 0;
+  size_t   used = 0;
+  size_t   live = 0;
+  uint16_t count = 0;
+  uint16_t capacity = 0;
+  uint16_t evicted = 0;
+  mutable uint32_t tick = 0;  // Uses so far, see touch()
+};
+
+// The library as two stores behind an atomic index, so the IR task can
+// use commands while the network task reloads them. The network task
+// edits the spare copy and publish()es it with one atomic store; lookups
+// and transmits never wait on a reload. Readers pin the copy they use,
+// and edit() will not hand out a copy that is still pinned.
+class CommandLibrary {
+public:
+  bool begin(size_t arenaBytes = kStoreArenaBytes,
+             uint16_t maxCommands = kStoreMaxCommands);
+
+  // Any task. The copy stays valid until unpin(slot).
+  const CommandStore &pin(uint8_t &slot);
+  void unpin(uint8_t slot) { pins[slot].fetch_sub(1); }
+
+  // Network task only.
+  const CommandStore &live() const { return stores[current.load()]; }
+  // The spare copy, seeded from live() unless `seed` is false, or
+  // nullptr while a reader still pins it.
+  CommandStore *edit(bool seed = true);
+  void publish() { current.store(current.load() ^ 1); }
+
+private:
+  CommandStore         stores[2];
+  std::atomic<uint8_t> current{0};
+  std::atomic<uint8_t> pins[2];
+};
@@ -0,0 +1,212 @@
+#include "ir_codec.h"
+
+#include <algorithm>
+
+size_t irWriteVarint(std::vector<uint8_t> &out, uint32_t v) {
+  size_t n = 0;
+  do {
+    uint8_t b = v & 0x7F;
+    v >>= 7;
+    if (v) b |= 0x80;
+    out.push_back(b);
+    n++;
+  } while (v);
+  return n;
+}
+
+size_t irWriteVarint(uint8_t *out, uint32_t v) {
+  size_t n = 0;
+  do {
+    uint8_t b = v & 0x7F;
+    v >>= 7;
+    if (v) b |= 0x80;
+    out[n++] = b;
+  } while (v);
+  return n;
+}
+
+bool irReadVarint(const uint8_t *&p, const uint8_t *end, uint32_t &v) {
+  v = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (p >= end) return false;
+    uint8_t b = *p++;
+    v |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+// Only a zero width stays zero, see learnAppendWidth().
+static uint32_t quantize(uint16_t us, uint8_t tickUs) {
+  uint32_t t = (us + tickUs / 2) / tickUs;
+  return t || !us ? t : 1;
+}
+
+size_t irEncode(const uint16_t *timings, size_t n, uint8_t tickUs,
+                std::vector<uint8_t> &out, uint32_t repeat) {
+  if (!tickUs) tickUs = 1;
+  size_t start = out.size();
+
+  std::vector<uint32_t> ticks(n);
+  for (size_t i = 0; i < n; i++) ticks[i] = quantize(timings[i], tickUs);
+
+  // Pick the most frequent widths that repeat at least once.
+  std::vector<uint32_t> sorted(ticks);
+  std::sort(sorted.begin(), sorted.end());
+  std::vector<std::pair<uint32_t, uint32_t>> freq;  // (count, ticks)
+  for (size_t i = 0; i < sorted.size();) {
+    size_t j = i;
+    while (j < sorted.size() && sorted[j] == sorted[i]) j++;
+    if (j - i > 1) freq.push_back({(uint32_t)(j - i), sorted[i]});
+    i = j;
+  }
+  std::sort(freq.begin(), freq.end(),
+            [](const std::pair<uint32_t, uint32_t> &a,
+               const std::pair<uint32_t, uint32_t> &b) { return a.first > b.first; });
+  if (freq.size() > kIrCodecMaxDict) freq.resize(kIrCodecMaxDict);
+
+  std::vector<uint32_t> dict;
+  for (auto &f : freq) dict.push_back(f.second);
+  std::sort(dict.begin(), dict.end());
+
+  out.push_back(repeat > 1 ? kIrRepeatVersion : kIrCodecVersion);
+  out.push_back(tickUs);
+  irWriteVarint(out, n);
+  if (repeat > 1) irWriteVarint(out, repeat);
+  out.push_back(dict.size());
+  uint32_t prev = 0;
+  for (uint32_t d : dict) {
+    irWriteVarint(out, d - prev);
+    prev = d;
+  }
+
+  size_t symbols = out.size();
+  out.resize(symbols + (n + 1) / 2, 0);
+  std::vector<uint32_t> literals;
+  for (size_t i = 0; i < n; i++) {
+    auto it = std::lower_bound(dict.begin(), dict.end(), ticks[i]);
+    uint8_t sym = kIrCodecEscape;
+    if (it != dict.end() && *it == ticks[i]) {
+      sym = it - dict.begin();
+    } else {
+      literals.push_back(ticks[i]);
+    }
+    out[symbols + i / 2] |= (i & 1) ? sym << 4 : sym;
+  }
+  for (uint32_t l : literals) irWriteVarint(out, l);
+
+  return out.size() - start;
+}
+
+size_t irEncodeProtocol(uint16_t protocol, uint16_t bits, const uint8_t *bytes,
+                        uint8_t nbytes, std::vector<uint8_t> &out) {
+  size_t start = out.size();
+  out.push_back(kIrProtocolVersion);
+  irWriteVarint(out, protocol);
+  irWriteVarint(out, bits);
+  out.push_back(nbytes);
+  out.insert(out.end(), bytes, bytes + nbytes);
+  return out.size() - start;
+}
+
+// Parses a protocol blob up to its state bytes.
+static bool readProtocol(const uint8_t *&p, const uint8_t *end, uint32_t &protocol,
+                         uint32_t &bits, uint8_t &nbytes) {
+  if (p >= end || *p++ != kIrProtocolVersion) return false;
+  if (!irReadVarint(p, end, protocol) || !irReadVarint(p, end, bits) || p >= end) {
+    return false;
+  }
+  nbytes = *p++;
+  return end - p >= nbytes;
+}
+
+bool irReadHeader(const uint8_t *data, size_t len, IrCodecHeader &hdr) {
+  const uint8_t *p = data, *end = data + len;
+  if (len >= 1 && p[0] == kIrProtocolVersion) {
+    uint32_t protocol, bits;
+    uint8_t nbytes;
+    if (!readProtocol(p, end, protocol, bits, nbytes)) return false;
+    hdr.version = kIrProtocolVersion;
+    hdr.tickUs = 0;
+    hdr.count = 3 + (nbytes + 1) / 2;
+    hdr.repeat = 1;
+    return true;
+  }
+  if (len < 2 || (p[0] != kIrCodecVersion && p[0] != kIrRepeatVersion) || p[1] == 0) {
+    return false;
+  }
+  hdr.version = *p++;
+  hdr.tickUs = *p++;
+  hdr.repeat = 1;
+  if (!irReadVarint(p, end, hdr.count)) return false;
+  if (hdr.version == kIrRepeatVersion) {
+    if (!irReadVarint(p, end, hdr.repeat)) return false;
+    hdr.count++;
+  }
+  return true;
+}
+
+static bool decodeProtocol(const uint8_t *data, size_t len, uint16_t *out) {
+  const uint8_t *p = data, *end = data + len;
+  uint32_t protocol, bits;
+  uint8_t nbytes;
+  if (!readProtocol(p, end, protocol, bits, nbytes)) return false;
+  out[0] = protocol;
+  out[1] = bits;
+  out[2] = nbytes;
+  for (uint8_t i = 0; i < nbytes; i += 2) {
+    out[3 + i / 2] = p[i] | (i + 1 < nbytes ? p[i + 1] << 8 : 0);
+  }
+  return true;
+}
+
+bool irDecode(const uint8_t *data, size_t len, uint16_t *out, size_t cap) {
+  IrCodecHeader hdr;
+  if (!irReadHeader(data, len, hdr) || hdr.count > cap) return false;
+  if (hdr.version == kIrProtocolVersion) return decodeProtocol(data, len, out);
+
+  const uint8_t *p = data + 2, *end = data + len;
+  uint32_t count, repeat;
+  irReadVarint(p, end, count);
+  if (hdr.version == kIrRepeatVersion) {
+    irReadVarint(p, end, repeat);
+    *out++ = repeat > 0xFFFF ? 0xFFFF : repeat;
+  }
+  if (p >= end || *p > kIrCodecMaxDict) return false;
+  uint8_t dictSize = *p++;
+
+  uint32_t dict[kIrCodecMaxDict];
+  uint32_t prev = 0;
+  for (uint8_t i = 0; i < dictSize; i++) {
+    uint32_t delta;
+    if (!irReadVarint(p, end, delta)) return false;
+    prev += delta;
+    dict[i] = prev;
+  }
+
+  const uint8_t *symbols = p;
+  if ((size_t)(end - symbols) < (count + 1) / 2) return false;
+  p = symbols + (count + 1) / 2;
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t sym = (symbols[i / 2] >> ((i & 1) * 4)) & 0x0F;
+    uint32_t ticks;
+    if (sym == kIrCodecEscape) {
+      if (!irReadVarint(p, end, ticks)) return false;
+    } else if (sym < dictSize) {
+      ticks = dict[sym];
+    } else {
+      return false;
+    }
+    uint32_t us = ticks * hdr.tickUs;
+    out[i] = us > 0xFFFF ? 0xFFFF : us;
+  }
+  return true;
+}
+
+bool irDecode(const uint8_t *data, size_t len, std::vector<uint16_t> &out) {
+  IrCodecHeader hdr;
+  if (!irReadHeader(data, len, hdr) || hdr.count > len * 2 + 3) return false;
+  out.resize(hdr.count);
+  return irDecode(data, len, out.data(), out.size());
+}
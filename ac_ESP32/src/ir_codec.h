@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Compact binary form of a raw IR capture.
+//
+//   u8      version            kIrCodecVersion
+//   u8      tick_us            quantization unit, every pulse is stored in ticks
+//   varint  count              number of pulses
+//   u8      dict_size          canonical widths, 0..kIrCodecMaxDict
+//   varint  dict[dict_size]    widths in ticks, ascending, delta-coded
+//   u8      symbols[(count+1)/2]
+//                              one nibble per pulse, low nibble first:
+//                              index into dict, or kIrCodecEscape
+//   varint  literals[]         ticks for every escaped pulse, in order
+//
+// Varints are unsigned LEB128.
+//
+// A capture folded into one repeated frame uses kIrRepeatVersion: the
+// same layout with a varint repeat count after `count`. It decodes to
+// the repeat count followed by the frame's timings, the frame ending in
+// the gap that separates copies.
+const uint8_t kIrCodecVersion = 1;
+const uint8_t kIrRepeatVersion = 3;
+const uint8_t kIrCodecMaxDict = 15;
+const uint8_t kIrCodecEscape  = 0x0F;
+
+// A capture the receiver could decode is stored as protocol and state:
+//
+//   u8      version            kIrProtocolVersion
+//   varint  protocol           decode_type_t
+//   varint  bits
+//   u8      nbytes
+//   u8      bytes[nbytes]      AC state, or the value as little-endian u64
+//
+// It decodes to words: protocol, bits, nbytes, then the bytes two per
+// word, low byte first. IrCodecHeader::count is that word count.
+const uint8_t kIrProtocolVersion = 2;
+
+// Save messages and library snapshots carry encoded captures as records:
+//   u8 name_len, name bytes, varint blob_len, blob
+// A save message is kLibraryVersion followed by one record, a u8
+// confidence 0..100 and the library the command was learned into, as
+// u8 length and name bytes.
+// Snapshots and deltas are described in library_frame.h.
+//
+// A save message longer than one packet goes out in pieces on
+// home/ac/dev/<device>/save/part instead, each one
+//   u8 kLibraryVersion, varint transfer id, varint offset,
+//   varint total length, the save message bytes from offset on
+// The backend starts over whenever offset is 0 and decodes the message
+// once it has total bytes.
+const uint8_t kLibraryVersion = 1;
+
+const size_t kIrVarintMax = 5;
+
+struct IrCodecHeader {
+  uint8_t  version;  // kIrCodecVersion, kIrRepeatVersion or kIrProtocolVersion
+  uint8_t  tickUs;
+  uint32_t count;    // Words irDecode() writes
+  uint32_t repeat;
+};
+
+size_t irWriteVarint(std::vector<uint8_t> &out, uint32_t v);
+// Writes at most kIrVarintMax bytes to `out`.
+size_t irWriteVarint(uint8_t *out, uint32_t v);
+bool irReadVarint(const uint8_t *&p, const uint8_t *end, uint32_t &v);
+
+// Appends the encoded capture to `out`, returns the number of bytes written.
+size_t irEncode(const uint16_t *timings, size_t n, uint8_t tickUs,
+                std::vector<uint8_t> &out, uint32_t repeat = 1);
+size_t irEncodeProtocol(uint16_t protocol, uint16_t bits, const uint8_t *bytes,
+                        uint8_t nbytes, std::vector<uint8_t> &out);
+
+bool irReadHeader(const uint8_t *data, size_t len, IrCodecHeader &hdr);
+
+// Decodes into `out`, which must hold hdr.count entries.
+bool irDecode(const uint8_t *data, size_t len, uint16_t *out, size_t cap);
+bool irDecode(const uint8_t *data, size_t len, std::vector<uint16_t> &out);
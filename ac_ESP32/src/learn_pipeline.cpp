@@ -0,0 +1,98 @@
+#include "learn_pipeline.h"
+
+#include <algorithm>
+
+struct Cluster {
+  uint32_t lo, hi, center;
+};
+
+static std::vector<Cluster> clusterWidths(const std::vector<std::vector<uint32_t>> &captures) {
+  std::vector<uint32_t> all;
+  for (auto &c : captures) all.insert(all.end(), c.begin(), c.end());
+  std::sort(all.begin(), all.end());
+
+  std::vector<Cluster> clusters;
+  for (size_t i = 0; i < all.size();) {
+    uint32_t limit = all[i] + (uint64_t)all[i] * kLearnClusterTolerance / 100;
+    size_t j = i;
+    while (j < all.size() && all[j] <= limit) j++;
+    clusters.push_back({all[i], all[j - 1], all[(i + j - 1) / 2]});
+    i = j;
+  }
+  return clusters;
+}
+
+static uint8_t clusterOf(const std::vector<Cluster> &clusters, uint32_t v) {
+  auto it = std::lower_bound(clusters.begin(), clusters.end(), v,
+                             [](const Cluster &c, uint32_t x) { return c.hi < x; });
+  return it - clusters.begin();
+}
+
+// Smallest even period p with seq == unit repeated (len + 1) / p times,
+// the last copy missing its trailing gap, and the count fitting
+// LearnResult::repeat. A frame repeated more often folds into a unit of
+// several copies. Returns 0 when there is none.
+static size_t findPeriod(const std::vector<uint8_t> &seq) {
+  size_t len = seq.size();
+  for (size_t p = 2; p <= (len + 1) / 2; p += 2) {
+    if ((len + 1) % p || (len + 1) / p > UINT8_MAX) continue;
+    size_t i = 0;
+    while (i + p < len && seq[i] == seq[i + p]) i++;
+    if (i + p == len) return p;
+  }
+  return 0;
+}
+
+void learnAppendWidth(std::vector<uint16_t> &out, uint32_t us) {
+  for (; us > kLearnSplitUs; us -= kLearnSplitUs) {
+    out.push_back(kLearnSplitUs);
+    out.push_back(0);
+  }
+  out.push_back(us);
+}
+
+bool learnConsensus(const std::vector<std::vector<uint32_t>> &captures,
+                    LearnResult &out) {
+  if (captures.empty()) return false;
+
+  // Vote on the frame length first; captures with extra or missing
+  // pulses are noise and sit out the per-position vote.
+  size_t bestLen = 0, bestVotes = 0;
+  for (auto &c : captures) {
+    size_t votes = std::count_if(captures.begin(), captures.end(),
+                                 [&c](const std::vector<uint32_t> &o) { return o.size() == c.size(); });
+    if (votes > bestVotes) {
+      bestLen = c.size();
+      bestVotes = votes;
+    }
+  }
+  if (bestLen < 2) return false;
+
+  std::vector<Cluster> clusters = clusterWidths(captures);
+  std::vector<uint8_t> seq(bestLen);
+  uint32_t agreement = 0;  // Sum over positions of the winning vote count
+  std::vector<uint8_t> tally(clusters.size());
+  for (size_t i = 0; i < bestLen; i++) {
+    std::fill(tally.begin(), tally.end(), 0);
+    for (auto &c : captures) {
+      if (c.size() == bestLen) tally[clusterOf(clusters, c[i])]++;
+    }
+    auto win = std::max_element(tally.begin(), tally.end());
+    seq[i] = win - tally.begin();
+    agreement += *win;
+  }
+
+  size_t period = findPeriod(seq);
+  size_t frameLen = period ? period : bestLen;
+  out.frame.clear();
+  for (size_t i = 0; i < frameLen; i++) learnAppendWidth(out.frame, clusters[seq[i]].center);
+  out.repeat = period ? (bestLen + 1) / period : 1;
+
+  std::vector<uint8_t> used(seq.begin(), seq.begin() + frameLen);
+  std::sort(used.begin(), used.end());
+  out.widths = std::unique(used.begin(), used.end()) - used.begin();
+  out.agreeing = bestVotes;
+  out.confidence = (uint64_t)agreement * 100 / (bestLen * captures.size());
+  out.capturedPulses = bestLen;
+  return true;
+}
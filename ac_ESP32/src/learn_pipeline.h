@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#ifndef kLearnClusterTolerance
+#define kLearnClusterTolerance 25  // Percent spread allowed inside one width cluster
+#endif
+
+#ifndef kLearnSplitUs
+#define kLearnSplitUs 65000  // Longest stored width, a whole number of codec ticks
+#endif
+
+struct LearnResult {
+  std::vector<uint16_t> frame;  // Canonical timings of one frame, split (see below)
+  uint8_t  repeat;              // Copies of frame sent back to back
+  uint8_t  widths;              // Distinct canonical widths
+  uint8_t  agreeing;            // Captures that matched the voted length
+  uint8_t  confidence;          // 0..100
+  size_t   capturedPulses;      // Length of the voted capture before folding
+};
+
+// Builds one command from several captures of the same button, widths
+// in microseconds. Pulse widths from all captures are clustered into
+// canonical durations, the captures of the most common length vote per
+// position, and a frame repeated back to back is folded into one copy
+// plus a repeat count.
+bool learnConsensus(const std::vector<std::vector<uint32_t>> &captures,
+                    LearnResult &out);
+
+// Appends a width of any length as 16-bit timings. Past kLearnSplitUs
+// it goes in pieces joined by zero-length opposites, so a 90 ms gap is
+// stored as 65000, 0, 25000 and sendRaw() still plays one gap.
+void learnAppendWidth(std::vector<uint16_t> &out, uint32_t us);
@@ -0,0 +1,42 @@
+#include "led.h"
+
+#include <Arduino.h>
+
+static const uint8_t kLedSlots = 4;
+
+struct LedPattern {
+  uint8_t  pin;
+  uint8_t  toggles;  // Remaining level changes, 0 when idle
+  uint16_t ms;
+  uint32_t next;
+};
+
+static LedPattern patterns[kLedSlots];
+
+static void start(uint8_t pin, uint8_t toggles, uint16_t ms) {
+  LedPattern *slot = nullptr;
+  for (auto &p : patterns) {
+    if (p.toggles && p.pin == pin) slot = &p;
+    else if (!slot && !p.toggles) slot = &p;
+  }
+  if (!slot) return;
+  slot->pin = pin;
+  slot->toggles = toggles;
+  slot->ms = ms;
+  slot->next = millis() + ms;
+  digitalWrite(pin, HIGH);
+}
+
+void ledPulse(uint8_t pin, uint16_t ms) { start(pin, 1, ms); }
+
+void ledBlink(uint8_t pin, uint8_t times, uint16_t ms) { start(pin, times * 2 - 1, ms); }
+
+void ledService() {
+  uint32_t now = millis();
+  for (auto &p : patterns) {
+    if (!p.toggles || (int32_t)(now - p.next) < 0) continue;
+    p.toggles--;
+    digitalWrite(p.pin, (p.toggles & 1) ? HIGH : LOW);
+    p.next = now + p.ms;
+  }
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+// Non-blocking LED patterns, advanced by ledService() on the IR task.
+void ledPulse(uint8_t pin, uint16_t ms);
+void ledBlink(uint8_t pin, uint8_t times, uint16_t ms);
+void ledService();
@@ -0,0 +1,253 @@
+#include "library_frame.h"
+
+#include <string.h>
+
+static bool readName(const uint8_t *&p, const uint8_t *end,
+                     const char *&name, uint8_t &nameLen) {
+  if (p >= end || end - p < 1 + *p) return false;
+  nameLen = *p++;
+  name = (const char *)p;
+  p += nameLen;
+  return true;
+}
+
+bool readLibraryRecord(const uint8_t *&p, const uint8_t *end, LibraryRecord &rec) {
+  uint32_t blobLen;
+  IrCodecHeader hdr;
+  if (!readName(p, end, rec.name, rec.nameLen) ||
+      !irReadVarint(p, end, blobLen) || (uint32_t)(end - p) < blobLen ||
+      !irReadHeader(p, blobLen, hdr)) {
+    return false;
+  }
+  rec.blob = p;
+  rec.blobLen = blobLen;
+  rec.format = hdr.version;
+  rec.pulses = hdr.count;
+  p += blobLen;
+  return true;
+}
+
+LibraryReader::LibraryReader(const uint8_t *data, size_t len)
+    : p(data), end(data + len) {
+  if (len > 0 && *p == kLibraryLz) {
+    p++;
+    if (!irReadVarint(p, end, left) || !lz.begin(p, end - p)) return;
+    streamed = true;
+  }
+  uint8_t format, hash[4];
+  ok = pull(&format, 1) && format == kLibraryVersion && pullVarint(libVersion) &&
+       pull(hash, 4) && pullVarint(total);
+  libHash = hash[0] | (hash[1] << 8) | (hash[2] << 16) | ((uint32_t)hash[3] << 24);
+}
+
+bool LibraryReader::pull(uint8_t *out, size_t n) {
+  if (streamed) {
+    if (n > left || lz.read(out, n) != n) return false;
+    left -= n;
+    return true;
+  }
+  if ((size_t)(end - p) < n) return false;
+  memcpy(out, p, n);
+  p += n;
+  return true;
+}
+
+bool LibraryReader::pullVarint(uint32_t &v) {
+  v = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    uint8_t b;
+    if (!pull(&b, 1)) return false;
+    v |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+bool LibraryReader::nextStreamed(LibraryRecord &rec) {
+  uint8_t nameLen;
+  uint32_t blobLen;
+  IrCodecHeader hdr;
+  if (!pull(&nameLen, 1)) return false;
+  record.resize(nameLen);
+  if (!pull(record.data(), nameLen) || !pullVarint(blobLen) || blobLen > left) return false;
+  record.resize(nameLen + blobLen);
+  if (!pull(record.data() + nameLen, blobLen) ||
+      !irReadHeader(record.data() + nameLen, blobLen, hdr)) {
+    return false;
+  }
+  rec.name = (const char *)record.data();
+  rec.nameLen = nameLen;
+  rec.blob = record.data() + nameLen;
+  rec.blobLen = blobLen;
+  rec.format = hdr.version;
+  rec.pulses = hdr.count;
+  return true;
+}
+
+bool LibraryReader::next(LibraryRecord &rec) {
+  if (!ok || p == nullptr || seen >= total) return false;
+  if (streamed ? !nextStreamed(rec) : !readLibraryRecord(p, end, rec)) {
+    p = nullptr;
+    return false;
+  }
+  seen++;
+  return true;
+}
+
+bool LibraryReader::validate(const uint8_t *data, size_t len, uint32_t *pulses) {
+  LibraryReader reader(data, len);
+  LibraryRecord rec;
+  uint32_t sum = 0;
+  while (reader.next(rec)) sum += rec.pulses;
+  if (pulses) *pulses = sum;
+  return !reader.failed();
+}
+
+void LibraryStream::begin(size_t len) {
+  *this = LibraryStream();
+  left = len;
+}
+
+void LibraryStream::feed(const uint8_t *data, size_t len) {
+  in = data;
+  inEnd = data + len;
+  if (streamed) {
+    lz.feed(data, len);
+    return;
+  }
+  if (prefix || bad || len == 0) return;
+  // The compressed prefix is a few bytes, so the first piece holds it.
+  prefix = true;
+  if (*in != kLibraryLz) return;
+  const uint8_t *p = in + 1;
+  uint32_t size;
+  if (!irReadVarint(p, inEnd, size) || !lz.begin(p, inEnd - p)) {
+    bad = true;
+    return;
+  }
+  streamed = true;
+  left = size;
+  in = inEnd;
+}
+
+// Moves snapshot bytes into buf until it holds n past `used`. False when
+// the piece ran out first, or the snapshot is shorter than that.
+bool LibraryStream::need(size_t n) {
+  size_t have = buf.size() - used;
+  if (have >= n) return true;
+  if (n - have > left) {
+    bad = true;
+    return false;
+  }
+  size_t want = n - have, got;
+  size_t at = buf.size();
+  buf.resize(at + want);
+  if (streamed) {
+    got = lz.read(buf.data() + at, want);
+    if (lz.failed()) bad = true;
+  } else {
+    got = want < (size_t)(inEnd - in) ? want : inEnd - in;
+    memcpy(buf.data() + at, in, got);
+    in += got;
+  }
+  buf.resize(at + got);
+  left -= got;
+  return got == want;
+}
+
+// Reads the varint at buf[at]; false while more bytes are needed for it,
+// or when it is malformed.
+bool LibraryStream::needVarint(size_t &at, uint32_t &v) {
+  for (size_t n = 1; n <= kIrVarintMax; n++) {
+    if (!need(at + n)) return false;
+    const uint8_t *p = buf.data() + at;
+    if (irReadVarint(p, p + n, v)) {
+      at += n;
+      return true;
+    }
+  }
+  bad = true;
+  return false;
+}
+
+bool LibraryStream::readHeader() {
+  // u8 format, varint version, u32 hash, varint count
+  size_t at = 1;
+  if (!need(1)) return false;
+  if (buf[0] != kLibraryVersion) {
+    bad = true;
+    return false;
+  }
+  if (!needVarint(at, libVersion) || !need(at + 4)) return false;
+  const uint8_t *p = buf.data() + at;
+  libHash = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  at += 4;
+  if (!needVarint(at, total)) return false;
+  used = at;
+  header = true;
+  return true;
+}
+
+bool LibraryStream::next(LibraryRecord &rec) {
+  if (!prefix || bad || done()) return false;
+  if (!header && !readHeader()) return false;
+  // Drop what the caller already has before the buffer moves.
+  buf.erase(buf.begin(), buf.begin() + used);
+  used = 0;
+  if (done()) return false;
+
+  // The name and blob length come first; they tell how long the rest is.
+  if (!need(1)) return false;
+  size_t at = 1 + buf[0];
+  uint32_t blobLen;
+  if (!needVarint(at, blobLen)) return false;
+  if (blobLen > kLibraryRecordMax) {
+    bad = true;
+    return false;
+  }
+  size_t size = at + blobLen;
+  if (!need(size)) return false;
+  const uint8_t *p = buf.data();
+  if (!readLibraryRecord(p, p + size, rec)) {
+    bad = true;
+    return false;
+  }
+  used = size;
+  seen++;
+  return true;
+}
+
+bool readLibraryDelta(const uint8_t *data, size_t len, LibraryDelta &delta) {
+  const uint8_t *p = data, *end = data + len;
+  if (len < 2 || *p++ != kLibraryVersion) return false;
+  delta.op = *p++;
+  if (!irReadVarint(p, end, delta.version)) return false;
+  delta.rec.name = delta.newName = "";
+  delta.rec.nameLen = delta.newNameLen = 0;
+
+  switch (delta.op) {
+    case kOpUpsert:
+      return readLibraryRecord(p, end, delta.rec);
+    case kOpDelete:
+      return readName(p, end, delta.rec.name, delta.rec.nameLen);
+    case kOpRename:
+      return readName(p, end, delta.rec.name, delta.rec.nameLen) &&
+             readName(p, end, delta.newName, delta.newNameLen);
+    case kOpErase:
+      return true;
+  }
+  return false;
+}
+
+uint32_t libraryEntryHash(const char *name, size_t nameLen,
+                          const uint16_t *timings, size_t n) {
+  uint32_t h = 2166136261u;
+  auto mix = [&h](uint8_t b) { h = (h ^ b) * 16777619u; };
+  for (size_t i = 0; i < nameLen; i++) mix(name[i]);
+  mix(0);
+  for (size_t i = 0; i < n; i++) {
+    mix(timings[i] & 0xFF);
+    mix(timings[i] >> 8);
+  }
+  return h;
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ir_codec.h"
+#include "lz.h"
+
+// Library snapshot (home/ac/dev/<device>/library):
+//   u8      kLibraryVersion
+//   varint  library version
+//   u32     content hash, little-endian, see libraryEntryHash()
+//   varint  record count
+//   records
+//
+// Compressed snapshot, sent instead to devices that accept "lz":
+//   u8      kLibraryLz
+//   varint  snapshot length
+//   the snapshot above as an LZSS stream, see lz.h
+//
+// Library delta (home/ac/lib/<library>/delta), moves the library from
+// version - 1 to version:
+//   u8      kLibraryVersion
+//   u8      op
+//   varint  library version
+//   upsert: record
+//   delete: u8 name_len, name
+//   rename: u8 old_len, old name, u8 new_len, new name
+//   erase:  nothing
+const uint8_t kLibraryLz = 0x80 | kLibraryVersion;
+
+enum LibraryOp : uint8_t {
+  kOpUpsert = 'U',
+  kOpDelete = 'D',
+  kOpRename = 'R',
+  kOpErase  = 'E',
+};
+
+// One record of a save message or library snapshot. Name and blob point
+// into the payload buffer, nothing is copied.
+struct LibraryRecord {
+  const char    *name;
+  uint8_t        nameLen;
+  const uint8_t *blob;
+  size_t         blobLen;
+  uint8_t        format;  // Blob version, see ir_codec.h
+  uint32_t       pulses;  // Words the blob decodes to
+};
+
+struct LibraryDelta {
+  uint8_t       op;
+  uint32_t      version;
+  LibraryRecord rec;      // upsert, or the name for delete/rename
+  const char   *newName;  // rename only
+  uint8_t       newNameLen;
+};
+
+// Walks the records of a library snapshot in place. A compressed one is
+// decoded as it is walked, a record at a time, so records point into a
+// buffer the next call reuses.
+class LibraryReader {
+public:
+  LibraryReader(const uint8_t *data, size_t len);
+
+  bool valid() const { return ok; }
+  uint32_t version() const { return libVersion; }
+  uint32_t hash() const { return libHash; }
+  uint32_t count() const { return total; }
+
+  // False at the end of the snapshot or on a malformed record; check
+  // failed() to tell the two apart.
+  bool next(LibraryRecord &rec);
+  bool failed() const { return !ok || (seen < total && p == nullptr); }
+
+  // Checks every record without decoding the timings.
+  static bool validate(const uint8_t *data, size_t len, uint32_t *pulses = nullptr);
+
+  bool compressed() const { return streamed; }
+
+private:
+  bool pull(uint8_t *out, size_t n);
+  bool pullVarint(uint32_t &v);
+  bool nextStreamed(LibraryRecord &rec);
+
+  const uint8_t       *p;
+  const uint8_t       *end;
+  uint32_t             libVersion = 0;
+  uint32_t             libHash = 0;
+  uint32_t             total = 0;
+  uint32_t             seen = 0;
+  bool                 ok = false;
+  bool                 streamed = false;
+  uint32_t             left = 0;  // Snapshot bytes still in the stream
+  LzDecoder            lz;
+  std::vector<uint8_t> record;    // The current record, when streamed
+};
+
+// Longest record a LibraryStream holds. It bounds the memory a snapshot
+// in parts takes, whatever the number of records.
+const size_t kLibraryRecordMax = 8192;
+
+// Walks a library snapshot, whole or compressed, that arrives in pieces
+// split anywhere. Only the record being read and a compressed snapshot's
+// window are held, so records point into a buffer the next call reuses.
+class LibraryStream {
+public:
+  // Starts over for a snapshot of `len` bytes as sent.
+  void begin(size_t len);
+
+  // Hands over the next piece. It is used up, and can go, once next()
+  // returned false.
+  void feed(const uint8_t *data, size_t len);
+
+  // False once the piece is used up, at the end of the snapshot or on a
+  // malformed one; check done() and failed().
+  bool next(LibraryRecord &rec);
+  bool done() const { return header && seen == total; }
+  bool failed() const { return bad; }
+
+  // Valid once the header came in.
+  bool started() const { return header; }
+  uint32_t version() const { return libVersion; }
+  uint32_t hash() const { return libHash; }
+  uint32_t count() const { return total; }
+  bool compressed() const { return streamed; }
+
+private:
+  bool need(size_t n);
+  bool needVarint(size_t &at, uint32_t &v);
+  bool readHeader();
+
+  const uint8_t       *in = nullptr;
+  const uint8_t       *inEnd = nullptr;
+  size_t               left = 0;      // Snapshot bytes not yet in buf
+  bool                 prefix = false;  // Compressed prefix read, or none
+  bool                 streamed = false;
+  bool                 header = false;
+  bool                 bad = false;
+  uint32_t             libVersion = 0;
+  uint32_t             libHash = 0;
+  uint32_t             total = 0;
+  uint32_t             seen = 0;
+  LzDecoder            lz;
+  std::vector<uint8_t> buf;
+  size_t               used = 0;      // Bytes of buf already walked
+};
+
+bool readLibraryRecord(const uint8_t *&p, const uint8_t *end, LibraryRecord &rec);
+bool readLibraryDelta(const uint8_t *data, size_t len, LibraryDelta &delta);
+
+// FNV-1a over the name, a zero byte and the timings as little-endian u16.
+// The library hash is the wrapping sum of all entry hashes, so it can be
+// kept current while deltas are applied.
+uint32_t libraryEntryHash(const char *name, size_t nameLen,
+                          const uint16_t *timings, size_t n);
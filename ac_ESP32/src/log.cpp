@@ -0,0 +1,73 @@
+#include "log.h"
+
+#include <Arduino.h>
+#include <atomic>
+#include <stdarg.h>
+
+static const size_t kLogLineMax = 160;
+
+static char ring[kLogRingBytes];
+static std::atomic<uint32_t> head(0);  // Written by logWrite()
+static std::atomic<uint32_t> tail(0);  // Written by logDrain()
+static std::atomic<uint32_t> dropped(0);
+
+static bool push(const char *line, size_t len) {
+  uint32_t h = head.load(std::memory_order_relaxed);
+  uint32_t t = tail.load(std::memory_order_acquire);
+  if (kLogRingBytes - (h - t) < len) return false;
+  for (size_t i = 0; i < len; i++) ring[(h + i) & (kLogRingBytes - 1)] = line[i];
+  head.store(h + len, std::memory_order_release);
+  return true;
+}
+
+void logWrite(const char *fmt, ...) {
+  char line[kLogLineMax];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+  if (n < 0) return;
+  if ((size_t)n >= sizeof(line)) n = sizeof(line) - 1;  // Truncated
+  if (!push(line, n)) dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+void logDump(const char *label, const uint8_t *data, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) h = (h ^ data[i]) * 16777619u;
+  char hex[kLogDumpBytes * 2 + 1];
+  size_t shown = len < kLogDumpBytes ? len : kLogDumpBytes;
+  for (size_t i = 0; i < shown; i++) snprintf(hex + 2 * i, 3, "%02x", data[i]);
+  hex[2 * shown] = '\0';
+  logWrite("[DUMP] %s: %u bytes, fnv %08x, %s%s\n", label, (unsigned)len, h, hex,
+           shown < len ? "..." : "");
+}
+
+void logDrain() {
+  uint32_t t = tail.load(std::memory_order_relaxed);
+  uint32_t h = head.load(std::memory_order_acquire);
+  int room = Serial.availableForWrite();
+  while (t != h && room > 0) {
+    // Up to the end of the ring or the free FIFO space, whichever is first
+    size_t start = t & (kLogRingBytes - 1);
+    size_t n = h - t;
+    if (n > kLogRingBytes - start) n = kLogRingBytes - start;
+    if (n > (size_t)room) n = room;
+    Serial.write((const uint8_t *)ring + start, n);
+    t += n;
+    room -= n;
+  }
+  tail.store(t, std::memory_order_release);
+
+  uint32_t lost = dropped.load(std::memory_order_relaxed);
+  if (lost && t == h) {
+    dropped.fetch_sub(lost, std::memory_order_relaxed);
+    logWrite("[LOG] %u lines dropped\n", lost);
+  }
+}
+
+void logFlush() {
+  while (tail.load(std::memory_order_relaxed) != head.load(std::memory_order_acquire)) {
+    logDrain();
+    delay(1);
+  }
+}
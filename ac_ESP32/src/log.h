@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#ifndef kLogRingBytes
+#define kLogRingBytes 4096  // Power of two
+#endif
+
+#ifndef kLogDumpBytes
+#define kLogDumpBytes 16  // Leading payload bytes shown by LOG_DUMP
+#endif
+
+// Log lines are formatted into a ring buffer and written to Serial by
+// logDrain(), which the network task calls once per pass and which never
+// waits on the UART. A full ring drops lines and says how many once it
+// has room again. Levels above LOG_LEVEL expand to nothing, so their
+// arguments are not even evaluated.
+//
+// The ring has one producer and one consumer; log from the network task.
+void logWrite(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Length, FNV-1a and the first kLogDumpBytes bytes in hex.
+void logDump(const char *label, const uint8_t *data, size_t len);
+
+// Writes out as much as the UART takes without blocking.
+void logDrain();
+// Blocks until everything is written, for use before a restart.
+void logFlush();
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_E(...) logWrite(__VA_ARGS__)
+#else
+#define LOG_E(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_W(...) logWrite(__VA_ARGS__)
+#else
+#define LOG_W(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_I(...) logWrite(__VA_ARGS__)
+#else
+#define LOG_I(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_D(...) logWrite(__VA_ARGS__)
+#define LOG_DUMP(label, data, len) logDump(label, data, len)
+#else
+#define LOG_D(...) do {} while (0)
+#define LOG_DUMP(label, data, len) do {} while (0)
+#endif
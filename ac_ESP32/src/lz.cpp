@@ -0,0 +1,59 @@
+#include "lz.h"
+
+bool LzDecoder::begin(const uint8_t *data, size_t len) {
+  p = data;
+  end = data + len;
+  pos = 0;
+  items = copyLeft = 0;
+  split = bad = false;
+  window.resize(kLzWindow);
+  return window.size() == kLzWindow;
+}
+
+void LzDecoder::feed(const uint8_t *data, size_t len) {
+  p = data;
+  end = data + len;
+}
+
+void LzDecoder::put(uint8_t b) {
+  window[pos++ & (kLzWindow - 1)] = b;
+}
+
+size_t LzDecoder::read(uint8_t *out, size_t n) {
+  size_t done = 0;
+  while (done < n && !bad) {
+    if (copyLeft) {
+      uint8_t b = window[(pos - distance) & (kLzWindow - 1)];
+      put(b);
+      out[done++] = b;
+      copyLeft--;
+      continue;
+    }
+    if (p >= end) break;
+    if (!items) {
+      flags = *p++;
+      items = 8;
+      continue;
+    }
+    bool match = flags & 1;
+    if (match && !split && end - p < 2) {
+      low = *p++;  // The rest of the token comes with the next piece
+      split = true;
+      break;
+    }
+    flags >>= 1;
+    items--;
+    if (!match) {
+      put(*p);
+      out[done++] = *p++;
+      continue;
+    }
+    uint16_t token = split ? low | (p[0] << 8) : p[0] | (p[1] << 8);
+    p += split ? 1 : 2;
+    split = false;
+    distance = (token & (kLzWindow - 1)) + 1;
+    copyLeft = (token >> 10) + kLzMinMatch;
+    if (distance > pos) bad = true;  // Reaches before the start
+  }
+  return done;
+}
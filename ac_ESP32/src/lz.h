@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// LZSS with a fixed window, for compressed library snapshots. The stream
+// is groups of a flag byte and up to eight items, flag bit i (low bit
+// first) telling item i apart:
+//
+//   0: literal   u8
+//   1: match     u16 little-endian, low 10 bits distance - 1, high 6
+//                bits length - kLzMinMatch; copies from that far back
+//                in the output, overlapping copies repeat
+//
+// Decoding keeps only the last kLzWindow output bytes, so it needs that
+// much memory however long the stream is. The stream may be handed over
+// in pieces split anywhere, see feed().
+const size_t   kLzWindow   = 1024;
+const uint8_t  kLzMinMatch = 3;
+const uint8_t  kLzMaxMatch = kLzMinMatch + 63;
+
+class LzDecoder {
+public:
+  // Allocates the window; false if that failed.
+  bool begin(const uint8_t *data, size_t len);
+
+  // Continues the stream with the next piece once read() has used up the
+  // last one.
+  void feed(const uint8_t *data, size_t len);
+
+  // Fills up to n bytes, fewer only at the end of the input or on a
+  // malformed stream; check failed() to tell the two apart.
+  size_t read(uint8_t *out, size_t n);
+  bool failed() const { return bad; }
+
+private:
+  void put(uint8_t b);
+
+  const uint8_t       *p = nullptr;
+  const uint8_t       *end = nullptr;
+  std::vector<uint8_t> window;
+  size_t               pos = 0;      // Bytes output so far
+  uint8_t              flags = 0;
+  uint8_t              items = 0;    // Items left in the current group
+  uint16_t             copyLeft = 0; // Bytes still to copy from the match
+  uint16_t             distance = 0;
+  uint8_t              low = 0;      // First byte of a match split across pieces
+  bool                 split = false;
+  bool                 bad = false;
+};
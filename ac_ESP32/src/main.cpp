@@ -6,14 +6,107 @@
 #include <IRremoteESP8266.h>
 #include <IRrecv.h>
 #include <IRsend.h>
+#include <IRutils.h>
 #include <Arduino.h>
 #include <ArduinoJson.h>
 #include <Preferences.h>
 #include <WiFiManager.h>
-#include <map>
+#include "ac_state.h"
+#include "buttons.h"
+#include "command_cache.h"
+#include "command_store.h"
+#include "ir_codec.h"
+#include "learn_pipeline.h"
+#include "led.h"
+#include "library_frame.h"
+#include "log.h"
+#include "metrics.h"
+#include "send_queue.h"
+#include "spsc_queue.h"
+#include "topics.h"
 
-#ifndef kRawTick
-#define kRawTick 50  // microseconds per raw tick
+#ifndef kIrCarrierKhz
+#define kIrCarrierKhz 38  // Carrier of raw sends
+#endif
+
+#ifndef kLearnTickUs
+#define kLearnTickUs 50  // Codec tick learned timings are stored in
+#endif
+
+#ifndef kLearnTimeoutMs
+#define kLearnTimeoutMs 20000
+#endif
+
+#ifndef kLearnCaptures
+#define kLearnCaptures 3  // Raw presses voted into one command
+#endif
+
+#ifndef kLearnRawBuf
+#define kLearnRawBuf 2048  // Receiver entries, allocated only while learning
+#endif
+
+#ifndef kLearnGapMs
+#define kLearnGapMs 90  // Silence that ends a capture; AC frames pause less in between
+#endif
+
+#ifndef kSaveChunkBytes
+#define kSaveChunkBytes 1024  // Save messages above this go out in parts
+#endif
+
+#ifndef kButtonLearnMs
+#define kButtonLearnMs 2000  // Holding a button longer learns instead of sending
+#endif
+
+#ifndef kDualCore
+#ifdef ARDUINO_ARCH_ESP32
+#define kDualCore 1  // Network task on core 0, IR engine in loop() on core 1
+#else
+#define kDualCore 0  // loop() runs both sides in turn
+#endif
+#endif
+
+#ifndef kNetTaskStack
+#define kNetTaskStack 8192
+#endif
+
+#ifndef kWifiFastMs
+#define kWifiFastMs 1500  // Join with the cached BSSID and lease, then scan
+#endif
+
+#ifndef kWifiTimeoutMs
+#define kWifiTimeoutMs 20000  // Reboot when the first link takes longer
+#endif
+
+#ifndef kMqttBackoffMinMs
+#define kMqttBackoffMinMs 250  // Broker retry delay, doubled per failure
+#endif
+
+#ifndef kMqttBackoffMaxMs
+#define kMqttBackoffMaxMs 30000
+#endif
+
+#ifndef kMqttSocketTimeoutS
+#define kMqttSocketTimeoutS 2  // Wait for CONNACK, down from the library's 15 s
+#endif
+
+#ifndef kMqttProbeMs
+#define kMqttProbeMs 1000  // Wait for the ping echo before re-subscribing
+#endif
+
+#ifndef kStaleRequestMs
+#define kStaleRequestMs 30000  // Outage after which queued requests are dropped
+#endif
+
+#ifndef kResyncMinMs
+#define kResyncMinMs 5000  // Wait before asking again for a snapshot that failed to load
+#endif
+
+#ifndef kResyncMaxMs
+#define kResyncMaxMs 600000
+#endif
+
+#ifndef kFetchTimeoutMs
+#define kFetchTimeoutMs 3000  // Wait for an evicted command before failing its step
 #endif
 
 Preferences prefs;
@@ -29,6 +122,7 @@ Preferences prefs;
 
 const int buttonPins[2] = { BTN_ON, BTN_PLAY };
 const int ledPins[2]    = { LED_ON, LED_PLAY };
+const char *const buttonNames[2] = { "on", "play" };
 
 const char* mqtt_server = "192.168.29.142";
 const int   mqtt_port   = 1883;
@@ -37,95 +131,313 @@ const char* mqtt_pass   = "@hema.";
 
 WiFiClient espClient;
 PubSubClient client(espClient);
-IRrecv irrecv(RECV_PIN);
 IRsend irsend(IR_SEND_PIN);
 decode_results results;
 
-unsigned long pressStart[2] = {0, 0};
-bool firstConnect = true;
-std::map<String, std::vector<uint16_t>> commandMap;
+CommandLibrary commandLibrary;
+SendQueue sendQueue;
+uint32_t libraryVersion = 0;
+uint32_t libraryHash = 0;
+uint32_t batchReceivedUs[kSendQueueBatches];  // micros() each batch arrived at
+
+// The network task (MQTT, JSON, the send queue, the library and learning)
+// and the IR task (transmitter, receiver, buttons and LEDs) share nothing
+// but commandLibrary and these two queues. Jobs are resolved before they
+// cross: a frame job points into the library copy it pinned, which the
+// IR task unpins once the frame is out. Only the network task logs and
+// records metrics.
+enum IrJobKind : uint8_t { kJobFrame, kJobAcState, kJobLed };
+
+struct IrJob {
+  IrJobKind      kind;
+  uint8_t        slot;   // kJobFrame: pinned library copy
+  CommandView    cmd;    // kJobFrame
+  stdAc::state_t ac;     // kJobAcState
+  uint8_t        pin;    // kJobLed
+  uint8_t        times;  // kJobLed: blinks, 0 for one pulse
+  uint16_t       ms;     // kJobLed
+};
+
+// Learned captures are copied off the receiver buffer by the IR task and
+// owned by whoever pops the event.
+struct IrCapture {
+  std::vector<uint32_t> timings;  // Raw microseconds, when the receiver could not decode it
+  std::vector<uint8_t>  blob;     // kIrProtocolVersion, when it could
+  stdAc::state_t        profile;
+  bool                  hasProfile;
+  decode_type_t         protocol;
+  uint16_t              bits;
+  uint16_t              rawlen;
+  bool                  truncated;  // Filled the receive buffer
+};
+
+enum IrEventKind : uint8_t { kEventSent, kEventButton, kEventCapture };
+
+// Why a short press sent nothing.
+enum IrFail : uint8_t {
+  kFailNone,
+  kFailNotFound,  // Not in the store, or only its name (evicted)
+  kFailTransmit,
+  kFailLearning,  // The receiver was armed
+};
+
+struct IrEvent {
+  IrEventKind kind;
+  bool        ok;          // kEventSent, and kEventButton for short presses
+  IrFail      fail;        // kEventButton, when not ok
+  uint8_t     button;      // kEventButton
+  uint32_t    heldMs;      // kEventButton
+  uint32_t    endMs;       // kEventSent: when the frame finished
+  uint32_t    transmitUs;  // kEventSent
+  IrCapture  *capture;     // kEventCapture
+};
+
+const size_t kIrEventSlots = 16;
+SpscQueue<IrJob, 8> irJobs;
+SpscQueue<IrEvent, kIrEventSlots> irEvents;
+std::atomic<bool> irLearning(false);  // Set by the network task
+// Flash writes stall the cache of both cores, and with it a frame being
+// timed on the IR task, so the two never overlap; see flashBegin().
+std::atomic<bool> irSending(false);     // IR task, from irClaim() to the frame's end
+std::atomic<bool> flashWriting(false);  // Network task
 
 void setup_wifi();
+void wifiStart(bool fast);
+void saveWifiLink();
+void loadIdentity();
+void netConnect();
+bool connectMqtt(bool subscribe);
+void subscribeAll();
+void sendProbe();
 void mqttCallback(char* topic, byte* payload, unsigned int length);
 void sendStatus(const String &msg);
 void requestCommandList();
-void handleAvailableCommands(const String &msg);
-void sendIR(const String &name);
+void scheduleResync();
+void handleAvailableCommands(const byte *payload, unsigned int len);
+void handleLibraryPart(const byte *payload, unsigned int len);
+void handleLibraryDelta(const byte *payload, unsigned int len);
+void handleFetchedCommand(const byte *payload, unsigned int len);
+bool fetchCommand(const char *name);
+bool applyLibraryDelta(CommandStore &store, const LibraryDelta &delta, uint32_t &hash);
+void replayLibraryDelta(const uint8_t *payload, size_t len);
+void loadCommandCache();
+void queueSend(JsonObjectConst req, uint32_t receivedUs);
+bool dispatchIR(const char *name, bool fetched = false);
+void serviceSendQueue();
+void publishMetrics();
 void learnIR(int index, const String &name);
-void handleButtons();
-void blinkFeedback(int times, int ms);
+void handleCapture(IrCapture &cap);
+void serviceLearn();
+void finishLearn();
+void publishLearned(const String &name, const std::vector<uint8_t> &blob, uint8_t confidence);
+void handleButton(const IrEvent &ev);
+void drainIrEvents();
+void netTask(void *arg);
+void netService();
+bool irService();
+void trackLoopTime(uint32_t us);
 void resetWiFi();
 
+// Last good association, so a boot can skip the scan and DHCP.
+struct WifiLink {
+  uint8_t  bssid[6];
+  uint8_t  channel;
+  uint32_t ip, gateway, subnet, dns;
+};
+
+// Connection state of the network task, see netConnect().
+struct NetLink {
+  bool          wifiUp = false;
+  bool          wifiFast = false;    // Association uses the cached link
+  bool          everLinked = false;
+  uint32_t      wifiStartUs = 0;
+  bool          mqttUp = false;
+  bool          everReady = false;
+  uint32_t      downUs = 0;          // When the broker was lost
+  unsigned long retryAt = 0;
+  uint32_t      backoffMs = kMqttBackoffMinMs;
+  uint32_t      probe = 0;           // Ping token awaiting its echo, 0 for none
+  unsigned long probeAt = 0;
+  bool          dropQueued = false;  // Requests before the echo are stale
+} net;
+
+// A step naming an evicted command stays out, as far as the send queue
+// is concerned, until the backend answers its fetch or kFetchTimeoutMs.
+struct FetchState {
+  bool          active = false;
+  char          name[kSendNameMax];
+  unsigned long at = 0;
+  uint32_t      startUs = 0;
+} fetch;
+
+// A library request put off after a snapshot failed to load, see
+// scheduleResync().
+struct LibraryResync {
+  bool          pending = false;
+  unsigned long at = 0;
+  uint32_t      backoffMs = kResyncMinMs;
+  uint32_t      tooLarge = 0;  // Version reported as not fitting the store
+} resync;
+
+// Learning runs as a state machine on the network task, fed captures by
+// the IR task, so MQTT keeps flowing while we wait for the remote.
+struct LearnSession {
+  bool          active = false;
+  String        name;
+  unsigned long start = 0;
+  std::vector<std::vector<uint32_t>> captures;
+} learnSession;
+
+// Snapshots that do not fit MQTT_MAX_PACKET_SIZE come in parts, in the
+// layout of save/part messages. Each part is loaded into the spare copy
+// as it arrives, so only the record split across two parts is held.
+struct LibraryParts {
+  uint32_t       transfer = 0;
+  uint32_t       total = 0;
+  uint32_t       received = 0;
+  CommandStore  *store = nullptr;  // Spare being loaded, null when none
+  uint32_t       hash = 0;
+  uint32_t       pulses = 0;
+  bool           full = false;
+  LibraryStream  stream;
+} libraryParts;
+
 void setup() {
   Serial.begin(9600);
-  Serial.println("[SETUP] Starting up...");
+  LOG_I("[SETUP] Starting up...\n");
 
   pinMode(LED_PIN, OUTPUT);
   pinMode(BTN_ON, INPUT_PULLUP);
   pinMode(LED_ON, OUTPUT);
   pinMode(BTN_PLAY, INPUT_PULLUP);
   pinMode(LED_PLAY, OUTPUT);
+  buttonsBegin(buttonPins, 2);
 
-  irrecv.enableIRIn();
   irsend.begin();
+  acBegin(IR_SEND_PIN);
+  if (!commandLibrary.begin()) LOG_E("[ERROR] Command store allocation failed\n");
+  loadCommandCache();
 
   setup_wifi();
+  loadIdentity();
 
+  // The network task connects once the link is up.
   client.setServer(mqtt_server, mqtt_port);
-  client.setBufferSize(2048);  // Set dynamically
+  client.setBufferSize(MQTT_MAX_PACKET_SIZE);  // Larger snapshots arrive in parts
+  client.setSocketTimeout(kMqttSocketTimeoutS);
 
   client.setCallback(mqttCallback);
 
-  Serial.printf("[MQTT] Connecting to %s:%d… ", mqtt_server, mqtt_port);
-  if (client.connect("esp32Client", mqtt_user, mqtt_pass)) {
-    Serial.println("OK");
-    client.subscribe("home/ac/send");
-    client.subscribe("home/ac/available_cmds");
-    client.subscribe("home/ac/erase_all");
-    client.subscribe("home/ac/reset_wifi");
+#if kDualCore
+  // Core 0 already runs the Wi-Fi stack; loop() stays on core 1.
+  xTaskCreatePinnedToCore(netTask, "net", kNetTaskStack, nullptr, 1, nullptr, 0);
+#endif
+}
 
-    sendStatus("ESP32 Ready");
-    requestCommandList();
-  } else {
-    Serial.printf("FAILED, rc=%d\n", client.state());
+void loop() {
+#if kDualCore
+  if (!irService()) delay(1);
+#else
+  netService();
+  irService();
+#endif
+}
+
+#if kDualCore
+void netTask(void *) {
+  for (;;) {
+    netService();
+    delay(1);
   }
 }
+#endif
 
-void loop() {
-  if (!client.connected()) {
-    Serial.println("[MQTT] Disconnected! Reconnecting…");
-    if (client.connect("esp32Client", mqtt_user, mqtt_pass)) {
-      Serial.println("[MQTT] Reconnected");
-      client.subscribe("home/ac/send");
-      client.subscribe("home/ac/available_cmds");
-      client.subscribe("home/ac/erase_all");
-      client.subscribe("home/ac/reset_wifi");
-      sendStatus("Reconnected");
-      if (firstConnect) {
-        requestCommandList();
-        firstConnect = false;
-      }
-    } else {
-      Serial.printf("[MQTT] Reconnect failed, rc=%d\n", client.state());
-      delay(2000);
-    }
+void netService() {
+  uint32_t loopStart = micros();
+  static bool started = false;
+  if (!started) {
+    LOG_I("[BOOT] Buttons live after %lu ms\n", millis());
+    started = true;
   }
 
+  netConnect();
+
+  uint32_t mqttStart = micros();
   client.loop();
-  handleButtons();
+  metricsRecord(kStageMqtt, micros() - mqttStart);
+  drainIrEvents();
+  serviceSendQueue();
+  serviceLearn();
+  logDrain();
+  trackLoopTime(micros() - loopStart);
+}
+
+// Waits for the IR task to let go of the spare library copy, which takes
+// at most the frame it is sending.
+// Drops a snapshot half loaded from parts; the library is asked for
+// again later.
+static void dropLibraryParts() {
+  if (!libraryParts.store) return;
+  libraryParts.store = nullptr;
+  libraryParts.stream = LibraryStream();
+  scheduleResync();
+}
+
+// The spare is where a snapshot in parts loads, so editing it for
+// anything else ends that load.
+static CommandStore &editLibrary(bool seed = true) {
+  dropLibraryParts();
+  CommandStore *store;
+  while (!(store = commandLibrary.edit(seed))) {
+#if !kDualCore
+    irService();
+#endif
+    delay(1);
+  }
+  return *store;
+}
+
+void trackLoopTime(uint32_t us) {
+  static uint32_t worstUs = 0;
+  static unsigned long reportAt = 0;
+  static unsigned long heapAt = 0;
+  static unsigned long metricsAt = 0;
+  metricsRecord(kStageLoop, us);
+  if (millis() - heapAt >= 1000) {
+    metricsHeap(ESP.getFreeHeap(), ESP.getMaxAllocHeap());
+    heapAt = millis();
+  }
+  if (millis() - metricsAt >= kMetricsPeriodMs) {
+    publishMetrics();
+    metricsAt = millis();
+  }
+  if (us > worstUs) worstUs = us;
+  if (millis() - reportAt >= 10000) {
+    LOG_I("[LOOP] Worst iteration %u us\n", worstUs);
+    worstUs = 0;
+    reportAt = millis();
+  }
 }
 
 void setup_wifi() {
-  Serial.println("[WIFI] Checking stored credentials…");
+  LOG_I("[WIFI] Checking stored credentials…\n");
   prefs.begin("wifi", true);
   bool configured = prefs.getBool("configured", false);
   prefs.end();
 
   if (!configured) {
-    Serial.println("[WIFI] Starting config portal");
+    LOG_I("[WIFI] Starting config portal\n");
+    // The portal also names the device and assigns its library, prefilled
+    // with what the device uses now.
+    loadIdentity();
     WiFiManager wm;
+    WiFiManagerParameter deviceParam("device", "Device name", topicDevice(), kDeviceIdMax);
+    WiFiManagerParameter libraryParam("library", "Command library", topicLibrary(), kDeviceIdMax);
+    wm.addParameter(&deviceParam);
+    wm.addParameter(&libraryParam);
     if (!wm.startConfigPortal("ESP32-Setup")) {
-      Serial.println("[WIFI] Config portal failed, rebooting");
+      LOG_I("[WIFI] Config portal failed, rebooting\n");
+      logFlush();
       ESP.restart();
     }
     prefs.begin("wifi", false);
@@ -133,162 +445,1069 @@ void setup_wifi() {
     prefs.putString("pass", WiFi.psk());
     prefs.putBool("configured", true);
     prefs.end();
-    Serial.println("[WIFI] Credentials saved, rebooting");
+    prefs.begin("device", false);
+    prefs.putString("name", deviceParam.getValue());
+    prefs.putString("library", libraryParam.getValue());
+    prefs.end();
+    LOG_I("[WIFI] Credentials saved, rebooting\n");
+    logFlush();
     ESP.restart();
   }
 
+  WiFi.persistent(false);  // Credentials live in prefs; spare the SDK's flash writes
+  WiFi.mode(WIFI_STA);
+  wifiStart(true);
+}
+
+// Starts association and returns; netConnect() polls for the link. With
+// a cached link the scan and DHCP are skipped: the radio goes straight to
+// the last access point and the last lease is reused as a static address.
+void wifiStart(bool fast) {
   prefs.begin("wifi", true);
   String ssid = prefs.getString("ssid", "");
   String pass = prefs.getString("pass", "");
+  WifiLink link;
+  net.wifiFast = fast && prefs.getBytes("link", &link, sizeof(link)) == sizeof(link);
   prefs.end();
 
-  Serial.printf("[WIFI] Connecting to SSID: %s\n", ssid.c_str());
-  WiFi.begin(ssid.c_str(), pass.c_str());
+  net.wifiStartUs = micros();
+  if (net.wifiFast) {
+    LOG_I("[WIFI] Joining %s on channel %u\n", ssid.c_str(), link.channel);
+    WiFi.config(IPAddress(link.ip), IPAddress(link.gateway), IPAddress(link.subnet), IPAddress(link.dns));
+    WiFi.begin(ssid.c_str(), pass.c_str(), link.channel, link.bssid);
+  } else {
+    LOG_I("[WIFI] Connecting to SSID: %s\n", ssid.c_str());
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);  // DHCP
+    WiFi.begin(ssid.c_str(), pass.c_str());
+  }
+}
+
+// Written only when the access point or lease changed.
+void saveWifiLink() {
+  WifiLink link, saved;
+  memset(&link, 0, sizeof(link));
+  memcpy(link.bssid, WiFi.BSSID(), sizeof(link.bssid));
+  link.channel = WiFi.channel();
+  link.ip = WiFi.localIP();
+  link.gateway = WiFi.gatewayIP();
+  link.subnet = WiFi.subnetMask();
+  link.dns = WiFi.dnsIP();
+  prefs.begin("wifi", false);
+  if (prefs.getBytes("link", &saved, sizeof(saved)) != sizeof(saved) ||
+      memcmp(&saved, &link, sizeof(link)) != 0) {
+    prefs.putBytes("link", &link, sizeof(link));
+  }
+  prefs.end();
+}
 
-  unsigned long start = millis();
-  while (WiFi.status() != WL_CONNECTED) {
-    if (millis() - start > 20000) {
-      Serial.println("[ERROR] WiFi Disconnected during publish!");
-      Serial.println("[WIFI] Timeout, rebooting");
+// Brings the link and the broker up from the network task. Nothing waits
+// for the link, but a broker connect attempt still blocks the task: for
+// the core's TCP connect timeout (3 s), then up to kMqttSocketTimeoutS
+// for the CONNACK. A failed one is retried after an exponential backoff
+// with jitter, so a fleet that lost the broker does not return in step.
+// The session is persistent: subscriptions survive a reconnect and the
+// broker queues requests meanwhile. A ping to ourselves confirms the
+// session; everything that arrives before its echo was queued, and is
+// dropped when the outage was too long for it to still be wanted.
+void netConnect() {
+  if (WiFi.status() != WL_CONNECTED) {
+    if (net.wifiUp) {
+      LOG_W("[WIFI] Link lost\n");
+      net.wifiUp = false;
+      net.wifiStartUs = micros();
+    }
+    if (net.mqttUp) {
+      net.mqttUp = false;
+      net.downUs = micros();
+    }
+    uint32_t waitedMs = (micros() - net.wifiStartUs) / 1000;
+    if (net.wifiFast && waitedMs >= kWifiFastMs) {
+      LOG_W("[WIFI] Cached link failed after %u ms, scanning\n", waitedMs);
+      WiFi.disconnect();
+      wifiStart(false);
+    } else if (!net.everLinked && millis() >= kWifiTimeoutMs) {
+      LOG_E("[WIFI] No link after %lu ms, rebooting\n", millis());
+      logFlush();
       ESP.restart();
     }
-    Serial.print(".");
-    delay(500);
+    return;
+  }
+
+  if (!net.wifiUp) {
+    uint32_t us = micros() - net.wifiStartUs;
+    metricsRecord(kStageWifi, us);
+    LOG_I("[WIFI] Connected in %u ms%s, IP: %s\n", us / 1000, net.wifiFast ? " (cached)" : "",
+          WiFi.localIP().toString().c_str());
+    net.wifiUp = true;
+    net.wifiFast = false;  // Drops are left to the driver's own reconnect
+    net.everLinked = true;
+    net.retryAt = millis();
+    saveWifiLink();
+  }
+
+  if (client.connected()) {
+    net.mqttUp = true;  // Survived a short Wi-Fi drop
+    if (net.probe && millis() - net.probeAt >= kMqttProbeMs) {
+      LOG_W("[MQTT] No session on the broker, subscribing again\n");
+      metricsCount(kCountSessionLost);
+      net.dropQueued = false;
+      subscribeAll();
+      sendProbe();
+      requestCommandList();  // Library deltas were lost with the session
+    }
+    if (resync.pending && (long)(millis() - resync.at) >= 0) {
+      resync.pending = false;
+      requestCommandList();
+    }
+    return;
+  }
+  if (net.mqttUp) {
+    LOG_I("[MQTT] Disconnected! Reconnecting…\n");
+    net.mqttUp = false;
+    net.downUs = micros();
+  }
+  if ((long)(millis() - net.retryAt) < 0) return;
+
+  uint32_t connectStart = micros();
+  if (!connectMqtt(!net.everReady)) {
+    uint32_t delayMs = net.backoffMs / 2 + random(net.backoffMs / 2 + 1);
+    LOG_W("[MQTT] Connect failed, rc=%d, retry in %u ms\n", client.state(), delayMs);
+    net.retryAt = millis() + delayMs;
+    net.backoffMs = std::min<uint32_t>(net.backoffMs * 2, kMqttBackoffMaxMs);
+    return;
+  }
+  net.mqttUp = true;
+  net.backoffMs = kMqttBackoffMinMs;
+
+  if (!net.everReady) {
+    net.everReady = true;
+    metricsRecord(kStageReady, micros());
+    LOG_I("[BOOT] Ready for commands after %lu ms, broker %lu ms\n", millis(),
+          (unsigned long)((micros() - connectStart) / 1000));
+    net.dropQueued = true;  // Queued before this boot
+    sendProbe();
+    sendStatus("ESP32 Ready");
+    requestCommandList();
+  } else {
+    uint32_t downUs = micros() - net.downUs;
+    metricsCount(kCountReconnects);
+    metricsRecord(kStageReconnect, downUs);
+    LOG_I("[MQTT] Reconnected after %u ms down\n", downUs / 1000);
+    net.dropQueued = downUs / 1000 >= kStaleRequestMs;
+    sendProbe();
+    sendStatus("Reconnected");
   }
-  Serial.printf("\n[WIFI] Connected! IP: %s\n", WiFi.localIP().toString().c_str());
+}
+
+// Names come from the config portal and live in their own namespace, so
+// a Wi-Fi reset keeps them. A missing or unusable device name falls back
+// to one derived from the MAC.
+void loadIdentity() {
+  prefs.begin("device", true);
+  String device = prefs.getString("name", "");
+  String library = prefs.getString("library", "");
+  prefs.end();
+
+  char fallback[16];
+  if (!topicNameValid(device.c_str())) {
+    uint8_t mac[6];
+    WiFi.macAddress(mac);
+    topicDefaultDevice(mac, fallback, sizeof(fallback));
+    device = fallback;
+  }
+  if (!topicNameValid(library.c_str())) library = "default";
+  topicsBegin(device.c_str(), library.c_str());
+  LOG_I("[SETUP] Device %s, library %s\n", device.c_str(), library.c_str());
 }
 
 void mqttCallback(char* topic, byte* payload, unsigned int len) {
-  String msg;
-  for (unsigned int i = 0; i < len; i++) msg += (char)payload[i];
-  Serial.printf("[MQTT] ← %s : %s\n", topic, msg.c_str());
-
-  if (strcmp(topic, "home/ac/send") == 0) {
-    DynamicJsonDocument req(2048);
-    if (deserializeJson(req, msg) == DeserializationError::Ok) {
-      sendIR(req["name"].as<String>());
+  uint32_t receivedUs = micros();
+  metricsCount(kCountReceived);
+  LOG_DUMP(topic, payload, len);
+
+  Topic t = topicMatch(topic);
+  if (net.dropQueued && (t == kTopicSend || t == kTopicState)) {
+    metricsCount(kCountStale);
+    return;
+  }
+
+  switch (t) {
+  case kTopicPing: {
+    char token[9];
+    snprintf(token, sizeof(token), "%08x", net.probe);
+    if (net.probe && len == 8 && memcmp(payload, token, 8) == 0) {
+      net.probe = 0;
+      net.dropQueued = false;
+    }
+    break;
+  }
+  case kTopicLibrary:
+    handleAvailableCommands(payload, len);
+    break;
+  case kTopicLibraryPart:
+    handleLibraryPart(payload, len);
+    break;
+  case kTopicDelta:
+    handleLibraryDelta(payload, len);
+    break;
+  case kTopicCommand:
+    handleFetchedCommand(payload, len);
+    break;
+  case kTopicSend: {
+    StaticJsonDocument<1024> req;
+    if (deserializeJson(req, (char*)payload, len) == DeserializationError::Ok) {
+      queueSend(req.as<JsonObjectConst>(), receivedUs);
+      metricsRecord(kStageParse, micros() - receivedUs);
+    } else {
+      metricsCount(kCountDropped);
     }
-  } else if (strcmp(topic, "home/ac/available_cmds") == 0) {
-    handleAvailableCommands(msg);
-  } else if (strcmp(topic, "home/ac/erase_all") == 0) {
-    commandMap.clear();
-    sendStatus("Erase all requested");
-  } else if (strcmp(topic, "home/ac/reset_wifi") == 0) {
+    break;
+  }
+  case kTopicState: {
+    StaticJsonDocument<256> req;
+    if (deserializeJson(req, (char*)payload, len) == DeserializationError::Ok &&
+        acApply(req.as<JsonObjectConst>())) {
+      int batch = sendQueue.beginBatch("ac_state");
+      if (batch >= 0) batchReceivedUs[batch] = receivedUs;
+      if (!sendQueue.add(batch, kAcStateStep)) metricsCount(kCountDropped);
+      sendQueue.endBatch(batch);
+    } else {
+      sendStatus("Error: No AC protocol for state request");
+    }
+    break;
+  }
+  case kTopicResetWifi:
     resetWiFi();
+    break;
+  case kTopicMetricsGet:
+    publishMetrics();
+    break;
+  default:
+    break;
   }
 }
 
+// The device name is the MQTT client ID too, so devices sharing a broker
+// no longer take each other's session. The will marks the device offline
+// for the app.
+bool connectMqtt(bool subscribe) {
+  if (!client.connect(topicDevice(), mqtt_user, mqtt_pass, topicFor(kTopicStatus), 1, true,
+                      "Offline", false)) {
+    return false;
+  }
+  if (subscribe) subscribeAll();
+  return true;
+}
+
+// QoS 1, so the broker queues what arrives while we are away.
+void subscribeAll() {
+  for (uint8_t t = 0; t < kTopicSubscribed; t++) client.subscribe(topicFor((Topic)t), 1);
+}
+
+void sendProbe() {
+  char token[9];
+  do {
+    net.probe = random(0x7fffffff);
+  } while (!net.probe);
+  net.probeAt = millis();
+  snprintf(token, sizeof(token), "%08x", net.probe);
+  client.publish(topicFor(kTopicPing), token);
+}
+
 void sendStatus(const String &msg) {
-  Serial.printf("[STATUS] %s\n", msg.c_str());
-  client.publish("home/ac/status", msg.c_str());
+  LOG_I("[STATUS] %s\n", msg.c_str());
+  // Retained, so an app that connects later still finds the device.
+  if (!client.publish(topicFor(kTopicStatus), msg.c_str(), true)) metricsCount(kCountPublishFailed);
 }
 
 void requestCommandList() {
-  Serial.println("[REQUEST] Asking for available_cmds");
-  client.publish("home/ac/list", "");
+  // The backend skips the snapshot when version and hash already match.
+  // "accept" lists the snapshot encodings we decode besides the plain one.
+  char req[80 + kDeviceIdMax];
+  snprintf(req, sizeof(req),
+           "{\"version\":%u,\"hash\":%u,\"library\":\"%s\",\"accept\":\"lz\"}",
+           libraryVersion, libraryHash, topicLibrary());
+  LOG_I("[REQUEST] Asking for library %s, have v%u\n", topicLibrary(), libraryVersion);
+  client.publish(topicFor(kTopicList), req);
+}
+
+static void logCacheWrite() {
+  // Flash bytes per received byte is the cache's write amplification.
+  CacheStats cs = cacheStats();
+  LOG_I("[CACHE] %u bytes flashed for %u received, log %u bytes\n",
+                cs.flashBytes, cs.logicalBytes, cs.logBytes);
+}
+
+// Waits out a frame being sent and keeps the next one from starting
+// until flashEnd().
+static void flashBegin() {
+  flashWriting.store(true);
+  while (irSending.load()) delay(1);
+}
+
+static void flashEnd() { flashWriting.store(false); }
+
+// Counts what editing the spare copy evicted, then makes it live.
+static void publishLibrary(const CommandStore &store) {
+  uint16_t evicted = store.stats().evicted;
+  if (evicted) metricsCount(kCountEvicted, evicted);
+  commandLibrary.publish();
+}
+
+// Adds one snapshot record to the spare and its hash to `hash`; false
+// once the store is full. Commands keep their uses across the reload, so
+// the store evicts the same cold ones it would have before.
+static bool loadRecord(CommandStore &store, const LibraryRecord &rec, uint32_t &hash) {
+  uint16_t *timings = store.put(rec.name, rec.nameLen, rec.pulses, rec.format);
+  if (!timings) return false;
+  if (!irDecode(rec.blob, rec.blobLen, timings, rec.pulses)) {
+    LOG_E("[ERROR] Bad timings for %.*s\n", rec.nameLen, rec.name);
+    store.remove(rec.name, rec.nameLen);
+    return true;
+  }
+  hash += store.seal(rec.name, rec.nameLen, &commandLibrary.live());
+  return true;
 }
 
-void handleAvailableCommands(const String &msg) {
-  Serial.println("[MQTT] ← available_cmds : " + msg);
-  DynamicJsonDocument doc(8192);
-  DeserializationError err = deserializeJson(doc, msg);
-  if (err) {
-    Serial.println("[ERROR] Invalid available_cmds JSON");
+// A library the store cannot hold, past kStoreMaxCommands or with names
+// alone filling the arena, fails the same way on every try. It is
+// reported once per version and not asked for again; a later delta or
+// reconnect still asks, and may find it smaller.
+static void libraryTooLarge(uint32_t version, uint32_t commands) {
+  resync.pending = false;
+  if (resync.tooLarge == version) return;
+  resync.tooLarge = version;
+  LOG_E("[ERROR] Library v%u of %u commands does not fit the store\n", version, commands);
+  sendStatus("Error: Library too large (" + String(commands) + " commands)");
+}
+
+// Makes a loaded snapshot live. Anything short of the backend's library
+// stays off the live copy and out of the cache; the spare is reseeded by
+// the next edit.
+static void finishLoad(CommandStore &store, uint32_t version, uint32_t want, uint32_t hash,
+                       size_t len, uint32_t pulses, bool compressed) {
+  if (hash != want) {
+    LOG_E("[ERROR] Library hash mismatch %08x != %08x\n", hash, want);
+    scheduleResync();
     return;
   }
-  commandMap.clear();
-  for (auto kv : doc.as<JsonObject>()) {
-    String name = kv.key().c_str();
-    JsonArray arr = kv.value().as<JsonArray>();
-    std::vector<uint16_t> timings;
-    for (auto v : arr) timings.push_back((uint16_t)v.as<uint32_t>());
-    commandMap[name] = timings;
+  resync = LibraryResync();
+  libraryVersion = version;
+  libraryHash = hash;
+  // cacheSave() compacts, so it runs before the copy goes live.
+  flashBegin();
+  bool cached = cacheSave(store, libraryVersion, libraryHash, len);
+  flashEnd();
+  if (!cached) LOG_E("[ERROR] Could not cache library\n");
+  publishLibrary(store);
+  logCacheWrite();
+
+  CommandStoreStats st = store.stats();
+  LOG_I("[LIBRARY] Loaded v%u: %u commands, %u pulses from %u bytes%s\n",
+                libraryVersion, st.commands, pulses, (unsigned)len, compressed ? " (lz)" : "");
+  LOG_I("[STORE] %u/%u bytes, %u%% fragmented, timings of %u/%u commands\n",
+                (unsigned)st.usedBytes, (unsigned)st.arenaBytes, st.fragmentation, st.resident,
+                st.commands);
+}
+
+void handleAvailableCommands(const byte *payload, unsigned int len) {
+  // Check the whole snapshot first so a truncated message never wipes the
+  // commands we already have.
+  uint32_t pulses;
+  if (!LibraryReader::validate(payload, len, &pulses)) {
+    LOG_E("[ERROR] Invalid library snapshot\n");
+    return;
+  }
+
+  CommandStore &store = editLibrary(false);
+  uint32_t hash = 0;
+  bool full = false;
+  LibraryReader reader(payload, len);
+  LibraryRecord rec;
+  while (!full && reader.next(rec)) full = !loadRecord(store, rec, hash);
+  if (full) {
+    libraryTooLarge(reader.version(), reader.count());
+    return;
   }
+  finishLoad(store, reader.version(), reader.hash(), hash, len, pulses, reader.compressed());
 }
 
-void sendIR(const String &name) {
-  Serial.printf("[IR SEND] %s\n", name.c_str());
-  auto it = commandMap.find(name);
-  if (it == commandMap.end()) {
-    Serial.println("[ERROR] Command not found: " + name);
+// The same snapshot keeps failing when the library outgrows the store, so
+// the retries back off rather than loop with the backend.
+void scheduleResync() {
+  resync.pending = true;
+  resync.at = millis() + resync.backoffMs;
+  LOG_W("[LIBRARY] Keeping v%u, asking again in %u ms\n", libraryVersion, resync.backoffMs);
+  resync.backoffMs = std::min<uint32_t>(resync.backoffMs * 2, kResyncMaxMs);
+}
+
+void handleLibraryPart(const byte *payload, unsigned int len) {
+  const uint8_t *p = payload, *end = payload + len;
+  uint32_t transfer, offset, total;
+  if (len < 1 || *p++ != kLibraryVersion || !irReadVarint(p, end, transfer) ||
+      !irReadVarint(p, end, offset) || !irReadVarint(p, end, total)) {
+    LOG_E("[ERROR] Invalid library part\n");
+    return;
+  }
+  LibraryParts &parts = libraryParts;
+  if (offset == 0) {
+    CommandStore &store = editLibrary(false);  // Ends a load still going
+    parts.transfer = transfer;
+    parts.total = total;
+    parts.received = 0;
+    parts.store = &store;
+    parts.hash = 0;
+    parts.pulses = 0;
+    parts.full = false;
+    parts.stream.begin(total);
+  } else if (!parts.store && transfer == parts.transfer) {
+    return;  // Rest of a transfer already dropped
+  }
+  if (!parts.store || transfer != parts.transfer || offset != parts.received ||
+      (size_t)(end - p) > parts.total - offset) {
+    // A part went missing, so the rest of this transfer is useless.
+    LOG_W("[LIBRARY] Part at %lu out of order\n", (unsigned long)offset);
+    parts.transfer = transfer;
+    dropLibraryParts();
+    return;
+  }
+  parts.received += end - p;
+  parts.stream.feed(p, end - p);
+  LibraryRecord rec;
+  while (!parts.full && parts.stream.next(rec)) {
+    parts.pulses += rec.pulses;
+    parts.full = !loadRecord(*parts.store, rec, parts.hash);
+  }
+  if (parts.full) {
+    parts.store = nullptr;  // Its other parts are dropped above
+    libraryTooLarge(parts.stream.version(), parts.stream.count());
+    parts.stream = LibraryStream();
+    return;
+  }
+  if (parts.stream.failed() || (parts.received == parts.total && !parts.stream.done())) {
+    LOG_E("[ERROR] Invalid library snapshot\n");
+    dropLibraryParts();
     return;
   }
-  irsend.sendRaw(it->second.data(), it->second.size(), kRawTick);
-  sendStatus("Sent " + name);
+  if (parts.received < parts.total) return;
+
+  CommandStore &store = *parts.store;
+  LibraryStream &s = parts.stream;
+  parts.store = nullptr;
+  finishLoad(store, s.version(), s.hash(), parts.hash, parts.total, parts.pulses,
+             s.compressed());
+  s = LibraryStream();
 }
 
-void learnIR(int index, const String &name) {
-  Serial.printf("[LEARN] Button %d → %s\n", index, name.c_str());
-  while (irrecv.decode(&results)) irrecv.resume();
-  blinkFeedback(5, 75);
-  sendStatus("Learning " + name);
+void handleLibraryDelta(const byte *payload, unsigned int len) {
+  LibraryDelta delta;
+  if (!readLibraryDelta(payload, len, delta)) {
+    LOG_E("[ERROR] Invalid library delta\n");
+    return;
+  }
+  if (delta.version <= libraryVersion) return;  // Already applied
+  const LibraryStream &loading = libraryParts.stream;
+  if (libraryParts.store && loading.started() && delta.version <= loading.version()) {
+    return;  // The snapshot coming in parts has it
+  }
+  CommandStore *store = nullptr;
+  uint32_t hash = libraryHash;
+  if (delta.version == libraryVersion + 1) store = &editLibrary();
+  if (!store || !applyLibraryDelta(*store, delta, hash)) {
+    LOG_W("[LIBRARY] Cannot apply v%u on v%u, resyncing\n", delta.version, libraryVersion);
+    requestCommandList();
+    return;
+  }
+  libraryVersion = delta.version;
+  libraryHash = hash;
+  LOG_I("[LIBRARY] Applied '%c' %.*s -> v%u\n",
+                delta.op, delta.rec.nameLen, delta.rec.name, libraryVersion);
+
+  flashBegin();
+  bool cached = cacheNeedsCompaction()
+                  ? cacheSave(*store, libraryVersion, libraryHash, len)
+                  : cacheAppend(payload, len);
+  flashEnd();
+  publishLibrary(*store);
+  if (!cached) LOG_E("[ERROR] Could not cache library delta\n");
+  logCacheWrite();
+}
 
-  unsigned long start = millis();
-  while (millis() - start < 20000) {
-    if (irrecv.decode(&results)) {
-      Serial.printf("[LEARN] Captured rawlen=%u\n", results.rawlen);
-
-      DynamicJsonDocument doc(8192);
-      doc["name"] = name;
-      JsonArray timings = doc.createNestedArray("timings");
-      for (size_t i = 0; i < results.rawlen; i++) {
-        uint16_t d = results.rawbuf[i] * kRawTick;
-        if (d > 50 && d < 20000) timings.add(d);
+// Applies `delta` to `store` and keeps `hash` in step. A failed upsert
+// leaves the store half-edited, so callers drop it rather than publish.
+bool applyLibraryDelta(CommandStore &store, const LibraryDelta &delta, uint32_t &hash) {
+  const LibraryRecord &rec = delta.rec;
+  switch (delta.op) {
+    case kOpUpsert: {
+      hash -= store.hashOf(rec.name, rec.nameLen);
+      uint16_t *timings = store.put(rec.name, rec.nameLen, rec.pulses, rec.format);
+      if (!timings || !irDecode(rec.blob, rec.blobLen, timings, rec.pulses)) {
+        LOG_E("[ERROR] Could not store %.*s\n", rec.nameLen, rec.name);
+        store.remove(rec.name, rec.nameLen);
+        return false;
       }
+      hash += store.seal(rec.name, rec.nameLen);
+      break;
+    }
+    case kOpDelete:
+      hash -= store.hashOf(rec.name, rec.nameLen);
+      store.remove(rec.name, rec.nameLen);
+      break;
+    case kOpRename: {
+      if (!store.known(rec.name, rec.nameLen)) break;
+      uint32_t before = store.hashOf(rec.name, rec.nameLen) +
+                        store.hashOf(delta.newName, delta.newNameLen);
+      // An evicted command cannot be rehashed under its new name; the
+      // snapshot the caller falls back to can.
+      if (!store.rename(rec.name, rec.nameLen, delta.newName, delta.newNameLen)) return false;
+      hash += store.hashOf(rec.name, rec.nameLen) +
+              store.hashOf(delta.newName, delta.newNameLen) - before;
+      break;
+    }
+    case kOpErase:
+      store.reset();
+      hash = 0;
+      break;
+  }
+  return true;
+}
 
-      char buffer[4096];
-      size_t len = serializeJson(doc, buffer, sizeof(buffer));
-      Serial.printf("[DEBUG] Final payload size: %u bytes\n", len);
-      Serial.printf("[MEM] Free heap before publish: %u\n", ESP.getFreeHeap());
+static CommandStore *bootStore = nullptr;  // Target of replayLibraryDelta()
 
-      bool ok = client.publish("home/ac/save", (uint8_t*)buffer, len, false);
-      Serial.printf("[DEBUG] publish() returned: %d\n", ok);
-      if (!ok) Serial.println("[ERROR] MQTT publish failed!");
+void replayLibraryDelta(const uint8_t *payload, size_t len) {
+  LibraryDelta delta;
+  if (readLibraryDelta(payload, len, delta) && delta.version == libraryVersion + 1 &&
+      applyLibraryDelta(*bootStore, delta, libraryHash)) {
+    libraryVersion = delta.version;
+  }
+}
 
-      client.loop();
-      sendStatus("Learned " + name);
-      irrecv.resume();
-      return;
+void loadCommandCache() {
+  // Runs before Wi-Fi so buttons work off the last known library; the
+  // backend reconciles it through requestCommandList() once MQTT is up.
+  if (!cacheBegin()) {
+    LOG_E("[ERROR] SPIFFS mount failed\n");
+    return;
+  }
+  bootStore = &editLibrary(false);
+  if (cacheLoad(*bootStore, libraryVersion, libraryHash)) {
+    cacheReplay(replayLibraryDelta);
+  }
+  publishLibrary(*bootStore);
+  CacheStats cs = cacheStats();
+  LOG_I("[BOOT] %u cached commands (v%u, log %u bytes) ready after %lu ms\n",
+                commandLibrary.live().size(), libraryVersion, cs.logBytes, millis());
+}
+
+// {"name": "on"} sends one command. A batch runs its steps in order:
+// {"id": "cool24", "steps": [{"name": "on"}, {"name": "mode_cool", "group": "mode"},
+//                            {"name": "temp_24", "group": "temp", "delay": 300, "repeat": 2}]}
+// A step's "delay" or "repeat": `def` when absent, UINT32_MAX, which
+// SendQueue::add() rejects, when not a whole number it can hold.
+static uint32_t stepNumber(JsonVariantConst v, uint32_t def) {
+  if (v.isNull()) return def;
+  double n = v | -1.0;
+  return n >= 0 && n < UINT32_MAX && n == (uint32_t)n ? (uint32_t)n : UINT32_MAX;
+}
+
+void queueSend(JsonObjectConst req, uint32_t receivedUs) {
+  const char *tag = req["id"] | (const char*)nullptr;
+  if (!tag) tag = req["name"] | "send";
+  int batch = sendQueue.beginBatch(tag);
+  if (batch < 0) {
+    metricsCount(kCountDropped);
+    sendStatus("Error: Send queue busy");
+    return;
+  }
+  batchReceivedUs[batch] = receivedUs;
+
+  JsonArrayConst steps = req["steps"];
+  if (steps.isNull()) {
+    if (!sendQueue.add(batch, req["name"] | "")) metricsCount(kCountDropped);
+  } else {
+    for (JsonObjectConst step : steps) {
+      if (!sendQueue.add(batch, step["name"] | "", stepNumber(step["delay"], 0),
+                         stepNumber(step["repeat"], 1), step["group"] | "")) {
+        metricsCount(kCountDropped);
+      }
     }
   }
+  sendQueue.endBatch(batch);
+}
 
-  sendStatus("Error: Timeout");
+static bool transmitCommand(const CommandView &cmd) {
+  if (cmd.format == kIrProtocolVersion) return acSendProtocol(irsend, cmd.timings, cmd.count);
+  if (cmd.format == kIrRepeatVersion) {
+    // Word 0 is the repeat count, the frame ends with its gap which the
+    // last copy leaves out, every piece of it when it was split at
+    // kLearnSplitUs
+    const uint16_t *frame = cmd.timings + 1;
+    uint16_t n = cmd.count - 1;
+    uint16_t last = n - 1;
+    while (last >= 2 && frame[last - 1] == 0 && frame[last - 2] == kLearnSplitUs) last -= 2;
+    for (uint16_t i = 1; i < cmd.timings[0]; i++) irsend.sendRaw(frame, n, kIrCarrierKhz);
+    irsend.sendRaw(frame, last, kIrCarrierKhz);
+    return true;
+  }
+  irsend.sendRaw(cmd.timings, cmd.count, kIrCarrierKhz);
+  return true;
 }
 
-void handleButtons() {
-  const String names[2] = { "on", "play" };
-  for (int i = 0; i < 2; i++) {
-    int raw = digitalRead(buttonPins[i]);
-    bool pressed = (raw == LOW);
-    unsigned long now = millis();
+// Resolves a due step and hands it to the IR task, or fetches it when
+// the store evicted it; false when there is nothing to send. `fetched`
+// is set for the retry once the fetch answered, already counted a miss.
+bool dispatchIR(const char *name, bool fetched) {
+  IrJob job = {};
+  if (strcmp(name, kAcStateStep) == 0) {
+    job.kind = kJobAcState;
+    if (!acNextState(job.ac)) return false;
+  } else {
+    uint32_t start = micros();
+    job.kind = kJobFrame;
+    size_t nameLen = strlen(name);
+    const CommandStore &store = commandLibrary.pin(job.slot);
+    bool found = store.find(name, nameLen, job.cmd);
+    bool known = found || store.known(name, nameLen);
+    if (found) store.touch(name, nameLen);
+    metricsRecord(kStageLookup, micros() - start);
+    if (!found) {
+      commandLibrary.unpin(job.slot);
+      if (known && !fetched) return fetchCommand(name);
+      metricsCount(kCountUnknown);
+      LOG_E("[ERROR] Command not found: %s\n", name);
+      return false;
+    }
+    if (!fetched) metricsCount(kCountCacheHit);
+    LOG_D("[IR SEND] %s\n", name);
+  }
+  if (irJobs.push(job)) return true;
+  if (job.kind == kJobFrame) commandLibrary.unpin(job.slot);
+  return false;
+}
 
-    if (pressed && pressStart[i] == 0) {
-      pressStart[i] = now;
-      Serial.printf("[DEBUG] Btn %d DOWN at %lums\n", i, now);
-    } else if (!pressed && pressStart[i] != 0) {
-      unsigned long dt = now - pressStart[i];
-      Serial.printf("[DEBUG] Btn %d UP after %lums\n", i, dt);
-      pressStart[i] = 0;
+// Asks the backend for one evicted command. The step's frame counts as
+// out until handleFetchedCommand() sends it or the fetch times out.
+bool fetchCommand(const char *name) {
+  char req[48 + kSendNameMax + kDeviceIdMax];
+  snprintf(req, sizeof(req), "{\"name\":\"%s\",\"library\":\"%s\"}", name, topicLibrary());
+  if (!client.publish(topicFor(kTopicFetch), req)) {
+    metricsCount(kCountPublishFailed);
+    return false;
+  }
+  metricsCount(kCountCacheMiss);
+  LOG_D("[FETCH] %s\n", name);
+  snprintf(fetch.name, sizeof(fetch.name), "%s", name);
+  fetch.active = true;
+  fetch.at = millis();
+  fetch.startUs = micros();
+  return true;
+}
+
+// The reply is an upsert at the library version we have, or a delete
+// when the backend no longer knows the name. The timings must hash to
+// what the store kept for the evicted command.
+void handleFetchedCommand(const byte *payload, unsigned int len) {
+  LibraryDelta reply;
+  if (!fetch.active || !readLibraryDelta(payload, len, reply) ||
+      reply.rec.nameLen != strlen(fetch.name) ||
+      memcmp(reply.rec.name, fetch.name, reply.rec.nameLen) != 0) {
+    return;  // Late answer to a fetch that timed out
+  }
+  fetch.active = false;
+  metricsRecord(kStageFetch, micros() - fetch.startUs);
+
+  const LibraryRecord &rec = reply.rec;
+  bool stored = false;
+  if (reply.op == kOpUpsert && reply.version == libraryVersion) {
+    CommandStore &store = editLibrary();
+    uint32_t want = store.hashOf(rec.name, rec.nameLen);
+    uint16_t *timings = store.put(rec.name, rec.nameLen, rec.pulses, rec.format);
+    stored = timings && irDecode(rec.blob, rec.blobLen, timings, rec.pulses) &&
+             store.seal(rec.name, rec.nameLen) == want;
+    if (stored) publishLibrary(store);
+  }
+  if (stored && dispatchIR(fetch.name, true)) return;
+  if (!stored) {
+    LOG_W("[FETCH] No v%u timings for %s, resyncing\n", libraryVersion, fetch.name);
+    requestCommandList();
+  }
+  sendQueue.complete(false, millis());
+}
+
+void serviceSendQueue() {
+  if (fetch.active && millis() - fetch.at >= kFetchTimeoutMs) {
+    fetch.active = false;
+    LOG_W("[FETCH] No reply for %s\n", fetch.name);
+    sendQueue.complete(false, millis());
+  }
+
+  // The IR task reports the frame through kEventSent, see drainIrEvents().
+  const char *name = sendQueue.due(millis());
+  if (name && !dispatchIR(name)) sendQueue.complete(false, millis());
+
+  SendBatchResult done;
+  while (sendQueue.pollCompleted(done)) {
+    if (done.sent) metricsRecord(kStageEndToEnd, micros() - batchReceivedUs[done.id]);
+    if (done.steps == 1 && done.sent == 1) {
+      sendStatus(String("Sent ") + done.tag);
+    } else {
+      char msg[128];
+      snprintf(msg, sizeof(msg), "Sent %s: %u/%u (%u failed, %u superseded)",
+               done.tag, done.sent, done.steps, done.failed, done.superseded);
+      sendStatus(msg);
+    }
+  }
+}
 
-      if (dt > 2000) {
-        learnIR(i, names[i]);
-      } else {
-        digitalWrite(ledPins[i], HIGH);
-        sendIR(names[i]);
-        delay(200);
-        digitalWrite(ledPins[i], LOW);
+void drainIrEvents() {
+  IrEvent ev;
+  while (irEvents.pop(ev)) {
+    switch (ev.kind) {
+      case kEventSent:
+        metricsRecord(kStageTransmit, ev.transmitUs);
+        sendQueue.complete(ev.ok, ev.endMs);
+        break;
+      case kEventButton:
+        handleButton(ev);
+        break;
+      case kEventCapture:
+        handleCapture(*ev.capture);
+        delete ev.capture;
+        break;
+    }
+  }
+}
+
+static void irLed(uint8_t pin, uint8_t times, uint16_t ms) {
+  IrJob job = {};
+  job.kind = kJobLed;
+  job.pin = pin;
+  job.times = times;
+  job.ms = ms;
+  irJobs.push(job);
+}
+
+void publishMetrics() {
+  std::vector<uint8_t> report;
+  metricsEncode(millis() / 1000, report);
+  if (!client.publish(topicFor(kTopicMetrics), report.data(), report.size(), false)) {
+    metricsCount(kCountPublishFailed);
+  }
+}
+
+void learnIR(int index, const String &name) {
+  LOG_I("[LEARN] Button %d → %s\n", index, name.c_str());
+  irLed(LED_PIN, 5, 75);
+  sendStatus("Learning " + name);
+  learnSession.active = true;
+  learnSession.name = name;
+  learnSession.start = millis();
+  learnSession.captures.clear();
+  irLearning.store(true);
+}
+
+void handleCapture(IrCapture &cap) {
+  if (!learnSession.active) return;
+  LOG_I("[LEARN] Captured rawlen=%u\n", cap.rawlen);
+  // The rest of the frame is missing, and every press would end the same.
+  if (cap.truncated) {
+    LOG_W("[LEARN] Capture filled all %u receiver entries\n", cap.rawlen);
+    learnSession.active = false;
+    irLearning.store(false);
+    sendStatus("Error: Capture truncated at " + String(cap.rawlen) + " pulses");
+    return;
+  }
+  // Prefer protocol + state when the library decoded the frame; raw
+  // timings are only kept for remotes it does not know.
+  if (!cap.blob.empty()) {
+    LOG_I("[LEARN] Decoded %s, %u bits\n", typeToString(cap.protocol).c_str(), cap.bits);
+    if (cap.hasProfile) acLearnProfile(cap.profile);
+    learnSession.active = false;
+    irLearning.store(false);
+    publishLearned(learnSession.name, cap.blob, 100);
+    return;
+  }
+
+  learnSession.captures.push_back(std::move(cap.timings));
+  irLed(LED_PIN, 0, 100);
+  if (learnSession.captures.size() >= kLearnCaptures) {
+    finishLearn();
+  } else {
+    sendStatus("Learning " + learnSession.name + ": press again (" +
+               learnSession.captures.size() + "/" + kLearnCaptures + ")");
+  }
+}
+
+void serviceLearn() {
+  if (!learnSession.active || millis() - learnSession.start <= kLearnTimeoutMs) return;
+  if (learnSession.captures.empty()) {
+    sendStatus("Error: Timeout");
+    learnSession.active = false;
+    irLearning.store(false);
+  } else {
+    finishLearn();
+  }
+}
+
+void finishLearn() {
+  learnSession.active = false;
+  irLearning.store(false);
+  LearnResult learned;
+  if (!learnConsensus(learnSession.captures, learned)) {
+    sendStatus("Error: Capture too short");
+    return;
+  }
+
+  std::vector<uint8_t> blob;
+  irEncode(learned.frame.data(), learned.frame.size(), kLearnTickUs, blob, learned.repeat);
+  LOG_I("[LEARN] %u/%u captures agree, %u widths, frame %u x%u, confidence %u%%\n",
+                learned.agreeing, (unsigned)learnSession.captures.size(), learned.widths,
+                (unsigned)learned.frame.size(), learned.repeat, learned.confidence);
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+  std::vector<uint16_t> first;
+  std::vector<uint8_t> single;
+  for (uint32_t us : learnSession.captures[0]) learnAppendWidth(first, us);
+  irEncode(first.data(), first.size(), kLearnTickUs, single);
+  LOG_D("[LEARN] Stored %u bytes, first capture alone %u bytes\n",
+                (unsigned)blob.size(), (unsigned)single.size());
+#endif
+  learnSession.captures.clear();
+  publishLearned(learnSession.name, blob, learned.confidence);
+}
+
+// The save message is written to the socket piece by piece from `blob`,
+// so the learn path never holds a second copy of the capture.
+struct SaveSpan {
+  const uint8_t *data;
+  size_t         len;
+};
+
+// Streams bytes [offset, offset + n) of the spans laid end to end.
+static void writeSpans(const SaveSpan *spans, size_t count, size_t offset, size_t n) {
+  for (size_t i = 0; i < count && n; i++) {
+    if (offset >= spans[i].len) {
+      offset -= spans[i].len;
+      continue;
+    }
+    size_t take = min(spans[i].len - offset, n);
+    client.write(spans[i].data + offset, take);
+    offset = 0;
+    n -= take;
+  }
+}
+
+void publishLearned(const String &name, const std::vector<uint8_t> &blob, uint8_t confidence) {
+  static uint32_t transferId = 0;
+  uint8_t head[2 + 255 + kIrVarintMax];
+  size_t nameLen = min((size_t)name.length(), (size_t)255);
+  size_t headLen = 0;
+  head[headLen++] = kLibraryVersion;
+  head[headLen++] = nameLen;
+  memcpy(head + headLen, name.c_str(), nameLen);
+  headLen += nameLen;
+  headLen += irWriteVarint(head + headLen, blob.size());
+  uint8_t tail[2 + kDeviceIdMax];
+  size_t libraryLen = strlen(topicLibrary());
+  tail[0] = confidence;
+  tail[1] = libraryLen;
+  memcpy(tail + 2, topicLibrary(), libraryLen);
+  const SaveSpan spans[] = { { head, headLen }, { blob.data(), blob.size() }, { tail, 2 + libraryLen } };
+  size_t total = headLen + blob.size() + 2 + libraryLen;
+  LOG_D("[DEBUG] Final payload size: %u bytes\n", (unsigned)total);
+  LOG_D("[MEM] Free heap before publish: %u\n", ESP.getFreeHeap());
+
+  bool ok;
+  if (total <= kSaveChunkBytes) {
+    ok = client.beginPublish(topicFor(kTopicSave), total, false);
+    if (ok) writeSpans(spans, 3, 0, total);
+    ok = ok && client.endPublish();
+  } else {
+    transferId++;
+    ok = true;
+    for (size_t offset = 0; ok && offset < total; offset += kSaveChunkBytes) {
+      size_t n = min(total - offset, (size_t)kSaveChunkBytes);
+      uint8_t part[1 + 3 * kIrVarintMax];
+      size_t partLen = 0;
+      part[partLen++] = kLibraryVersion;
+      partLen += irWriteVarint(part + partLen, transferId);
+      partLen += irWriteVarint(part + partLen, offset);
+      partLen += irWriteVarint(part + partLen, total);
+      ok = client.beginPublish(topicFor(kTopicSavePart), partLen + n, false);
+      if (ok) {
+        client.write(part, partLen);
+        writeSpans(spans, 3, offset, n);
       }
+      ok = ok && client.endPublish();
+    }
+    LOG_D("[DEBUG] Sent %u bytes in %u parts\n", (unsigned)total,
+          (unsigned)((total + kSaveChunkBytes - 1) / kSaveChunkBytes));
+  }
+  LOG_D("[DEBUG] publish() returned: %d\n", ok);
+  if (!ok) {
+    metricsCount(kCountPublishFailed);
+    LOG_E("[ERROR] MQTT publish failed!\n");
+    sendStatus("Error: Could not save " + name);
+    return;
+  }
+  sendStatus("Learned " + name + " (confidence " + confidence + "%)");
+}
+
+void handleButton(const IrEvent &ev) {
+  const char *name = buttonNames[ev.button];
+  LOG_D("[DEBUG] Btn %d UP after %lums\n", ev.button, (unsigned long)ev.heldMs);
+  const CommandStore &library = commandLibrary.live();
+  if (ev.heldMs > kButtonLearnMs) {
+    learnIR(ev.button, name);
+  } else if (ev.ok) {
+    library.touch(name, strlen(name));
+    sendStatus(String("Sent ") + name);
+  } else if (ev.fail == kFailTransmit || ev.fail == kFailLearning) {
+    LOG_E("[ERROR] %s: %s\n", ev.fail == kFailLearning ? "Not sent while learning"
+                                                      : "Transmit failed", name);
+    sendStatus(String("Sent ") + name + ": 0/1 (1 failed, 0 superseded)");
+  } else if (library.known(name, strlen(name))) {
+    // Evicted, or loaded since: the send queue fetches it if need be.
+    int batch = sendQueue.beginBatch(name);
+    if (batch >= 0) batchReceivedUs[batch] = micros();
+    if (!sendQueue.add(batch, name)) metricsCount(kCountDropped);
+    sendQueue.endBatch(batch);
+  } else {
+    metricsCount(kCountUnknown);
+    LOG_E("[ERROR] Command not found: %s\n", name);
+    sendStatus(String("Sent ") + name + ": 0/1 (1 failed, 0 superseded)");
+  }
+}
+
+// IR task. Never logs, allocates only for learning (the receiver and its
+// captures), and touches the library only through pins.
+
+static uint32_t irQuietAt = 0;  // millis() the next frame may start at
+static IRrecv *irrecv = nullptr;  // Only while learning, see irService()
+
+static void irPostCapture() {
+  // One slot stays free for the kEventSent the send queue waits on.
+  if (irEvents.size() >= kIrEventSlots - 1) return;
+  IrCapture *cap = new IrCapture();
+  cap->rawlen = results.rawlen;
+  cap->protocol = results.decode_type;
+  cap->bits = results.bits;
+  cap->truncated = results.overflow;
+  if (!acEncodeCapture(results, cap->blob, cap->profile, cap->hasProfile)) {
+    // rawbuf[0] is the idle time before the frame, not part of it. Entries
+    // count IRremoteESP8266's kRawTick microseconds.
+    cap->timings.reserve(results.rawlen);
+    for (size_t i = 1; i < results.rawlen; i++) {
+      cap->timings.push_back((uint32_t)results.rawbuf[i] * kRawTick);
     }
   }
+  IrEvent ev = {};
+  ev.kind = kEventCapture;
+  ev.capture = cap;
+  if (!irEvents.push(ev)) delete cap;
+}
+
+// Takes the transmitter unless the network task is writing flash. The
+// flag goes up before the check, so a write that starts in between waits
+// for irSending to drop.
+static bool irClaim() {
+  irSending.store(true);
+  if (!flashWriting.load()) return true;
+  irSending.store(false);
+  return false;
 }
 
-void blinkFeedback(int times, int ms) {
-  for (int i = 0; i < times; i++) {
-    digitalWrite(LED_PIN, HIGH);
-    delay(ms);
-    digitalWrite(LED_PIN, LOW);
-    delay(ms);
+static void irRunJob(const IrJob &job) {
+  if (job.kind == kJobLed) {
+    if (job.times) ledBlink(job.pin, job.times, job.ms);
+    else ledPulse(job.pin, job.ms);
+    return;
+  }
+  IrEvent ev = {};
+  ev.kind = kEventSent;
+  uint32_t start = micros();
+  if (job.kind == kJobAcState) {
+    ev.ok = acSendState(job.ac);
+  } else {
+    ev.ok = transmitCommand(job.cmd);
+    commandLibrary.unpin(job.slot);
+  }
+  ev.transmitUs = micros() - start;
+  ev.endMs = millis();
+  irQuietAt = ev.endMs + kInterFrameGapMs;
+  irEvents.push(ev);
+}
+
+// Short presses are sent here without a trip through the network task;
+// long ones go there to start learning. False while the press has to
+// wait: for room in the event queue, or like jobs for the inter-frame gap.
+static bool irButton(const ButtonEvent &b) {
+  bool send = b.heldMs <= kButtonLearnMs;
+  if (irEvents.size() >= kIrEventSlots - 1) return false;
+  if (send && (int32_t)(millis() - irQuietAt) < 0) return false;
+  bool learning = irLearning.load() || irrecv;
+  if (send && !learning && !irClaim()) return false;
+  IrEvent ev = {};
+  ev.kind = kEventButton;
+  ev.button = b.index;
+  ev.heldMs = b.heldMs;
+  if (send && learning) {
+    ev.fail = kFailLearning;  // Our own frame would be captured as the remote's
+  } else if (send) {
+    ledPulse(ledPins[b.index], 200);
+    uint8_t slot;
+    CommandView cmd;
+    const char *name = buttonNames[b.index];
+    if (!commandLibrary.pin(slot).find(name, strlen(name), cmd)) ev.fail = kFailNotFound;
+    else if (!transmitCommand(cmd)) ev.fail = kFailTransmit;
+    ev.ok = ev.fail == kFailNone;
+    commandLibrary.unpin(slot);
+    irSending.store(false);
+    irQuietAt = millis() + kInterFrameGapMs;
+  }
+  irEvents.push(ev);
+  return true;
+}
+
+// Returns true when it did anything.
+bool irService() {
+  bool busy = false;
+  // A press that has to wait keeps its place, the ones after it stay in
+  // the button driver's queue.
+  static ButtonEvent press;
+  static bool pressWaiting = false;
+  while (pressWaiting || buttonsPoll(press)) {
+    pressWaiting = !irButton(press);
+    if (pressWaiting) break;
+    busy = true;
+  }
+
+  IrJob job;
+  if ((int32_t)(millis() - irQuietAt) >= 0 && irClaim()) {
+    if (irJobs.pop(job)) {
+      irRunJob(job);
+      busy = true;
+    }
+    irSending.store(false);
+  }
+
+  // The receiver and its buffer exist only while learning; deleting it
+  // stops the receive interrupt too.
+  if (irLearning.load() != (irrecv != nullptr)) {
+    if (irrecv) {
+      delete irrecv;
+      irrecv = nullptr;
+    } else {
+      irrecv = new IRrecv(RECV_PIN, kLearnRawBuf, kLearnGapMs);
+      irrecv->enableIRIn();
+    }
+  }
+  if (irrecv && irrecv->decode(&results)) {
+    irPostCapture();
+    irrecv->resume();
+    busy = true;
   }
+  ledService();
+  return busy;
 }
 
 void resetWiFi() {
@@ -297,5 +1516,6 @@ void resetWiFi() {
   prefs.end();
   sendStatus("Wi-Fi reset, restarting");
   delay(500);
+  logFlush();
   ESP.restart();
 }
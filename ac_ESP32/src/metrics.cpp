@@ -0,0 +1,66 @@
+#include "metrics.h"
+
+#include "ir_codec.h"
+
+struct Histogram {
+  uint32_t buckets[kMetricBuckets];
+  uint32_t samples;
+  uint32_t maxUs;
+  uint64_t sumUs;
+};
+
+static Histogram stages[kStageCount];
+static uint32_t counters[kCounterCount];
+static uint32_t heapFree, heapLargest;
+static uint32_t heapMinFree = UINT32_MAX, heapMinLargest = UINT32_MAX;
+
+static uint8_t bucketOf(uint32_t us) {
+  uint8_t b = 0;
+  while (us > 1 && b < kMetricBuckets - 1) {
+    us >>= 1;
+    b++;
+  }
+  return b;
+}
+
+void metricsRecord(MetricStage stage, uint32_t us) {
+  Histogram &h = stages[stage];
+  h.buckets[bucketOf(us)]++;
+  h.samples++;
+  h.sumUs += us;
+  if (us > h.maxUs) h.maxUs = us;
+}
+
+void metricsCount(MetricCounter counter, uint32_t n) { counters[counter] += n; }
+
+void metricsHeap(uint32_t freeBytes, uint32_t largestBlock) {
+  heapFree = freeBytes;
+  heapLargest = largestBlock;
+  if (freeBytes < heapMinFree) heapMinFree = freeBytes;
+  if (largestBlock < heapMinLargest) heapMinLargest = largestBlock;
+}
+
+size_t metricsEncode(uint32_t uptimeS, std::vector<uint8_t> &out) {
+  size_t start = out.size();
+  out.push_back(kMetricsVersion);
+  irWriteVarint(out, uptimeS);
+  irWriteVarint(out, heapFree);
+  irWriteVarint(out, heapLargest);
+  irWriteVarint(out, heapMinFree == UINT32_MAX ? 0 : heapMinFree);
+  irWriteVarint(out, heapMinLargest == UINT32_MAX ? 0 : heapMinLargest);
+
+  out.push_back(kCounterCount);
+  for (uint32_t c : counters) irWriteVarint(out, c);
+
+  out.push_back(kStageCount);
+  for (const Histogram &h : stages) {
+    irWriteVarint(out, h.samples);
+    irWriteVarint(out, h.samples ? h.sumUs / h.samples : 0);
+    irWriteVarint(out, h.maxUs);
+    uint8_t used = kMetricBuckets;
+    while (used && !h.buckets[used - 1]) used--;
+    out.push_back(used);
+    for (uint8_t i = 0; i < used; i++) irWriteVarint(out, h.buckets[i]);
+  }
+  return out.size() - start;
+}
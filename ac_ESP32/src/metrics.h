@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#ifndef kMetricsPeriodMs
+#define kMetricsPeriodMs 60000  // Periodic publish, see metricsEncode()
+#endif
+
+// Latency histograms use power-of-two microsecond buckets: bucket 0 is
+// under 2 us, bucket i covers [2^i, 2^(i+1)) and the last one is open.
+const uint8_t kMetricBuckets = 21;  // Last bucket starts at ~1 s
+
+enum MetricStage : uint8_t {
+  kStageMqtt,      // client.loop(), socket reads plus callbacks
+  kStageParse,     // Send request callback: JSON parse and enqueue
+  kStageLookup,    // CommandStore::find for one step
+  kStageTransmit,  // sendRaw or protocol send of one frame
+  kStageEndToEnd,  // Callback entry to the batch's last frame
+  kStageLoop,      // One pass of the network task
+  kStageWifi,      // Wi-Fi association, at boot or after the link dropped
+  kStageReconnect, // Broker lost to connected again
+  kStageReady,     // Boot to the first broker connection, one sample
+  kStageFetch,     // Fetch request for an evicted command to its reply
+  kStageCount
+};
+
+enum MetricCounter : uint8_t {
+  kCountReceived,       // MQTT messages
+  kCountReconnects,
+  kCountDropped,        // Malformed requests and steps the queue refused
+  kCountUnknown,        // Steps naming a command the store does not have
+  kCountPublishFailed,
+  kCountSessionLost,    // Reconnects that found no session and re-subscribed
+  kCountStale,          // Requests queued by the broker too long ago, dropped
+  kCountCacheHit,       // Steps whose timings were in the command store
+  kCountCacheMiss,      // Steps naming an evicted command, fetched
+  kCountEvicted,        // Commands whose timings were dropped for room
+  kCounterCount
+};
+
+// Fixed-size, allocation-free counters. Everything is cumulative since
+// boot so a consumer can diff two reports.
+void metricsRecord(MetricStage stage, uint32_t us);
+void metricsCount(MetricCounter counter, uint32_t n = 1);
+
+// Samples the heap; low-water marks are kept across samples.
+void metricsHeap(uint32_t freeBytes, uint32_t largestBlock);
+
+// Report published on home/ac/dev/<device>/metrics:
+//   u8      kMetricsVersion
+//   varint  uptime, seconds
+//   varint  free heap, largest free block, lowest free heap, lowest
+//           largest block, bytes
+//   u8      counter count, then a varint per MetricCounter
+//   u8      stage count, then per MetricStage:
+//           varint samples, varint mean us, varint max us,
+//           u8 used buckets (trailing empty ones are cut), varint each
+const uint8_t kMetricsVersion = 1;
+size_t metricsEncode(uint32_t uptimeS, std::vector<uint8_t> &out);
@@ -0,0 +1,118 @@
+#include "send_queue.h"
+
+#include <string.h>
+
+static void copyName(char *dst, const char *src, size_t cap) {
+  strncpy(dst, src, cap - 1);
+  dst[cap - 1] = '\0';
+}
+
+int SendQueue::beginBatch(const char *tag) {
+  for (int i = 0; i < kSendQueueBatches; i++) {
+    Batch &b = batches[i];
+    if (b.used) continue;
+    memset(&b, 0, sizeof(b));
+    copyName(b.result.tag, tag, kSendNameMax);
+    b.result.id = i;
+    b.used = true;
+    b.open = true;
+    return i;
+  }
+  return -1;
+}
+
+bool SendQueue::add(int batch, const char *name, uint32_t delayMs,
+                    uint32_t repeat, const char *group) {
+  if (batch < 0 || batch >= kSendQueueBatches || !batches[batch].open) return false;
+  Batch &b = batches[batch];
+  b.result.steps++;
+  if (count >= kSendQueueSteps || strlen(name) >= kSendNameMax || repeat == 0 ||
+      repeat > kSendRepeatMax || delayMs > kSendDelayMaxMs) {
+    b.result.failed++;
+    return false;
+  }
+
+  // Waiting steps from earlier batches that this one supersedes.
+  for (uint8_t i = started ? 1 : 0; i < count;) {
+    Step &s = steps[i];
+    if (s.batch != batch &&
+        (strcmp(s.name, name) == 0 || (group[0] && strcmp(s.group, group) == 0))) {
+      batches[s.batch].result.superseded++;
+      finishStep(s.batch);
+      dropAt(i);
+    } else {
+      i++;
+    }
+  }
+
+  Step &s = steps[count++];
+  copyName(s.name, name, kSendNameMax);
+  copyName(s.group, group, kSendGroupMax);
+  s.delayMs = delayMs;
+  s.repeat = repeat;
+  s.batch = batch;
+  b.remaining++;
+  return true;
+}
+
+void SendQueue::endBatch(int batch) {
+  if (batch >= 0 && batch < kSendQueueBatches) batches[batch].open = false;
+}
+
+bool SendQueue::service(Clock now, Transmit tx, void *ctx) {
+  const char *name = due(now());
+  if (!name) return false;
+  bool ok = tx(name, ctx);
+  complete(ok, now());
+  return ok;
+}
+
+const char *SendQueue::due(unsigned long now) {
+  if (!count || inFlight || (int32_t)(now - nextAt) < 0) return nullptr;
+  started = true;
+  inFlight = true;
+  return steps[0].name;
+}
+
+void SendQueue::complete(bool ok, unsigned long endMs) {
+  if (!inFlight) return;
+  inFlight = false;
+  Step &s = steps[0];
+  if (!ok) {
+    batches[s.batch].result.failed++;
+    finishStep(s.batch);
+    dropAt(0);
+    started = false;
+    return;
+  }
+
+  if (--s.repeat) {
+    nextAt = endMs + kInterFrameGapMs;
+    return;
+  }
+  nextAt = endMs + (s.delayMs > kInterFrameGapMs ? s.delayMs : kInterFrameGapMs);
+  batches[s.batch].result.sent++;
+  finishStep(s.batch);
+  dropAt(0);
+  started = false;
+}
+
+bool SendQueue::pollCompleted(SendBatchResult &out) {
+  for (auto &b : batches) {
+    if (b.used && !b.open && b.remaining == 0) {
+      out = b.result;
+      b.used = false;
+      return true;
+    }
+  }
+  return false;
+}
+
+void SendQueue::dropAt(uint8_t i) {
+  memmove(&steps[i], &steps[i + 1], (count - i - 1) * sizeof(Step));
+  count--;
+}
+
+void SendQueue::finishStep(uint8_t batch) {
+  if (batches[batch].remaining) batches[batch].remaining--;
+}
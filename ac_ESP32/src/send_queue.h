@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef kSendQueueSteps
+#define kSendQueueSteps 32
+#endif
+
+#ifndef kSendQueueBatches
+#define kSendQueueBatches 8
+#endif
+
+#ifndef kInterFrameGapMs
+#define kInterFrameGapMs 40  // Quiet time receivers need between frames
+#endif
+
+const size_t kSendNameMax = 64;
+const size_t kSendGroupMax = 16;
+const uint32_t kSendDelayMaxMs = UINT16_MAX;
+const uint32_t kSendRepeatMax = UINT8_MAX;
+
+struct SendBatchResult {
+  char    tag[kSendNameMax];
+  uint8_t id;          // As returned by beginBatch()
+  uint8_t steps;       // Steps accepted into the batch
+  uint8_t sent;
+  uint8_t failed;      // Unknown command or transmit error
+  uint8_t superseded;  // Replaced by a later step before it ran
+};
+
+// Ordered IR transmit queue fed from MQTT and drained by the network
+// task. Steps belong to batches. A step that is still waiting is
+// dropped when a later step names the same command, or shares its
+// non-empty group, since AC remotes send the full state in every frame.
+class SendQueue {
+public:
+  // Returns false for a name the store does not know.
+  typedef bool (*Transmit)(const char *name, void *ctx);
+  typedef unsigned long (*Clock)();
+
+  // Returns a batch id, or -1 when every batch slot is busy.
+  int beginBatch(const char *tag);
+  // A delay over kSendDelayMaxMs, or a repeat outside 1..kSendRepeatMax,
+  // fails the step rather than wrapping.
+  bool add(int batch, const char *name, uint32_t delayMs = 0,
+           uint32_t repeat = 1, const char *group = "");
+  // Marks the batch complete once its steps have run. An empty batch
+  // completes immediately.
+  void endBatch(int batch);
+
+  // Sends at most one frame if one is due, returns true when it did.
+  // The clock is read again after the frame so gaps start when it ends.
+  bool service(Clock now, Transmit tx, void *ctx);
+  bool pollCompleted(SendBatchResult &out);
+
+  // The same in two halves, for a transmitter on another task: due()
+  // names the frame to send now, or returns nullptr, also while a frame
+  // is out. complete() reports it, `endMs` being when it finished.
+  const char *due(unsigned long now);
+  void complete(bool ok, unsigned long endMs);
+
+  uint8_t pending() const { return count; }
+
+private:
+  struct Step {
+    char     name[kSendNameMax];
+    char     group[kSendGroupMax];
+    uint16_t delayMs;  // Pause after the step, on top of the frame gap
+    uint8_t  repeat;
+    uint8_t  batch;
+  };
+  struct Batch {
+    SendBatchResult result;
+    uint8_t         remaining;
+    bool            used;
+    bool            open;
+  };
+
+  void dropAt(uint8_t i);
+  void finishStep(uint8_t batch);
+
+  Step     steps[kSendQueueSteps];
+  Batch    batches[kSendQueueBatches] = {};
+  uint8_t  count = 0;
+  bool     started = false;  // Head step has sent at least one frame
+  bool     inFlight = false;  // Between due() and complete()
+  uint32_t nextAt = 0;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded queue between exactly one producer task and one consumer task,
+// on either core. Neither side blocks or takes a lock: push() fails when
+// the queue is full and pop() when it is empty. N must be a power of two.
+template <typename T, size_t N>
+class SpscQueue {
+  static_assert(N && (N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+
+public:
+  // Producer side.
+  bool push(const T &item) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == N) return false;
+    slots[h & (N - 1)] = item;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side.
+  bool pop(T &item) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) return false;
+    item = slots[t & (N - 1)];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // The other side may move while this reads: from the consumer it is a
+  // lower bound, as pushes may land; from the producer an upper bound, as
+  // pops may. No other task should call it.
+  size_t size() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+
+private:
+  T slots[N];
+  std::atomic<uint32_t> head{0};  // Written by push()
+  std::atomic<uint32_t> tail{0};  // Written by pop()
+};
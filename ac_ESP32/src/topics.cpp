@@ -0,0 +1,55 @@
+#include "topics.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const char *const kSuffix[kTopicCount] = {
+  "send", "state", "library", "library/part", "reset_wifi", "metrics/get", "ping", "command",
+  "delta",
+  "status", "list", "fetch", "save", "save/part", "metrics",
+};
+
+// Longest prefix is "home/ac/dev/", longest suffix "library/part".
+static const size_t kTopicMax = 12 + kDeviceIdMax + 1 + 12 + 1;
+
+static char device[kDeviceIdMax + 1];
+static char library[kDeviceIdMax + 1];
+static char topics[kTopicCount][kTopicMax];
+static size_t devicePrefixLen;  // Shared by every topic but kTopicDelta
+
+bool topicNameValid(const char *name) {
+  size_t len = strlen(name);
+  return len > 0 && len <= kDeviceIdMax && !strpbrk(name, "/+#");
+}
+
+void topicDefaultDevice(const uint8_t mac[6], char *out, size_t len) {
+  snprintf(out, len, "ac-%02x%02x%02x", mac[3], mac[4], mac[5]);
+}
+
+void topicsBegin(const char *dev, const char *lib) {
+  snprintf(device, sizeof(device), "%s", dev);
+  snprintf(library, sizeof(library), "%s", lib);
+  devicePrefixLen = snprintf(nullptr, 0, "home/ac/dev/%s/", device);
+  for (uint8_t t = 0; t < kTopicCount; t++) {
+    if (t == kTopicDelta) {
+      snprintf(topics[t], kTopicMax, "home/ac/lib/%s/%s", library, kSuffix[t]);
+    } else {
+      snprintf(topics[t], kTopicMax, "home/ac/dev/%s/%s", device, kSuffix[t]);
+    }
+  }
+}
+
+const char *topicDevice() { return device; }
+const char *topicLibrary() { return library; }
+const char *topicFor(Topic topic) { return topics[topic]; }
+
+Topic topicMatch(const char *topic) {
+  if (strcmp(topic, topics[kTopicDelta]) == 0) return kTopicDelta;
+  // The device prefix is compared once, then only the suffixes.
+  if (strncmp(topic, topics[kTopicSend], devicePrefixLen) != 0) return kTopicCount;
+  const char *suffix = topic + devicePrefixLen;
+  for (uint8_t t = 0; t < kTopicSubscribed; t++) {
+    if (t != kTopicDelta && strcmp(suffix, kSuffix[t]) == 0) return (Topic)t;
+  }
+  return kTopicCount;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef kDeviceIdMax
+#define kDeviceIdMax 32  // Device and library names, without the terminator
+#endif
+
+// Each device talks on its own topics, so a request for one device is
+// never delivered to, or parsed by, the rest of the fleet:
+//
+//   home/ac/dev/<device>/send        send request
+//   home/ac/dev/<device>/state       AC state request
+//   home/ac/dev/<device>/library     library snapshot, only when this
+//                                    device asked on .../list
+//   home/ac/dev/<device>/library/part
+//   home/ac/dev/<device>/reset_wifi
+//   home/ac/dev/<device>/metrics/get
+//   home/ac/dev/<device>/ping        the device's own session probe
+//   home/ac/dev/<device>/command     one command, answering .../fetch
+//   home/ac/dev/<device>/status      published; the rest too
+//   home/ac/dev/<device>/list        {"version", "hash", "library"}
+//   home/ac/dev/<device>/fetch       {"name", "library"}, for a command
+//                                    the device evicted
+//   home/ac/dev/<device>/save        learned command
+//   home/ac/dev/<device>/save/part
+//   home/ac/dev/<device>/metrics
+//
+// Library changes go to every device assigned that library, and only
+// to them:
+//
+//   home/ac/lib/<library>/delta
+enum Topic : uint8_t {
+  kTopicSend,
+  kTopicState,
+  kTopicLibrary,
+  kTopicLibraryPart,
+  kTopicResetWifi,
+  kTopicMetricsGet,
+  kTopicPing,
+  kTopicCommand,
+  kTopicDelta,
+  kTopicStatus,  // First published topic, the ones above are subscribed
+  kTopicList,
+  kTopicFetch,
+  kTopicSave,
+  kTopicSavePart,
+  kTopicMetrics,
+  kTopicCount
+};
+const uint8_t kTopicSubscribed = kTopicStatus;
+
+// A name is usable in a topic when it is 1..kDeviceIdMax characters
+// without '/', '+' or '#'.
+bool topicNameValid(const char *name);
+
+// "ac-" and the last three bytes of the MAC in hex.
+void topicDefaultDevice(const uint8_t mac[6], char *out, size_t len);
+
+// Builds every topic once; both names must be valid.
+void topicsBegin(const char *device, const char *library);
+
+const char *topicDevice();
+const char *topicLibrary();
+const char *topicFor(Topic topic);
+
+// Which subscribed topic a message arrived on, kTopicCount for none.
+Topic topicMatch(const char *topic);
@@ -0,0 +1,85 @@
+#pragma once
+
+// Host stand-in for the Arduino core, enough for the firmware sources to
+// build and run on Linux. See host.h for the knobs tests use.
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <type_traits>
+
+using std::max;
+using std::min;
+
+typedef uint8_t byte;
+
+#define IRAM_ATTR
+#define HIGH         1
+#define LOW          0
+#define INPUT        0x01
+#define OUTPUT       0x03
+#define INPUT_PULLUP 0x05
+#define CHANGE       0x03
+
+class String {
+public:
+  String() {}
+  String(const char *s) : s(s ? s : "") {}
+  String(const std::string &s) : s(s) {}
+  template <typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+  explicit String(T v) : s(std::is_same<T, char>::value ? std::string(1, (char)v) : std::to_string(v)) {}
+
+  const char *c_str() const { return s.c_str(); }
+  unsigned int length() const { return s.size(); }
+  bool operator==(const String &o) const { return s == o.s; }
+  bool operator!=(const String &o) const { return s != o.s; }
+  String &operator+=(const String &o) { s += o.s; return *this; }
+
+  friend String operator+(String a, const String &b) { return a += b; }
+  friend String operator+(String a, const char *b) { return a += String(b); }
+  friend String operator+(const char *a, const String &b) { return String(a) += b; }
+  template <typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+  friend String operator+(String a, T v) { return a += String(v); }
+
+private:
+  std::string s;
+};
+
+// Models a UART at the configured baud rate with a 128-byte TX FIFO: a
+// write that does not fit blocks, which here means the clock advances.
+class HardwareSerial {
+public:
+  void begin(unsigned long baud);
+  size_t write(const uint8_t *buf, size_t len);
+  int availableForWrite();
+  size_t printf(const char *fmt, ...);
+  size_t print(const char *s) { return printf("%s", s); }
+  size_t print(const String &s) { return print(s.c_str()); }
+  size_t println(const char *s = "") { return printf("%s\n", s); }
+  size_t println(const String &s) { return println(s.c_str()); }
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+  uint32_t getFreeHeap();
+  uint32_t getMaxAllocHeap();
+  void restart();
+};
+extern EspClass ESP;
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+long random(long howbig);  // Deterministic on the host
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+inline int digitalPinToInterrupt(int pin) { return pin; }
+void attachInterruptArg(uint8_t pin, void (*isr)(void *), void *arg, int mode);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <IRrecv.h>
+#include <IRutils.h>
+
+namespace stdAc {
+enum class opmode_t { kOff = -1, kAuto = 0, kCool, kHeat, kDry, kFan };
+enum class fanspeed_t { kAuto = 0, kMin, kLow, kMedium, kHigh, kMax };
+enum class swingv_t { kOff = -1, kAuto = 0, kHighest, kHigh, kMiddle, kLow, kLowest };
+
+struct state_t {
+  decode_type_t protocol = UNKNOWN;
+  int16_t       model = -1;
+  bool          power = false;
+  opmode_t      mode = opmode_t::kAuto;
+  float         degrees = 25;
+  bool          celsius = true;
+  fanspeed_t    fanspeed = fanspeed_t::kAuto;
+  swingv_t      swingv = swingv_t::kOff;
+};
+}  // namespace stdAc
+
+// Synthesizes nothing: sendAc() logs the requested (or next) state as a
+// protocol transmission with the degrees in state[0] and power in state[1].
+class IRac {
+public:
+  explicit IRac(uint16_t pin) {}
+  static bool isProtocolSupported(decode_type_t protocol) { return hasACState(protocol); }
+  static stdAc::opmode_t strToOpmode(const char *str, stdAc::opmode_t def);
+  static stdAc::fanspeed_t strToFanspeed(const char *str, stdAc::fanspeed_t def);
+  static stdAc::swingv_t strToSwingV(const char *str, stdAc::swingv_t def);
+  bool sendAc();
+  bool sendAc(const stdAc::state_t desired, const stdAc::state_t *prev = nullptr);
+
+  stdAc::state_t next;
+};
+
+namespace IRAcUtils {
+bool decodeToState(const decode_results *decode, stdAc::state_t *result,
+                   const stdAc::state_t *prev = nullptr);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <IRremoteESP8266.h>
+
+const uint16_t kRawTick = 2;  // Microseconds per rawbuf entry
+
+struct decode_results {
+  decode_type_t     decode_type = UNKNOWN;
+  uint64_t          value = 0;
+  uint16_t          bits = 0;
+  uint8_t           state[kStateSizeMax] = {};
+  volatile uint16_t *rawbuf = nullptr;
+  uint16_t          rawlen = 0;
+  bool              overflow = false;
+};
+
+// Hands out captures queued with hostCapture(), cut to the buffer size
+// with `overflow` set when longer.
+class IRrecv {
+public:
+  explicit IRrecv(uint16_t pin, uint16_t bufsize = kRawBuf, uint8_t timeout = kTimeoutMs,
+                  bool save_buffer = false);
+  ~IRrecv();
+  void enableIRIn() {}
+  bool decode(decode_results *results);
+  void resume() {}
+
+private:
+  uint16_t bufsize;
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <Arduino.h>
+
+// The handful of protocols the host tests use, numbered as upstream.
+enum decode_type_t {
+  UNKNOWN = -1,
+  UNUSED = 0,
+  NEC = 3,
+  SONY = 4,
+  COOLIX = 15,
+  DAIKIN = 16,
+  GREE = 24,
+};
+
+const uint16_t kStateSizeMax = 53;
+const uint16_t kRawBuf = 100;
+const uint8_t kTimeoutMs = 15;
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <IRremoteESP8266.h>
+
+// Every transmission is appended to hostTransmitted().
+class IRsend {
+public:
+  explicit IRsend(uint16_t pin) {}
+  void begin() {}
+  void sendRaw(const uint16_t *buf, uint16_t len, uint16_t hz);
+  bool send(decode_type_t type, const uint8_t *state, uint16_t nbytes);
+  bool send(decode_type_t type, uint64_t data, uint16_t nbits, uint16_t repeat = 0);
+};
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <IRremoteESP8266.h>
+
+String typeToString(decode_type_t protocol, bool isRepeat = false);
+decode_type_t strToDecodeType(const char *str);
+bool hasACState(decode_type_t protocol);
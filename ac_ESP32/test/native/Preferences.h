@@ -0,0 +1,37 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <map>
+#include <string>
+
+// Namespaces live in memory for the life of the process, like NVS
+// survives a reboot; hostReset() wipes them.
+class Preferences {
+public:
+  bool begin(const char *name, bool readOnly = false);
+  void end() { ns = nullptr; }
+  bool clear();
+
+  size_t putShort(const char *key, int16_t v) { return put(key, v); }
+  int16_t getShort(const char *key, int16_t def = 0) { return get(key, def); }
+  size_t putUInt(const char *key, uint32_t v) { return put(key, v); }
+  uint32_t getUInt(const char *key, uint32_t def = 0) { return get(key, def); }
+  size_t putBool(const char *key, bool v) { return put(key, v); }
+  bool getBool(const char *key, bool def = false) { return get(key, def); }
+  size_t putString(const char *key, const String &v);
+  String getString(const char *key, const String &def = String());
+  size_t putBytes(const char *key, const void *v, size_t len);
+  size_t getBytes(const char *key, void *buf, size_t len);
+
+private:
+  template <typename T> size_t put(const char *key, T v) {
+    return putBytes(key, &v, sizeof(v));
+  }
+  template <typename T> T get(const char *key, T def) {
+    T v;
+    return getBytes(key, &v, sizeof(v)) == sizeof(v) ? v : def;
+  }
+
+  std::map<std::string, std::string> *ns = nullptr;
+};
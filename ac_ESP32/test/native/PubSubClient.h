@@ -0,0 +1,47 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#include <functional>
+
+#ifndef MQTT_MAX_PACKET_SIZE
+#define MQTT_MAX_PACKET_SIZE 256
+#endif
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char *, uint8_t *, unsigned int)> callback
+
+// Acts as its own broker: publishes land in hostPublished(), and
+// hostDeliver() calls the registered callback. Subscriptions live in the
+// session, which a clean connect or hostDropSession() discards; a
+// publish to a subscribed topic comes back on the next loop().
+class PubSubClient {
+public:
+  PubSubClient(WiFiClient &) {}
+
+  PubSubClient &setServer(const char *domain, uint16_t port) { return *this; }
+  PubSubClient &setCallback(MQTT_CALLBACK_SIGNATURE);
+  // Also the limit for incoming messages, see hostDeliver().
+  bool setBufferSize(uint16_t size);
+  PubSubClient &setSocketTimeout(uint16_t timeout) { return *this; }
+
+  bool connect(const char *id, const char *user, const char *pass);
+  bool connect(const char *id, const char *user, const char *pass, const char *willTopic,
+               uint8_t willQos, bool willRetain, const char *willMessage, bool cleanSession);
+  bool connected();
+  int state() { return connected() ? 0 : -1; }
+  bool loop();
+  bool subscribe(const char *topic, uint8_t qos = 0);
+
+  bool publish(const char *topic, const char *payload, bool retained = false);
+  bool publish(const char *topic, const uint8_t *payload, unsigned int len, bool retained = false);
+
+  // Streamed publish: the message is logged by endPublish() once exactly
+  // plength bytes were written.
+  bool beginPublish(const char *topic, unsigned int plength, bool retained);
+  size_t write(uint8_t b) { return write(&b, 1); }
+  size_t write(const uint8_t *buf, size_t size);
+  int endPublish();
+
+  uint16_t bufferSize = MQTT_MAX_PACKET_SIZE;
+};
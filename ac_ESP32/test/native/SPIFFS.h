@@ -0,0 +1,35 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Files are byte vectors in memory; hostReset() formats the "partition".
+class File {
+public:
+  File() {}
+  File(std::shared_ptr<std::vector<uint8_t>> data, bool append)
+      : data(data), pos(append ? data->size() : 0) {}
+
+  explicit operator bool() const { return (bool)data; }
+  size_t size() const { return data ? data->size() : 0; }
+  bool seek(uint32_t p);
+  size_t read(uint8_t *buf, size_t len);
+  size_t write(const uint8_t *buf, size_t len);
+  void close() { data.reset(); }
+
+private:
+  std::shared_ptr<std::vector<uint8_t>> data;
+  size_t pos = 0;
+};
+
+class SPIFFSClass {
+public:
+  bool begin(bool formatOnFail = false) { return true; }
+  File open(const char *path, const char *mode = "r");
+  bool remove(const char *path);
+  bool exists(const char *path);
+};
+extern SPIFFSClass SPIFFS;
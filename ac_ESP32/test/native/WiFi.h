@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Arduino.h>
+
+#define WL_CONNECTED 3
+#define WL_DISCONNECTED 6
+#define WIFI_STA 1
+
+class IPAddress {
+public:
+  IPAddress(uint32_t addr = 0) : addr(addr) {}
+  operator uint32_t() const { return addr; }
+  String toString() const {
+    char s[16];
+    snprintf(s, sizeof(s), "%u.%u.%u.%u", addr & 0xff, (addr >> 8) & 0xff,
+             (addr >> 16) & 0xff, addr >> 24);
+    return s;
+  }
+
+private:
+  uint32_t addr;
+};
+static const IPAddress INADDR_NONE;
+
+class WiFiClient {};
+
+// Association completes on the host clock: kHostScanMs after a plain
+// begin(), kHostJoinMs when the channel and BSSID are given, plus
+// kHostDhcpMs unless config() set a static address.
+class WiFiClass {
+public:
+  static constexpr uint32_t kHostScanMs = 1500;
+  static constexpr uint32_t kHostJoinMs = 150;
+  static constexpr uint32_t kHostDhcpMs = 400;
+
+  bool mode(int m) { return true; }
+  void persistent(bool p) {}
+  bool config(IPAddress local, IPAddress gateway, IPAddress subnet, IPAddress dns = INADDR_NONE);
+  void begin(const char *ssid, const char *pass, int32_t channel = 0,
+             const uint8_t *bssid = nullptr, bool connect = true);
+  bool disconnect();
+  int status();
+  String SSID() { return "host"; }
+  String psk() { return ""; }
+  IPAddress localIP() { return status() == WL_CONNECTED ? IPAddress(0x0a01a8c0) : INADDR_NONE; }
+  IPAddress gatewayIP() { return IPAddress(0x0101a8c0); }
+  IPAddress subnetMask() { return IPAddress(0x00ffffff); }
+  IPAddress dnsIP() { return IPAddress(0x0101a8c0); }
+  uint8_t *BSSID() {
+    static uint8_t ap[6] = {0x9c, 0x53, 0x22, 0x10, 0x20, 0x30};
+    return ap;
+  }
+  int32_t channel() { return 6; }
+  uint8_t *macAddress(uint8_t *mac) {
+    static const uint8_t host[6] = {0x24, 0x6f, 0x28, 0xac, 0x00, 0x01};
+    memcpy(mac, host, 6);
+    return mac;
+  }
+
+  bool     joined = false;   // Last begin() was given a channel and BSSID
+  uint32_t staticIp = 0;
+  uint64_t linkAtUs = 0;     // When the pending association completes
+  bool     started = false;
+};
+extern WiFiClass WiFi;
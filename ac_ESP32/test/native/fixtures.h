@@ -0,0 +1,110 @@
+#pragma once
+
+// Builds library snapshots and deltas the way the backend does, for
+// feeding the firmware in host tests.
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ir_codec.h"
+#include "library_frame.h"
+
+typedef std::pair<std::string, std::vector<uint16_t>> FixtureCommand;
+
+inline void fixtureRecord(std::vector<uint8_t> &out, const std::string &name,
+                          const std::vector<uint16_t> &timings, uint8_t tickUs) {
+  out.push_back(name.size());
+  out.insert(out.end(), name.begin(), name.end());
+  std::vector<uint8_t> blob;
+  irEncode(timings.data(), timings.size(), tickUs, blob);
+  irWriteVarint(out, blob.size());
+  out.insert(out.end(), blob.begin(), blob.end());
+}
+
+// Timings must be multiples of tickUs for the library hash to match.
+inline std::vector<uint8_t> fixtureSnapshot(uint32_t version,
+                                            const std::vector<FixtureCommand> &commands,
+                                            uint8_t tickUs = 50) {
+  uint32_t hash = 0;
+  for (auto &c : commands) {
+    hash += libraryEntryHash(c.first.data(), c.first.size(), c.second.data(), c.second.size());
+  }
+  std::vector<uint8_t> out = {kLibraryVersion};
+  irWriteVarint(out, version);
+  for (int i = 0; i < 4; i++) out.push_back(hash >> (8 * i));
+  irWriteVarint(out, commands.size());
+  for (auto &c : commands) fixtureRecord(out, c.first, c.second, tickUs);
+  return out;
+}
+
+// Greedy LZSS over the whole window, as the backend's lz_compress().
+inline std::vector<uint8_t> fixtureCompress(const std::vector<uint8_t> &in) {
+  std::vector<uint8_t> out = {kLibraryLz};
+  irWriteVarint(out, in.size());
+  size_t flagAt = 0;
+  uint8_t bit = 8;
+  for (size_t i = 0; i < in.size();) {
+    if (bit == 8) {
+      flagAt = out.size();
+      out.push_back(0);
+      bit = 0;
+    }
+    size_t best = 0, distance = 0;
+    for (size_t j = i > kLzWindow ? i - kLzWindow : 0; j < i; j++) {
+      size_t len = 0;
+      while (len < kLzMaxMatch && i + len < in.size() && in[j + len] == in[i + len]) len++;
+      if (len >= best) {
+        best = len;
+        distance = i - j;
+      }
+    }
+    if (best >= kLzMinMatch) {
+      uint16_t token = (distance - 1) | ((best - kLzMinMatch) << 10);
+      out[flagAt] |= 1 << bit;
+      out.push_back(token & 0xFF);
+      out.push_back(token >> 8);
+      i += best;
+    } else {
+      out.push_back(in[i++]);
+    }
+    bit++;
+  }
+  return out;
+}
+
+// Splits a snapshot into .../library/part messages, as the backend's
+// split_parts().
+inline std::vector<std::vector<uint8_t>> fixtureParts(const std::vector<uint8_t> &in,
+                                                      uint32_t transfer, size_t chunk) {
+  std::vector<std::vector<uint8_t>> parts;
+  for (size_t offset = 0; offset < in.size(); offset += chunk) {
+    std::vector<uint8_t> part = {kLibraryVersion};
+    irWriteVarint(part, transfer);
+    irWriteVarint(part, offset);
+    irWriteVarint(part, in.size());
+    part.insert(part.end(), in.begin() + offset, in.begin() + std::min(offset + chunk, in.size()));
+    parts.push_back(part);
+  }
+  return parts;
+}
+
+inline std::vector<uint8_t> fixtureUpsert(uint32_t version, const FixtureCommand &command,
+                                          uint8_t tickUs = 50) {
+  std::vector<uint8_t> out = {kLibraryVersion, kOpUpsert};
+  irWriteVarint(out, version);
+  fixtureRecord(out, command.first, command.second, tickUs);
+  return out;
+}
+
+// NEC-style frame: header, 32 bits of `code`, stop mark.
+inline std::vector<uint16_t> fixtureFrame(uint32_t code) {
+  std::vector<uint16_t> t = {9000, 4500};
+  for (int i = 0; i < 32; i++) {
+    t.push_back(550);
+    t.push_back((code >> i) & 1 ? 1650 : 550);
+  }
+  t.push_back(550);
+  return t;
+}
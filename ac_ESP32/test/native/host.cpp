@@ -0,0 +1,480 @@
+#include "host.h"
+
+#include <IRac.h>
+#include <IRrecv.h>
+#include <IRsend.h>
+#include <IRutils.h>
+#include <Preferences.h>
+#include <PubSubClient.h>
+#include <SPIFFS.h>
+#include <WiFi.h>
+
+#include <deque>
+#include <malloc.h>
+#include <map>
+#include <memory>
+#include <new>
+#include <set>
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+SPIFFSClass SPIFFS;
+bool hostSerialEcho = true;
+
+static uint64_t nowUs = 0;
+static const size_t kSerialFifo = 128;
+static uint32_t serialBaud = 0;
+static double serialQueued = 0;  // Bytes still in the FIFO at serialAt
+static uint64_t serialAt = 0;
+static uint64_t serialBlockedUs = 0;
+static bool connected = true;
+static bool online = false;  // A connect() succeeded since the broker came up
+static uint32_t connects = 0, subscribes = 0;
+static std::set<std::string> session;
+static std::deque<HostMessage> inbox;  // Queued in the session for loop()
+static MQTT_CALLBACK_SIGNATURE;
+static uint16_t inboundLimit = MQTT_MAX_PACKET_SIZE;
+static std::vector<HostMessage> published;
+static HostMessage streaming;
+static size_t streamingLen = 0;
+static std::vector<HostTransmit> transmitted;
+static std::map<std::string, std::map<std::string, std::string>> nvs;
+static std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> files;
+
+struct HostCapture {
+  decode_results        results;
+  std::vector<uint16_t> raw;
+};
+static std::deque<HostCapture> captures;
+static HostCapture current;
+static uint32_t receivers = 0;
+
+static HostAllocs allocs = {0, 0, 0, 0};
+
+void *operator new(size_t size) {
+  allocs.count++;
+  allocs.bytes += size;
+  void *p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  allocs.live += malloc_usable_size(p);
+  if (allocs.live > allocs.peak) allocs.peak = allocs.live;
+  return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept {
+  if (p) allocs.live -= malloc_usable_size(p);
+  free(p);
+}
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete(p); }
+
+HostAllocs hostAllocs() { return allocs; }
+void hostResetPeak() { allocs.peak = allocs.live; }
+
+void hostReset() {
+  nowUs = 0;
+  serialAt = 0;
+  serialQueued = 0;
+  connected = true;
+  online = false;
+  session.clear();
+  inbox.clear();
+  WiFi = WiFiClass();
+  published.clear();
+  transmitted.clear();
+  nvs.clear();
+  files.clear();
+  captures.clear();
+}
+
+void hostAdvance(uint32_t ms) { nowUs += (uint64_t)ms * 1000; }
+void hostSetConnected(bool c) {
+  connected = c;
+  if (!c) online = false;
+}
+
+void hostDropSession() {
+  session.clear();
+  inbox.clear();
+}
+uint32_t hostConnects() { return connects; }
+uint32_t hostSubscribes() { return subscribes; }
+
+void hostDeliver(const char *topic, const uint8_t *payload, size_t len) {
+  if (!online) {
+    if (session.count(topic)) inbox.push_back({topic, std::vector<uint8_t>(payload, payload + len)});
+    return;
+  }
+  // PubSubClient reads an oversized packet off the socket and drops it.
+  if (!callback || len + strlen(topic) + 7 > inboundLimit) return;
+  std::string t(topic);
+  std::vector<uint8_t> copy(payload, payload + len);
+  callback(&t[0], copy.data(), len);
+}
+
+void hostDeliver(const char *topic, const char *payload) {
+  hostDeliver(topic, (const uint8_t *)payload, strlen(payload));
+}
+
+void hostCapture(const std::vector<uint16_t> &rawTicks) {
+  HostCapture c;
+  c.raw = rawTicks;
+  captures.push_back(c);
+}
+
+void hostCapture(decode_type_t protocol, const uint8_t *state, uint8_t nbytes) {
+  HostCapture c;
+  c.results.decode_type = protocol;
+  c.results.bits = nbytes * 8;
+  memcpy(c.results.state, state, nbytes);
+  for (uint8_t i = 0; i < nbytes && i < 8; i++) c.results.value |= (uint64_t)state[i] << (8 * i);
+  captures.push_back(c);
+}
+
+uint32_t hostReceivers() { return receivers; }
+
+std::vector<HostMessage> &hostPublished() { return published; }
+std::vector<HostTransmit> &hostTransmitted() { return transmitted; }
+
+// Arduino core
+
+static double serialByteUs() { return serialBaud ? 10e6 / serialBaud : 0; }
+
+static void serialDrain() {
+  double sent = serialBaud ? (nowUs - serialAt) / serialByteUs() : serialQueued;
+  serialQueued = std::max(0.0, serialQueued - sent);
+  serialAt = nowUs;
+}
+
+uint64_t hostSerialBlockedUs() { return serialBlockedUs; }
+
+void HardwareSerial::begin(unsigned long baud) { serialBaud = baud; }
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t len) {
+  serialDrain();
+  if (serialQueued + len > kSerialFifo) {
+    uint64_t wait = (serialQueued + len - kSerialFifo) * serialByteUs();
+    serialBlockedUs += wait;
+    nowUs += wait;
+    serialDrain();
+  }
+  serialQueued += len;
+  if (hostSerialEcho) fwrite(buf, 1, len, stdout);
+  return len;
+}
+
+int HardwareSerial::availableForWrite() {
+  serialDrain();
+  return kSerialFifo - (size_t)(serialQueued + 0.999);
+}
+
+size_t HardwareSerial::printf(const char *fmt, ...) {
+  char buf[512];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if (n < 0) return 0;
+  return write((const uint8_t *)buf, std::min((size_t)n, sizeof(buf) - 1));
+}
+
+uint32_t EspClass::getFreeHeap() { return 200000; }
+uint32_t EspClass::getMaxAllocHeap() { return 110000; }
+void EspClass::restart() { Serial.println("[HOST] ESP.restart()"); }
+
+unsigned long millis() { return nowUs / 1000; }
+unsigned long micros() { return nowUs; }
+void delay(uint32_t ms) { hostAdvance(ms); }
+
+long random(long howbig) {
+  static uint32_t seed = 1;
+  seed = seed * 1103515245 + 12345;
+  return howbig > 0 ? (seed >> 8) % howbig : 0;
+}
+
+// WiFi
+
+bool WiFiClass::config(IPAddress local, IPAddress, IPAddress, IPAddress) {
+  staticIp = local;
+  return true;
+}
+
+void WiFiClass::begin(const char *, const char *, int32_t channel, const uint8_t *bssid, bool) {
+  joined = channel && bssid;
+  started = true;
+  linkAtUs = nowUs + 1000ull * ((joined ? kHostJoinMs : kHostScanMs) + (staticIp ? 0 : kHostDhcpMs));
+}
+
+bool WiFiClass::disconnect() {
+  started = false;
+  return true;
+}
+
+int WiFiClass::status() { return started && nowUs >= linkAtUs ? WL_CONNECTED : WL_DISCONNECTED; }
+
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+struct HostPin {
+  int    level = HIGH;
+  void (*isr)(void *) = nullptr;
+  void  *arg = nullptr;
+};
+static std::map<uint8_t, HostPin> pins;
+
+int digitalRead(uint8_t pin) { return pins[pin].level; }
+void attachInterruptArg(uint8_t pin, void (*isr)(void *), void *arg, int) {
+  pins[pin].isr = isr;
+  pins[pin].arg = arg;
+}
+
+void hostSetPin(uint8_t pin, int level) {
+  HostPin &p = pins[pin];
+  if (p.level == level) return;
+  p.level = level;
+  if (p.isr) p.isr(p.arg);  // CHANGE
+}
+
+// PubSubClient
+
+PubSubClient &PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE) {
+  ::callback = callback;
+  return *this;
+}
+
+bool PubSubClient::setBufferSize(uint16_t size) {
+  bufferSize = size;
+  inboundLimit = size;
+  return true;
+}
+
+bool PubSubClient::connect(const char *id, const char *user, const char *pass) {
+  return connect(id, user, pass, nullptr, 0, false, nullptr, true);
+}
+
+bool PubSubClient::connect(const char *, const char *, const char *, const char *, uint8_t, bool,
+                           const char *, bool cleanSession) {
+  connects++;
+  if (!::connected) return false;
+  if (cleanSession) {
+    session.clear();
+    inbox.clear();
+  }
+  online = true;
+  return true;
+}
+
+bool PubSubClient::connected() { return ::connected && online; }
+
+bool PubSubClient::loop() {
+  if (!connected()) return false;
+  while (!inbox.empty()) {
+    HostMessage m = std::move(inbox.front());
+    inbox.pop_front();
+    hostDeliver(m.topic.c_str(), m.payload.data(), m.payload.size());
+  }
+  return true;
+}
+
+bool PubSubClient::subscribe(const char *topic, uint8_t) {
+  subscribes++;
+  if (!connected()) return false;
+  session.insert(topic);
+  return true;
+}
+
+bool PubSubClient::publish(const char *topic, const char *payload, bool retained) {
+  return publish(topic, (const uint8_t *)payload, strlen(payload), retained);
+}
+
+bool PubSubClient::publish(const char *topic, const uint8_t *payload, unsigned int len, bool) {
+  if (!connected() || len + strlen(topic) + 7 > bufferSize) return false;
+  published.push_back({topic, std::vector<uint8_t>(payload, payload + len)});
+  if (session.count(topic)) inbox.push_back(published.back());
+  return true;
+}
+
+bool PubSubClient::beginPublish(const char *topic, unsigned int plength, bool) {
+  if (!connected()) return false;
+  streaming = {topic, {}};
+  streamingLen = plength;
+  return true;
+}
+
+size_t PubSubClient::write(const uint8_t *buf, size_t size) {
+  streaming.payload.insert(streaming.payload.end(), buf, buf + size);
+  return size;
+}
+
+int PubSubClient::endPublish() {
+  if (!connected() || streaming.payload.size() != streamingLen) return 0;
+  published.push_back(std::move(streaming));
+  return 1;
+}
+
+// Preferences
+
+bool Preferences::begin(const char *name, bool) {
+  ns = &nvs[name];
+  return true;
+}
+
+bool Preferences::clear() {
+  if (ns) ns->clear();
+  return ns != nullptr;
+}
+
+size_t Preferences::putString(const char *key, const String &v) {
+  return putBytes(key, v.c_str(), v.length());
+}
+
+String Preferences::getString(const char *key, const String &def) {
+  if (!ns || !ns->count(key)) return def;
+  return String((*ns)[key]);
+}
+
+size_t Preferences::putBytes(const char *key, const void *v, size_t len) {
+  if (!ns) return 0;
+  (*ns)[key].assign((const char *)v, len);
+  return len;
+}
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t len) {
+  if (!ns || !ns->count(key)) return 0;
+  const std::string &v = (*ns)[key];
+  if (v.size() > len) return 0;
+  memcpy(buf, v.data(), v.size());
+  return v.size();
+}
+
+// SPIFFS
+
+bool File::seek(uint32_t p) {
+  if (!data || p > data->size()) return false;
+  pos = p;
+  return true;
+}
+
+size_t File::read(uint8_t *buf, size_t len) {
+  if (!data) return 0;
+  size_t n = std::min(len, data->size() - pos);
+  memcpy(buf, data->data() + pos, n);
+  pos += n;
+  return n;
+}
+
+size_t File::write(const uint8_t *buf, size_t len) {
+  if (!data) return 0;
+  if (data->size() < pos + len) data->resize(pos + len);
+  memcpy(data->data() + pos, buf, len);
+  pos += len;
+  return len;
+}
+
+File SPIFFSClass::open(const char *path, const char *mode) {
+  auto it = files.find(path);
+  if (mode[0] == 'w') {
+    files[path] = std::make_shared<std::vector<uint8_t>>();
+    return File(files[path], false);
+  }
+  if (mode[0] == 'a') {
+    if (it == files.end()) it = files.emplace(path, std::make_shared<std::vector<uint8_t>>()).first;
+    return File(it->second, true);
+  }
+  return it == files.end() ? File() : File(it->second, false);
+}
+
+bool SPIFFSClass::remove(const char *path) { return files.erase(path) > 0; }
+bool SPIFFSClass::exists(const char *path) { return files.count(path) > 0; }
+
+// IRremoteESP8266
+
+IRrecv::IRrecv(uint16_t, uint16_t bufsize, uint8_t, bool) : bufsize(bufsize) { receivers++; }
+IRrecv::~IRrecv() { receivers--; }
+
+bool IRrecv::decode(decode_results *results) {
+  if (captures.empty()) return false;
+  current = captures.front();
+  captures.pop_front();
+  *results = current.results;
+  results->overflow = current.raw.size() > bufsize;
+  if (results->overflow) current.raw.resize(bufsize);
+  results->rawbuf = current.raw.data();
+  results->rawlen = current.raw.size();
+  return true;
+}
+
+void IRsend::sendRaw(const uint16_t *buf, uint16_t len, uint16_t khz) {
+  transmitted.push_back({UNKNOWN, std::vector<uint16_t>(buf, buf + len), {}, 0, 0, khz});
+}
+
+bool IRsend::send(decode_type_t type, const uint8_t *state, uint16_t nbytes) {
+  transmitted.push_back({type, {}, std::vector<uint8_t>(state, state + nbytes), 0, (uint16_t)(nbytes * 8)});
+  return true;
+}
+
+bool IRsend::send(decode_type_t type, uint64_t data, uint16_t nbits, uint16_t) {
+  transmitted.push_back({type, {}, {}, data, nbits});
+  return true;
+}
+
+static const struct {
+  decode_type_t type;
+  const char   *name;
+} kProtocols[] = {
+  {NEC, "NEC"}, {SONY, "SONY"}, {COOLIX, "COOLIX"}, {DAIKIN, "DAIKIN"}, {GREE, "GREE"},
+};
+
+String typeToString(decode_type_t protocol, bool) {
+  for (auto &p : kProtocols) {
+    if (p.type == protocol) return p.name;
+  }
+  return "UNKNOWN";
+}
+
+decode_type_t strToDecodeType(const char *str) {
+  for (auto &p : kProtocols) {
+    if (strcmp(p.name, str) == 0) return p.type;
+  }
+  return UNKNOWN;
+}
+
+bool hasACState(decode_type_t protocol) { return protocol == DAIKIN || protocol == GREE; }
+
+stdAc::opmode_t IRac::strToOpmode(const char *str, stdAc::opmode_t def) {
+  static const char *names[] = {"auto", "cool", "heat", "dry", "fan"};
+  for (int i = 0; i < 5; i++) {
+    if (strcmp(names[i], str) == 0) return (stdAc::opmode_t)i;
+  }
+  return strcmp(str, "off") == 0 ? stdAc::opmode_t::kOff : def;
+}
+
+stdAc::fanspeed_t IRac::strToFanspeed(const char *str, stdAc::fanspeed_t def) {
+  static const char *names[] = {"auto", "min", "low", "medium", "high", "max"};
+  for (int i = 0; i < 6; i++) {
+    if (strcmp(names[i], str) == 0) return (stdAc::fanspeed_t)i;
+  }
+  return def;
+}
+
+stdAc::swingv_t IRac::strToSwingV(const char *str, stdAc::swingv_t def) {
+  if (strcmp(str, "off") == 0) return stdAc::swingv_t::kOff;
+  if (strcmp(str, "auto") == 0) return stdAc::swingv_t::kAuto;
+  return def;
+}
+
+bool IRac::sendAc() { return sendAc(next); }
+
+bool IRac::sendAc(const stdAc::state_t desired, const stdAc::state_t *) {
+  uint8_t state[2] = {(uint8_t)desired.degrees, desired.power};
+  transmitted.push_back({desired.protocol, {}, std::vector<uint8_t>(state, state + 2), 0, 16});
+  return true;
+}
+
+bool IRAcUtils::decodeToState(const decode_results *decode, stdAc::state_t *result,
+                              const stdAc::state_t *) {
+  if (!hasACState(decode->decode_type)) return false;
+  result->protocol = decode->decode_type;
+  return true;
+}
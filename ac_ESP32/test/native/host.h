@@ -0,0 +1,75 @@
+#pragma once
+
+// Test-side controls for the host build: a manual clock, the broker end
+// of PubSubClient, the IR receiver and LED, and allocation counters.
+
+#include <Arduino.h>
+#include <IRremoteESP8266.h>
+
+#include <string>
+#include <vector>
+
+struct HostMessage {
+  std::string          topic;
+  std::vector<uint8_t> payload;
+};
+
+struct HostTransmit {
+  decode_type_t         protocol;  // UNKNOWN for sendRaw
+  std::vector<uint16_t> timings;
+  std::vector<uint8_t>  state;
+  uint64_t              value;
+  uint16_t              bits;
+  uint16_t              khz = 0;   // Carrier of sendRaw
+};
+
+struct HostAllocs {
+  uint64_t count;
+  uint64_t bytes;
+  uint64_t live;  // Held right now
+  uint64_t peak;  // Most held at once since hostResetPeak()
+};
+
+// Clears published/transmitted logs, Preferences, SPIFFS, the broker,
+// Wi-Fi and the clock.
+void hostReset();
+
+void hostAdvance(uint32_t ms);
+
+// The broker: while disconnected, connect() fails. Dropping the session
+// is a broker restart without persistence.
+void hostSetConnected(bool connected);
+void hostDropSession();
+uint32_t hostConnects();    // connect() calls since start
+uint32_t hostSubscribes();  // subscribe() calls since start
+
+// Calls the callback registered with PubSubClient::setCallback(). While
+// the device is offline, the session queues messages to subscribed
+// topics for its next loop() and drops the rest. Messages that do not
+// fit the client's buffer are dropped, as on the device.
+void hostDeliver(const char *topic, const uint8_t *payload, size_t len);
+void hostDeliver(const char *topic, const char *payload);
+
+// Queues a receiver capture. Raw ticks as IRrecv stores them, rawbuf[0]
+// being the idle gap, or a decoded protocol frame. Captures wait for a
+// receiver to exist.
+void hostCapture(const std::vector<uint16_t> &rawTicks);
+void hostCapture(decode_type_t protocol, const uint8_t *state, uint8_t nbytes);
+uint32_t hostReceivers();  // IRrecv objects alive
+
+// Drives an input pin, HIGH until set; a change runs the interrupt
+// attached to it.
+void hostSetPin(uint8_t pin, int level);
+
+std::vector<HostMessage> &hostPublished();
+std::vector<HostTransmit> &hostTransmitted();
+
+// Global operator new calls since start. The command store's malloc
+// block is not counted.
+HostAllocs hostAllocs();
+void hostResetPeak();
+
+// Time callers spent blocked on a full Serial FIFO since start.
+uint64_t hostSerialBlockedUs();
+
+extern bool hostSerialEcho;  // Serial output to stdout, on by default
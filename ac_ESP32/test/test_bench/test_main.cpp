@@ -0,0 +1,293 @@
+#include <unity.h>
+
+#include <ArduinoJson.h>
+#include <PubSubClient.h>
+#include <chrono>
+#include <map>
+#include <string>
+#include <string_view>
+
+#include "command_store.h"
+#include "fixtures.h"
+#include "host.h"
+#include "ir_codec.h"
+#include "library_frame.h"
+#include "send_queue.h"
+#include "topics.h"
+
+// Throughput and allocation counts for the hot paths. Numbers are
+// printed, not asserted, except where a path must not allocate at all.
+// AC_BENCH_SCALE multiplies the iteration counts.
+
+extern CommandLibrary commandLibrary;
+extern PubSubClient client;
+void setup();
+void loop();
+
+static const int kBenchCommands = 200;
+
+struct BenchResult {
+  double   nsPerOp;
+  double   allocsPerOp;
+};
+
+template <typename F>
+static BenchResult bench(const char *name, int iterations, F body) {
+  const char *scale = getenv("AC_BENCH_SCALE");
+  if (scale) iterations *= atoi(scale);
+  body(0);  // Warm up
+
+  HostAllocs before = hostAllocs();
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) body(i);
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  HostAllocs after = hostAllocs();
+
+  BenchResult r = {ns / iterations, (double)(after.count - before.count) / iterations};
+  printf("%-28s %10.0f ns/op %8.2f allocs/op %10.0f bytes/op\n", name, r.nsPerOp,
+         r.allocsPerOp, (double)(after.bytes - before.bytes) / iterations);
+  return r;
+}
+
+static std::vector<FixtureCommand> library(int n = kBenchCommands) {
+  std::vector<FixtureCommand> commands;
+  for (int i = 0; i < n; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "cmd_%03d", i);
+    commands.push_back({name, fixtureFrame(0x20DF0000 | i * 2654435761u)});
+  }
+  return commands;
+}
+
+// A snapshot as the backend publishes it: whole when it fits the
+// client's buffer, else in parts.
+static std::vector<HostMessage> snapshotMessages(const std::vector<uint8_t> &snap) {
+  if (snap.size() + strlen(topicFor(kTopicLibrary)) + 7 <= client.bufferSize) {
+    return {{topicFor(kTopicLibrary), snap}};
+  }
+  std::vector<HostMessage> out;
+  for (auto &part : fixtureParts(snap, 1, 3072)) out.push_back({topicFor(kTopicLibraryPart), part});
+  return out;
+}
+
+static void deliver(const std::vector<HostMessage> &messages) {
+  for (const HostMessage &m : messages) hostDeliver(m.topic.c_str(), m.payload.data(), m.payload.size());
+}
+
+void setUp() {}
+void tearDown() {}
+
+static void test_bench_parse() {
+  const char *req = "{\"id\":\"scene\",\"steps\":[{\"name\":\"cmd_001\"},"
+                    "{\"name\":\"cmd_002\",\"delay\":200,\"group\":\"temp\"},"
+                    "{\"name\":\"cmd_003\",\"repeat\":2}]}";
+  size_t len = strlen(req);
+  bench("parse send request", 20000, [&](int) {
+    StaticJsonDocument<1024> doc;
+    deserializeJson(doc, req, len);
+  });
+}
+
+static void test_bench_encode_decode() {
+  std::vector<uint16_t> timings = fixtureFrame(0x20DF10EF);
+  std::vector<uint8_t> blob;
+  bench("irEncode 67 pulses", 20000, [&](int) {
+    blob.clear();
+    irEncode(timings.data(), timings.size(), 50, blob);
+  });
+
+  uint16_t out[128];
+  BenchResult r = bench("irDecode 67 pulses", 50000, [&](int) {
+    irDecode(blob.data(), blob.size(), out, 128);
+  });
+  TEST_ASSERT_EQUAL_FLOAT(0, r.allocsPerOp);
+
+  // The {"timings": [...]} form saves and snapshots used before the codec.
+  std::string json;
+  bench("JSON write 67 pulses", 20000, [&](int) {
+    json = "{\"timings\":[";
+    for (size_t i = 0; i < timings.size(); i++) {
+      char num[8];
+      snprintf(num, sizeof(num), i ? ",%u" : "%u", timings[i]);
+      json += num;
+    }
+    json += "]}";
+  });
+  bench("JSON read 67 pulses", 20000, [&](int) {
+    DynamicJsonDocument doc(4096);
+    deserializeJson(doc, json.data(), json.size());
+    size_t n = 0;
+    for (JsonVariantConst t : doc["timings"].as<JsonArrayConst>()) out[n++] = t | 0;
+  });
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(timings.data(), out, timings.size());
+  printf("67 pulses: %u bytes encoded, %u as JSON, %.2fx\n", (unsigned)blob.size(),
+         (unsigned)json.size(), (double)json.size() / blob.size());
+}
+
+static void test_bench_snapshot() {
+  std::vector<uint8_t> snap = fixtureSnapshot(1, library());
+  std::vector<HostMessage> parts = snapshotMessages(snap);
+  printf("snapshot: %u commands, %u bytes in %u messages\n", kBenchCommands,
+         (unsigned)snap.size(), (unsigned)parts.size());
+  bench("dev/<device>/library/part", 200, [&](int) { deliver(parts); });
+  TEST_ASSERT_EQUAL(kBenchCommands, commandLibrary.live().size());
+
+  std::vector<uint8_t> lz = fixtureCompress(snap);
+  printf("compressed: %u bytes, %.2fx\n", (unsigned)lz.size(), (double)snap.size() / lz.size());
+  std::vector<HostMessage> packed = snapshotMessages(lz);
+  bench("compressed snapshot", 200, [&](int) { deliver(packed); });
+  TEST_ASSERT_EQUAL(kBenchCommands, commandLibrary.live().size());
+
+  // The decoder alone; its window is the only allocation.
+  std::vector<uint8_t> out(snap.size());
+  const uint8_t *stream = lz.data() + 1;
+  uint32_t size;
+  irReadVarint(stream, lz.data() + lz.size(), size);
+  BenchResult r = bench("LzDecoder::read", 500, [&](int) {
+    LzDecoder dec;
+    dec.begin(stream, lz.data() + lz.size() - stream);
+    TEST_ASSERT_EQUAL(size, dec.read(out.data(), out.size()));
+  });
+  printf("%-28s %10.1f MB/s\n", "", snap.size() * 1e3 / r.nsPerOp);
+  TEST_ASSERT_TRUE(out == snap);
+}
+
+// Parsing alone, into a store of the firmware's size, up to the most
+// commands it indexes; past its arena, cold timings are evicted. Peak
+// heap is what the library fills in the store plus the most the reader
+// held at once. In parts, that is one record and the window, however
+// long the snapshot.
+static void test_bench_snapshot_scaling() {
+  for (int n : {10, 100, kStoreMaxCommands}) {
+    std::vector<uint8_t> snap = fixtureSnapshot(1, library(n));
+    std::vector<uint8_t> lz = fixtureCompress(snap);
+    CommandStore store;
+    TEST_ASSERT_TRUE(store.begin());
+    auto load = [&](const LibraryRecord &rec) {
+      uint16_t *timings = store.put(rec.name, rec.nameLen, rec.pulses, rec.format);
+      irDecode(rec.blob, rec.blobLen, timings, rec.pulses);
+      store.seal(rec.name, rec.nameLen);
+    };
+    for (bool parts : {false, true}) {
+      for (const std::vector<uint8_t> *in : {&snap, &lz}) {
+        char name[48];
+        snprintf(name, sizeof(name), "parse %d commands%s%s", n, in == &lz ? " (lz)" : "",
+                 parts ? " in parts" : "");
+        uint64_t peak = 0;
+        bench(name, 5000 / n, [&](int) {
+          hostResetPeak();
+          uint64_t base = hostAllocs().live;
+          store.reset();
+          LibraryRecord rec;
+          if (parts) {
+            LibraryStream stream;
+            stream.begin(in->size());
+            for (size_t at = 0; at < in->size(); at += 3072) {
+              stream.feed(in->data() + at, std::min<size_t>(3072, in->size() - at));
+              while (stream.next(rec)) load(rec);
+            }
+          } else {
+            LibraryReader reader(in->data(), in->size());
+            while (reader.next(rec)) load(rec);
+          }
+          peak = std::max(peak, hostAllocs().peak - base);
+        });
+        TEST_ASSERT_EQUAL(n, store.size());
+        size_t block = store.indexBytes() + store.stats().usedBytes;  // What the library fills
+        printf("%-28s %10u bytes in, %u peak heap (%u store, %u reader), %u resident\n", "",
+               (unsigned)in->size(), (unsigned)(block + peak), (unsigned)block, (unsigned)peak,
+               store.stats().resident);
+      }
+    }
+  }
+}
+
+static void test_bench_lookup() {
+  char names[kBenchCommands][16];
+  for (int i = 0; i < kBenchCommands; i++) snprintf(names[i], 16, "cmd_%03d", i);
+  CommandView cmd;
+  int hits = 0;
+  BenchResult r = bench("CommandStore::find", 200000, [&](int i) {
+    const char *name = names[(i * 7) % kBenchCommands];
+    hits += commandLibrary.live().find(name, 7, cmd);
+  });
+  TEST_ASSERT_EQUAL_FLOAT(0, r.allocsPerOp);
+  TEST_ASSERT_GREATER_THAN(0, hits);
+
+  // The std::map the store replaced, keyed the same way.
+  std::vector<FixtureCommand> commands = library();
+  std::map<std::string, std::vector<uint16_t>, std::less<>> map;
+  bench("std::map rebuild", 200, [&](int) {
+    map.clear();
+    for (const FixtureCommand &c : commands) map[c.first] = c.second;
+  });
+  int mapHits = 0;
+  bench("std::map find", 200000, [&](int i) {
+    std::string_view name(names[(i * 7) % kBenchCommands], 7);
+    mapHits += map.find(name) != map.end();
+  });
+  TEST_ASSERT_EQUAL(hits, mapHits);
+
+  CommandStore store;
+  TEST_ASSERT_TRUE(store.begin());
+  bench("CommandStore rebuild", 200, [&](int) {
+    store.reset();
+    for (const FixtureCommand &c : commands) {
+      uint16_t *t = store.put(c.first.data(), c.first.size(), c.second.size());
+      memcpy(t, c.second.data(), c.second.size() * sizeof(uint16_t));
+      store.seal(c.first.data(), c.first.size());
+    }
+  });
+  TEST_ASSERT_EQUAL(kBenchCommands, store.size());
+
+  uint64_t before = hostAllocs().live;
+  map.clear();
+  uint64_t after = hostAllocs().live;
+  printf("%-28s %10u bytes in std::map, %u in the store\n", "", (unsigned)(before - after),
+         (unsigned)(store.indexBytes() + store.stats().usedBytes));
+}
+
+static void test_bench_dispatch() {
+  // MQTT message in, frame out: parse, queue, lookup, sendRaw. The host
+  // clock only moves while Serial blocks, so the simulated latency is
+  // the time a 9600 baud UART would hold the send path.
+  size_t before = hostTransmitted().size();
+  uint64_t blockedBefore = hostSerialBlockedUs();
+  uint64_t latencyUs = 0;
+  int n = 0;
+  bench("send dispatch to sendRaw", 5000, [&](int i) {
+    char req[48];
+    snprintf(req, sizeof(req), "{\"name\":\"cmd_%03d\"}", i % kBenchCommands);
+    hostAdvance(kInterFrameGapMs);
+    loop();  // Idle iteration, drains pending output
+    unsigned long start = micros();
+    hostDeliver(topicFor(kTopicSend), req);
+    loop();
+    latencyUs += micros() - start;
+    n++;
+  });
+  printf("%-28s %10.0f us/op blocked on Serial, %.0f us/op simulated latency\n", "",
+         (double)(hostSerialBlockedUs() - blockedBefore) / n, (double)latencyUs / n);
+  TEST_ASSERT_EQUAL(n, hostTransmitted().size() - before);
+  hostTransmitted().clear();
+  hostPublished().clear();
+}
+
+int main() {
+  hostReset();
+  hostSerialEcho = getenv("AC_HOST_VERBOSE") != nullptr;
+  setup();
+  for (int i = 0; i < 1000; i++) {  // Wi-Fi, broker and session probe
+    loop();
+    hostAdvance(5);
+  }
+
+  UNITY_BEGIN();
+  RUN_TEST(test_bench_parse);
+  RUN_TEST(test_bench_encode_decode);
+  RUN_TEST(test_bench_snapshot);
+  RUN_TEST(test_bench_snapshot_scaling);
+  RUN_TEST(test_bench_lookup);
+  RUN_TEST(test_bench_dispatch);
+  return UNITY_END();
+}
@@ -0,0 +1,574 @@
+#include <unity.h>
+
+#include <map>
+#include <string>
+
+#include "buttons.h"
+#include "command_store.h"
+#include "fixtures.h"
+#include "host.h"
+#include "ir_codec.h"
+#include "learn_pipeline.h"
+#include "library_frame.h"
+#include "log.h"
+#include "metrics.h"
+#include "send_queue.h"
+#include "spsc_queue.h"
+#include "topics.h"
+
+void setUp() {}
+void tearDown() {}
+
+static void test_codec_round_trip() {
+  std::vector<uint16_t> timings = fixtureFrame(0x20DF10EF);
+  timings.push_back(40000);
+  std::vector<uint8_t> blob;
+  irEncode(timings.data(), timings.size(), 50, blob);
+  TEST_ASSERT_LESS_THAN(timings.size(), blob.size());  // Under a byte per pulse
+
+  std::vector<uint16_t> out;
+  TEST_ASSERT_TRUE(irDecode(blob.data(), blob.size(), out));
+  TEST_ASSERT_EQUAL(timings.size(), out.size());
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(timings.data(), out.data(), timings.size());
+}
+
+static void test_codec_repeat_frame() {
+  std::vector<uint16_t> frame = fixtureFrame(0x1234);
+  frame.push_back(20000);
+  std::vector<uint8_t> blob;
+  irEncode(frame.data(), frame.size(), 50, blob, 3);
+
+  IrCodecHeader hdr;
+  TEST_ASSERT_TRUE(irReadHeader(blob.data(), blob.size(), hdr));
+  TEST_ASSERT_EQUAL(kIrRepeatVersion, hdr.version);
+  TEST_ASSERT_EQUAL(frame.size() + 1, hdr.count);
+
+  std::vector<uint16_t> out;
+  TEST_ASSERT_TRUE(irDecode(blob.data(), blob.size(), out));
+  TEST_ASSERT_EQUAL(3, out[0]);
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(frame.data(), out.data() + 1, frame.size());
+}
+
+static void test_codec_rejects_truncation() {
+  std::vector<uint16_t> timings = fixtureFrame(0xFFFF0000);
+  std::vector<uint8_t> blob;
+  irEncode(timings.data(), timings.size(), 50, blob);
+  std::vector<uint16_t> out;
+  for (size_t len = 0; len < blob.size(); len++) {
+    TEST_ASSERT_FALSE(irDecode(blob.data(), len, out));
+  }
+}
+
+static void test_store_matches_map() {
+  CommandStore store;
+  TEST_ASSERT_TRUE(store.begin(4096, 32));
+  std::map<std::string, uint16_t> model;
+  for (int round = 0; round < 500; round++) {
+    std::string name = "cmd" + std::to_string(round * 7 % 40);
+    if (round % 5 == 4) {
+      TEST_ASSERT_EQUAL(model.erase(name) > 0, store.remove(name.data(), name.size()));
+      continue;
+    }
+    uint16_t n = 1 + round % 60;
+    uint16_t *t = store.put(name.data(), name.size(), n);
+    if (!t) {
+      TEST_ASSERT_TRUE(model.size() >= 32 || !model.count(name));
+      continue;
+    }
+    for (uint16_t i = 0; i < n; i++) t[i] = round;
+    model[name] = n;
+  }
+
+  TEST_ASSERT_EQUAL(model.size(), store.size());
+  CommandView cmd;
+  for (auto &m : model) {
+    TEST_ASSERT_TRUE(store.find(m.first.data(), m.first.size(), cmd));
+    TEST_ASSERT_EQUAL(m.second, cmd.count);
+  }
+  store.compact();
+  TEST_ASSERT_EQUAL(0, store.stats().fragmentation);
+  TEST_ASSERT_TRUE(store.verify());
+}
+
+static void test_store_evicts_coldest() {
+  CommandStore store;
+  TEST_ASSERT_TRUE(store.begin(512, 16));  // Two 100-pulse commands at a time
+  auto add = [&store](const char *name, uint16_t value) {
+    uint16_t *t = store.put(name, strlen(name), 100);
+    TEST_ASSERT_NOT_NULL(t);
+    for (int i = 0; i < 100; i++) t[i] = value;
+    return store.seal(name, strlen(name));
+  };
+  uint32_t hashA = add("a", 1);
+  add("b", 2);
+  for (int i = 0; i < kStorePinHits; i++) store.touch("a", 1);
+  store.touch("b", 1);
+
+  // b was used last, but a is pinned.
+  add("c", 3);
+  CommandView cmd;
+  TEST_ASSERT_FALSE(store.find("b", 1, cmd));
+  TEST_ASSERT_TRUE(store.known("b", 1));
+  TEST_ASSERT_TRUE(store.find("a", 1, cmd));
+  add("d", 4);
+  TEST_ASSERT_FALSE(store.find("c", 1, cmd));
+
+  CommandStoreStats st = store.stats();
+  TEST_ASSERT_EQUAL(4, st.commands);
+  TEST_ASSERT_EQUAL(2, st.resident);
+  TEST_ASSERT_EQUAL(1, st.pinned);
+  TEST_ASSERT_EQUAL(2, st.evicted);
+  TEST_ASSERT_EQUAL(hashA, store.hashOf("a", 1));
+  TEST_ASSERT_NOT_EQUAL(0, store.hashOf("b", 1));
+  TEST_ASSERT_FALSE(store.rename("b", 1, "e", 1));  // Its hash needs the timings
+
+  // Too big even for an empty arena: nothing is evicted for it.
+  TEST_ASSERT_NULL(store.put("huge", 4, 400));
+  TEST_ASSERT_EQUAL(2, store.stats().resident);
+  // Nor is a command replaced by one that cannot fit.
+  TEST_ASSERT_NULL(store.put("a", 1, 400));
+  TEST_ASSERT_TRUE(store.find("a", 1, cmd));
+  TEST_ASSERT_EQUAL(100, cmd.count);
+  TEST_ASSERT_EQUAL(hashA, store.hashOf("a", 1));
+
+  // Fetched back, the command hashes as it did before eviction.
+  uint32_t hashB = store.hashOf("b", 1);
+  TEST_ASSERT_EQUAL(hashB, add("b", 2));
+  TEST_ASSERT_TRUE(store.find("a", 1, cmd));
+  TEST_ASSERT_EQUAL(1, cmd.timings[99]);
+  TEST_ASSERT_TRUE(store.verify());
+}
+
+static void test_library_snapshot_and_delta() {
+  std::vector<uint8_t> snap = fixtureSnapshot(7, {{"on", fixtureFrame(1)}, {"off", fixtureFrame(2)}});
+  uint32_t pulses;
+  TEST_ASSERT_TRUE(LibraryReader::validate(snap.data(), snap.size(), &pulses));
+  TEST_ASSERT_EQUAL(2 * 67, pulses);
+
+  LibraryReader reader(snap.data(), snap.size());
+  TEST_ASSERT_EQUAL(7, reader.version());
+  TEST_ASSERT_EQUAL(2, reader.count());
+  uint32_t hash = 0;
+  LibraryRecord rec;
+  while (reader.next(rec)) {
+    std::vector<uint16_t> t;
+    TEST_ASSERT_TRUE(irDecode(rec.blob, rec.blobLen, t));
+    hash += libraryEntryHash(rec.name, rec.nameLen, t.data(), t.size());
+  }
+  TEST_ASSERT_FALSE(reader.failed());
+  TEST_ASSERT_EQUAL_HEX32(reader.hash(), hash);
+
+  // The compressed form walks to the same records.
+  std::vector<uint8_t> lz = fixtureCompress(snap);
+  LibraryReader packed(lz.data(), lz.size());
+  TEST_ASSERT_TRUE(packed.compressed());
+  TEST_ASSERT_EQUAL(7, packed.version());
+  TEST_ASSERT_EQUAL_HEX32(reader.hash(), packed.hash());
+  LibraryReader plain(snap.data(), snap.size());
+  LibraryRecord want;
+  while (plain.next(want)) {
+    TEST_ASSERT_TRUE(packed.next(rec));
+    TEST_ASSERT_EQUAL_STRING_LEN(want.name, rec.name, want.nameLen);
+    TEST_ASSERT_EQUAL(want.blobLen, rec.blobLen);
+    TEST_ASSERT_EQUAL_MEMORY(want.blob, rec.blob, want.blobLen);
+  }
+  TEST_ASSERT_FALSE(packed.next(rec));
+  TEST_ASSERT_FALSE(packed.failed());
+  lz.pop_back();
+  TEST_ASSERT_FALSE(LibraryReader::validate(lz.data(), lz.size()));
+
+  snap.pop_back();
+  TEST_ASSERT_FALSE(LibraryReader::validate(snap.data(), snap.size()));
+
+  std::vector<uint8_t> up = fixtureUpsert(8, {"fan", fixtureFrame(3)});
+  LibraryDelta delta;
+  TEST_ASSERT_TRUE(readLibraryDelta(up.data(), up.size(), delta));
+  TEST_ASSERT_EQUAL(kOpUpsert, delta.op);
+  TEST_ASSERT_EQUAL(8, delta.version);
+  TEST_ASSERT_EQUAL_STRING_LEN("fan", delta.rec.name, delta.rec.nameLen);
+}
+
+static void test_library_stream_in_pieces() {
+  std::vector<FixtureCommand> commands;
+  for (int i = 0; i < 20; i++) commands.push_back({"cmd_" + std::to_string(i), fixtureFrame(i)});
+  std::vector<uint8_t> snap = fixtureSnapshot(9, commands);
+  std::vector<uint8_t> lz = fixtureCompress(snap);
+
+  // A byte at a time splits every field and match token somewhere. The
+  // first piece holds the compressed prefix.
+  for (const std::vector<uint8_t> *in : {&snap, &lz}) {
+    LibraryStream stream;
+    stream.begin(in->size());
+    LibraryReader plain(snap.data(), snap.size());
+    LibraryRecord rec, want;
+    size_t records = 0;
+    for (size_t i = 0; i < in->size(); i += i ? 1 : 1 + kIrVarintMax) {
+      stream.feed(in->data() + i, i ? 1 : 1 + kIrVarintMax);
+      while (stream.next(rec)) {
+        TEST_ASSERT_TRUE(plain.next(want));
+        TEST_ASSERT_EQUAL_STRING_LEN(want.name, rec.name, want.nameLen);
+        TEST_ASSERT_EQUAL_MEMORY(want.blob, rec.blob, want.blobLen);
+        records++;
+      }
+      TEST_ASSERT_FALSE(stream.failed());
+    }
+    TEST_ASSERT_TRUE(stream.done());
+    TEST_ASSERT_EQUAL(commands.size(), records);
+    TEST_ASSERT_EQUAL(9, stream.version());
+    TEST_ASSERT_EQUAL_HEX32(plain.hash(), stream.hash());
+    TEST_ASSERT_EQUAL(in == &lz, stream.compressed());
+  }
+
+  // Cut short, it never gets done.
+  LibraryStream stream;
+  stream.begin(snap.size());
+  stream.feed(snap.data(), snap.size() - 1);
+  LibraryRecord rec;
+  while (stream.next(rec)) {}
+  TEST_ASSERT_FALSE(stream.done());
+
+  // A blob length past kLibraryRecordMax is malformed, not waited for.
+  std::vector<uint8_t> big = fixtureSnapshot(1, {});
+  big.back() = 1;  // One record
+  big.insert(big.end(), {1, 'x', 0xFF, 0xFF, 0x03});
+  stream.begin(big.size() + 100000);
+  stream.feed(big.data(), big.size());
+  TEST_ASSERT_FALSE(stream.next(rec));
+  TEST_ASSERT_TRUE(stream.failed());
+}
+
+static unsigned long queueNow = 0;
+static std::vector<std::string> queueSent;
+
+static unsigned long queueClock() { return queueNow; }
+static bool queueTransmit(const char *name, void *) {
+  queueSent.push_back(name);
+  return strcmp(name, "missing") != 0;
+}
+
+static void test_send_queue_supersedes_group() {
+  SendQueue q;
+  int a = q.beginBatch("a");
+  q.add(a, "temp_22", 0, 1, "temp");
+  q.add(a, "missing");
+  q.endBatch(a);
+  int b = q.beginBatch("b");
+  q.add(b, "temp_24", 0, 2, "temp");
+  q.endBatch(b);
+
+  for (int i = 0; i < 20; i++, queueNow += kInterFrameGapMs) q.service(queueClock, queueTransmit, nullptr);
+  TEST_ASSERT_EQUAL(3, queueSent.size());
+  TEST_ASSERT_EQUAL_STRING("missing", queueSent[0].c_str());
+  TEST_ASSERT_EQUAL_STRING("temp_24", queueSent[2].c_str());
+
+  SendBatchResult r;
+  TEST_ASSERT_TRUE(q.pollCompleted(r));
+  TEST_ASSERT_EQUAL_STRING("a", r.tag);
+  TEST_ASSERT_EQUAL(1, r.superseded);
+  TEST_ASSERT_EQUAL(1, r.failed);
+  TEST_ASSERT_TRUE(q.pollCompleted(r));
+  TEST_ASSERT_EQUAL(1, r.sent);
+}
+
+static void test_learn_consensus_folds_repeats() {
+  std::vector<uint16_t> frame = fixtureFrame(0xA5A5);
+  frame.push_back(30000);
+  std::vector<std::vector<uint32_t>> captures;
+  for (int c = 0; c < 3; c++) {
+    std::vector<uint32_t> cap;
+    for (int k = 0; k < 2; k++) {
+      for (size_t i = 0; i < frame.size(); i++) cap.push_back(frame[i] + (i * 37 + c * 11) % 100 - 50);
+    }
+    cap.pop_back();
+    captures.push_back(cap);
+  }
+  captures[1][20] = 9000;  // One bad pulse is outvoted
+  captures.push_back({550, 550, 550});  // So is a short capture
+
+  LearnResult r;
+  TEST_ASSERT_TRUE(learnConsensus(captures, r));
+  TEST_ASSERT_EQUAL(2, r.repeat);
+  TEST_ASSERT_EQUAL(frame.size(), r.frame.size());
+  TEST_ASSERT_EQUAL(5, r.widths);
+  TEST_ASSERT_EQUAL(3, r.agreeing);
+  TEST_ASSERT_INT_WITHIN(5, 74, r.confidence);
+  for (size_t i = 0; i < frame.size(); i++) TEST_ASSERT_UINT16_WITHIN(100, frame[i], r.frame[i]);
+
+  // More copies than the repeat count holds fold into a unit of two.
+  std::vector<uint32_t> burst;
+  for (int k = 0; k < 300; k++) burst.insert(burst.end(), {500, 1500});
+  burst.pop_back();
+  TEST_ASSERT_TRUE(learnConsensus({burst, burst, burst}, r));
+  TEST_ASSERT_EQUAL(150, r.repeat);
+  const uint16_t unit[] = {500, 1500, 500, 1500};
+  TEST_ASSERT_EQUAL(4, r.frame.size());
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(unit, r.frame.data(), 4);
+
+  // With no such unit, the capture stays whole.
+  burst.resize(257 * 2 - 1);
+  TEST_ASSERT_TRUE(learnConsensus({burst, burst, burst}, r));
+  TEST_ASSERT_EQUAL(1, r.repeat);
+  TEST_ASSERT_EQUAL(burst.size(), r.frame.size());
+}
+
+static void test_learn_splits_long_gaps() {
+  std::vector<uint16_t> split;
+  learnAppendWidth(split, 90000);
+  learnAppendWidth(split, 550);
+  const uint16_t expected[] = {kLearnSplitUs, 0, 90000 - kLearnSplitUs, 550};
+  TEST_ASSERT_EQUAL(4, split.size());
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(expected, split.data(), 4);
+
+  // Two frames 90 ms apart fold into one frame ending in the split gap.
+  std::vector<uint16_t> frame = fixtureFrame(0x0FF0);
+  std::vector<uint32_t> cap(frame.begin(), frame.end());
+  cap.push_back(90000);
+  cap.insert(cap.end(), frame.begin(), frame.end());
+  LearnResult r;
+  TEST_ASSERT_TRUE(learnConsensus({cap, cap, cap}, r));
+  TEST_ASSERT_EQUAL(2, r.repeat);
+  TEST_ASSERT_EQUAL(frame.size() + 3, r.frame.size());
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(expected, r.frame.data() + frame.size(), 3);
+
+  // The zero survives the codec, the pieces come back exact.
+  std::vector<uint8_t> blob;
+  irEncode(r.frame.data(), r.frame.size(), 50, blob);
+  std::vector<uint16_t> out;
+  TEST_ASSERT_TRUE(irDecode(blob.data(), blob.size(), out));
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(expected, out.data() + frame.size(), 3);
+}
+
+static void test_spsc_queue_wraps() {
+  SpscQueue<int, 4> q;
+  int v;
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 4; i++) TEST_ASSERT_TRUE(q.push(round * 10 + i));
+    TEST_ASSERT_FALSE(q.push(99));
+    TEST_ASSERT_EQUAL(4, q.size());
+    for (int i = 0; i < 4; i++) {
+      TEST_ASSERT_TRUE(q.pop(v));
+      TEST_ASSERT_EQUAL(round * 10 + i, v);
+    }
+    TEST_ASSERT_FALSE(q.pop(v));
+  }
+}
+
+static void test_topics_scope_to_device() {
+  uint8_t mac[6] = {0x24, 0x6f, 0x28, 0x12, 0xab, 0x0c};
+  char dev[16];
+  topicDefaultDevice(mac, dev, sizeof(dev));
+  TEST_ASSERT_EQUAL_STRING("ac-12ab0c", dev);
+  TEST_ASSERT_FALSE(topicNameValid(""));
+  TEST_ASSERT_FALSE(topicNameValid("hall/ac"));
+  TEST_ASSERT_FALSE(topicNameValid("ac+"));
+
+  topicsBegin("hall", "office");
+  TEST_ASSERT_EQUAL_STRING("home/ac/dev/hall/send", topicFor(kTopicSend));
+  TEST_ASSERT_EQUAL_STRING("home/ac/dev/hall/save/part", topicFor(kTopicSavePart));
+  TEST_ASSERT_EQUAL_STRING("home/ac/lib/office/delta", topicFor(kTopicDelta));
+  for (uint8_t t = 0; t < kTopicSubscribed; t++) TEST_ASSERT_EQUAL(t, topicMatch(topicFor((Topic)t)));
+
+  // Another device's requests, and another library's changes, match nothing.
+  TEST_ASSERT_EQUAL(kTopicCount, topicMatch("home/ac/dev/hallway/send"));
+  TEST_ASSERT_EQUAL(kTopicCount, topicMatch("home/ac/dev/hal/send"));
+  TEST_ASSERT_EQUAL(kTopicCount, topicMatch("home/ac/lib/default/delta"));
+  TEST_ASSERT_EQUAL(kTopicCount, topicMatch("home/ac/dev/hall/status"));
+}
+
+static void test_library_pin_holds_copy() {
+  CommandLibrary lib;
+  TEST_ASSERT_TRUE(lib.begin(1024, 8));
+  uint16_t *t = lib.edit()->put("on", 2, 1);
+  *t = 100;
+  lib.publish();
+
+  // A reader keeps the copy it pinned while the writer moves on.
+  uint8_t slot;
+  CommandView held;
+  TEST_ASSERT_TRUE(lib.pin(slot).find("on", 2, held));
+  CommandStore *spare = lib.edit();
+  TEST_ASSERT_NOT_NULL(spare);
+  *spare->put("on", 2, 1) = 200;
+  lib.publish();
+  TEST_ASSERT_NULL(lib.edit());  // The copy `held` points into
+  TEST_ASSERT_EQUAL(100, held.timings[0]);
+
+  lib.unpin(slot);
+  CommandView now;
+  TEST_ASSERT_TRUE(lib.live().find("on", 2, now));
+  TEST_ASSERT_EQUAL(200, now.timings[0]);
+  spare = lib.edit();
+  TEST_ASSERT_NOT_NULL(spare);
+  TEST_ASSERT_TRUE(spare->find("on", 2, now));  // Seeded from the live copy
+  TEST_ASSERT_EQUAL(200, now.timings[0]);
+}
+
+static void test_send_queue_rejects_out_of_range() {
+  SendQueue q;
+  int a = q.beginBatch("a");
+  TEST_ASSERT_FALSE(q.add(a, "on", kSendDelayMaxMs + 1));
+  TEST_ASSERT_FALSE(q.add(a, "on", 0, kSendRepeatMax + 1));
+  TEST_ASSERT_FALSE(q.add(a, "on", 0, 0));
+  q.endBatch(a);
+  SendBatchResult r;
+  TEST_ASSERT_TRUE(q.pollCompleted(r));
+  TEST_ASSERT_EQUAL(3, r.steps);
+  TEST_ASSERT_EQUAL(3, r.failed);
+
+  int b = q.beginBatch("b");
+  TEST_ASSERT_TRUE(q.add(b, "on", kSendDelayMaxMs, kSendRepeatMax));
+  q.endBatch(b);
+}
+
+static void test_send_queue_waits_for_completion() {
+  SendQueue q;
+  int a = q.beginBatch("a");
+  q.add(a, "on", 0, 2);
+  q.endBatch(a);
+  TEST_ASSERT_EQUAL_STRING("on", q.due(0));
+  TEST_ASSERT_NULL(q.due(1000));  // Frame still out
+  q.complete(true, 500);
+  TEST_ASSERT_NULL(q.due(500 + kInterFrameGapMs - 1));  // Gap runs from the end
+  TEST_ASSERT_EQUAL_STRING("on", q.due(500 + kInterFrameGapMs));
+  q.complete(true, 600);
+  SendBatchResult r;
+  TEST_ASSERT_TRUE(q.pollCompleted(r));
+  TEST_ASSERT_EQUAL(1, r.sent);
+}
+
+// Steps the clock a millisecond at a time, counting button events.
+static int pollButtons(uint32_t ms, ButtonEvent &ev) {
+  int events = 0;
+  for (uint32_t i = 0; i < ms; i++) {
+    hostAdvance(1);
+    while (buttonsPoll(ev)) events++;
+  }
+  return events;
+}
+
+static void test_buttons_settle() {
+  static const int pins[] = {40};
+  buttonsBegin(pins, 1);
+  ButtonEvent ev;
+
+  // A glitch on a released button is no press.
+  hostSetPin(40, LOW);
+  pollButtons(5, ev);
+  hostSetPin(40, HIGH);
+  TEST_ASSERT_EQUAL(0, pollButtons(100, ev));
+
+  // A bouncing press, a glitch while held and a bouncing release make
+  // one event, timed from the first edge of each bounce.
+  hostSetPin(40, LOW);
+  pollButtons(2, ev);
+  hostSetPin(40, HIGH);
+  pollButtons(1, ev);
+  hostSetPin(40, LOW);
+  TEST_ASSERT_EQUAL(0, pollButtons(997, ev));
+  hostSetPin(40, HIGH);
+  pollButtons(3, ev);
+  hostSetPin(40, LOW);
+  TEST_ASSERT_EQUAL(0, pollButtons(997, ev));
+  hostSetPin(40, HIGH);
+  pollButtons(2, ev);
+  hostSetPin(40, LOW);
+  pollButtons(1, ev);
+  hostSetPin(40, HIGH);
+  TEST_ASSERT_EQUAL(1, pollButtons(100, ev));
+  TEST_ASSERT_EQUAL(0, ev.index);
+  TEST_ASSERT_EQUAL(2000, ev.heldMs);
+}
+
+static void test_metrics_report() {
+  metricsRecord(kStageLookup, 1);
+  metricsRecord(kStageLookup, 5);
+  metricsRecord(kStageLookup, 6);
+  metricsRecord(kStageTransmit, 4000000);
+  metricsCount(kCountUnknown, 3);
+  metricsHeap(150000, 90000);
+  metricsHeap(160000, 80000);
+
+  std::vector<uint8_t> report;
+  metricsEncode(42, report);
+  const uint8_t *p = report.data(), *end = p + report.size();
+  TEST_ASSERT_EQUAL(kMetricsVersion, *p++);
+  uint32_t v[5];
+  for (uint32_t &x : v) TEST_ASSERT_TRUE(irReadVarint(p, end, x));
+  TEST_ASSERT_EQUAL(42, v[0]);
+  TEST_ASSERT_EQUAL(160000, v[1]);
+  TEST_ASSERT_EQUAL(80000, v[2]);
+  TEST_ASSERT_EQUAL(150000, v[3]);
+  TEST_ASSERT_EQUAL(80000, v[4]);
+
+  TEST_ASSERT_EQUAL(kCounterCount, *p++);
+  uint32_t counters[kCounterCount];
+  for (uint32_t &c : counters) TEST_ASSERT_TRUE(irReadVarint(p, end, c));
+  TEST_ASSERT_EQUAL(3, counters[kCountUnknown]);
+
+  TEST_ASSERT_EQUAL(kStageCount, *p++);
+  for (uint8_t stage = 0; stage < kStageCount; stage++) {
+    uint32_t samples, mean, max;
+    TEST_ASSERT_TRUE(irReadVarint(p, end, samples) && irReadVarint(p, end, mean) &&
+                     irReadVarint(p, end, max));
+    uint8_t used = *p++;
+    std::vector<uint32_t> buckets(used);
+    for (uint32_t &b : buckets) TEST_ASSERT_TRUE(irReadVarint(p, end, b));
+    if (stage == kStageLookup) {
+      TEST_ASSERT_EQUAL(3, samples);
+      TEST_ASSERT_EQUAL(4, mean);
+      TEST_ASSERT_EQUAL(6, max);
+      TEST_ASSERT_EQUAL(3, used);  // 1 us in bucket 0, 5 and 6 us in bucket 2
+      TEST_ASSERT_EQUAL(1, buckets[0]);
+      TEST_ASSERT_EQUAL(2, buckets[2]);
+    } else if (stage == kStageTransmit) {
+      TEST_ASSERT_EQUAL(kMetricBuckets, used);  // Clamped to the open bucket
+    } else {
+      TEST_ASSERT_EQUAL(0, used);
+    }
+  }
+  TEST_ASSERT_TRUE(p == end);
+}
+
+static void test_log_never_blocks() {
+  // At 9600 baud a 128-byte FIFO holds ~133 ms of output; neither
+  // logging nor draining may wait on it.
+  hostSerialEcho = false;
+  Serial.begin(9600);
+  uint64_t blocked = hostSerialBlockedUs();
+  unsigned long start = micros();
+  uint8_t payload[4096] = {};
+  for (int i = 0; i < 100; i++) logWrite("[TEST] line %03d of a burst that overruns the ring\n", i);
+  logDump("home/ac/library", payload, sizeof(payload));
+  logDrain();
+  TEST_ASSERT_EQUAL(start, micros());
+  TEST_ASSERT_EQUAL(blocked, hostSerialBlockedUs());
+
+  logFlush();  // Emits the drop notice, then waits it out
+  TEST_ASSERT_TRUE(micros() > start);
+  TEST_ASSERT_EQUAL(blocked, hostSerialBlockedUs());
+  Serial.begin(0);
+  hostSerialEcho = true;
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_codec_round_trip);
+  RUN_TEST(test_codec_repeat_frame);
+  RUN_TEST(test_codec_rejects_truncation);
+  RUN_TEST(test_store_matches_map);
+  RUN_TEST(test_store_evicts_coldest);
+  RUN_TEST(test_library_pin_holds_copy);
+  RUN_TEST(test_library_snapshot_and_delta);
+  RUN_TEST(test_library_stream_in_pieces);
+  RUN_TEST(test_send_queue_supersedes_group);
+  RUN_TEST(test_send_queue_rejects_out_of_range);
+  RUN_TEST(test_send_queue_waits_for_completion);
+  RUN_TEST(test_learn_consensus_folds_repeats);
+  RUN_TEST(test_learn_splits_long_gaps);
+  RUN_TEST(test_buttons_settle);
+  RUN_TEST(test_metrics_report);
+  RUN_TEST(test_spsc_queue_wraps);
+  RUN_TEST(test_topics_scope_to_device);
+  RUN_TEST(test_log_never_blocks);
+  return UNITY_END();
+}
@@ -0,0 +1,536 @@
+#include <unity.h>
+
+#include <ArduinoJson.h>
+#include <IRrecv.h>
+#include <PubSubClient.h>
+#include <WiFi.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include "command_store.h"
+#include "fixtures.h"
+#include "host.h"
+#include "ir_codec.h"
+#include "learn_pipeline.h"
+#include "library_frame.h"
+#include "topics.h"
+
+// Replays recorded MQTT traffic through the firmware's callback. A
+// session file has one step per line:
+//
+//   <topic> <payload>     deliver; payload is text, or hex:<bytes>
+//   save <file>           deliver a {"name", "timings"} file (the shape of
+//                         long_command.json) as the next library upsert
+//   wait <ms>             run loop() for that long
+//   expect-tx <n>         transmissions since the start of the session
+//
+// Paths are relative to AC_REPLAY_DIR, default the project directory.
+
+extern CommandLibrary commandLibrary;
+extern uint32_t libraryVersion;
+extern PubSubClient client;
+void setup();
+void loop();
+void learnIR(int index, const String &name);
+void wifiStart(bool fast);
+
+static unsigned long bootReadyMs;
+
+static std::string replayPath(const std::string &file) {
+  const char *dir = getenv("AC_REPLAY_DIR");
+  return (dir ? std::string(dir) + "/" : std::string()) + file;
+}
+
+static bool readFile(const std::string &file, std::string &out) {
+  std::ifstream in(replayPath(file), std::ios::binary);
+  if (!in) return false;
+  std::stringstream ss;
+  ss << in.rdbuf();
+  out = ss.str();
+  return true;
+}
+
+static void runFor(uint32_t ms) {
+  for (uint32_t t = 0; t < ms; t += 5) {
+    loop();
+    hostAdvance(5);
+  }
+}
+
+static std::vector<uint8_t> fromHex(const std::string &hex) {
+  std::vector<uint8_t> out;
+  for (size_t i = 0; i + 1 < hex.size(); i += 2) out.push_back(strtoul(hex.substr(i, 2).c_str(), nullptr, 16));
+  return out;
+}
+
+static bool saveAsDelta(const std::string &file, std::vector<uint8_t> &delta, FixtureCommand &cmd) {
+  std::string text;
+  DynamicJsonDocument doc(16384);
+  if (!readFile(file, text) || deserializeJson(doc, text) != DeserializationError::Ok) return false;
+  cmd.first = doc["name"] | "";
+  for (JsonVariantConst t : doc["timings"].as<JsonArrayConst>()) cmd.second.push_back(t | 0);
+  delta = fixtureUpsert(libraryVersion + 1, cmd, 10);
+  return true;
+}
+
+struct TopicTime {
+  uint32_t messages = 0;
+  double   totalUs = 0;
+  double   worstUs = 0;
+};
+
+void setUp() {}
+void tearDown() {}
+
+static void test_replay_session() {
+  std::string session;
+  if (!readFile("test/replay/session.mqtt", session)) TEST_IGNORE_MESSAGE("no session file");
+
+  std::map<std::string, TopicTime> times;
+  size_t txStart = hostTransmitted().size();
+  std::istringstream lines(session);
+  std::string line;
+  int lineNo = 0;
+  while (std::getline(lines, line)) {
+    lineNo++;
+    if (line.empty() || line[0] == '#') continue;
+    size_t sp = line.find(' ');
+    std::string head = line.substr(0, sp), arg = sp == std::string::npos ? "" : line.substr(sp + 1);
+
+    if (head == "wait") {
+      runFor(atoi(arg.c_str()));
+      continue;
+    }
+    if (head == "expect-tx") {
+      char msg[32];
+      snprintf(msg, sizeof(msg), "line %d", lineNo);
+      TEST_ASSERT_EQUAL_MESSAGE(atoi(arg.c_str()), hostTransmitted().size() - txStart, msg);
+      continue;
+    }
+
+    std::vector<uint8_t> payload;
+    if (head == "save") {
+      FixtureCommand cmd;
+      TEST_ASSERT_TRUE_MESSAGE(saveAsDelta(arg, payload, cmd), arg.c_str());
+      head = topicFor(kTopicDelta);
+    } else if (arg.compare(0, 4, "hex:") == 0) {
+      payload = fromHex(arg.substr(4));
+    } else {
+      payload.assign(arg.begin(), arg.end());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    hostDeliver(head.c_str(), payload.data(), payload.size());
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    TopicTime &tt = times[head];
+    tt.messages++;
+    tt.totalUs += us;
+    tt.worstUs = std::max(tt.worstUs, us);
+  }
+
+  printf("\n%-36s %8s %10s %10s\n", "topic", "messages", "mean us", "worst us");
+  for (auto &t : times) {
+    printf("%-36s %8u %10.1f %10.1f\n", t.first.c_str(), t.second.messages,
+           t.second.totalUs / t.second.messages, t.second.worstUs);
+  }
+}
+
+static void test_long_command_round_trip() {
+  std::vector<uint8_t> delta;
+  FixtureCommand cmd;
+  if (!saveAsDelta("long_command.json", delta, cmd)) TEST_IGNORE_MESSAGE("no long_command.json");
+
+  hostDeliver(topicFor(kTopicDelta), delta.data(), delta.size());
+  CommandView view;
+  TEST_ASSERT_TRUE(commandLibrary.live().find(cmd.first.data(), cmd.first.size(), view));
+
+  size_t before = hostTransmitted().size();
+  std::string req = "{\"name\":\"" + cmd.first + "\"}";
+  hostDeliver(topicFor(kTopicSend), req.c_str());
+  runFor(100);
+  TEST_ASSERT_EQUAL(before + 1, hostTransmitted().size());
+  const HostTransmit &tx = hostTransmitted().back();
+  TEST_ASSERT_EQUAL(38, tx.khz);
+  TEST_ASSERT_EQUAL(cmd.second.size(), tx.timings.size());
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(cmd.second.data(), tx.timings.data(), cmd.second.size());
+}
+
+static void test_learn_streams_long_capture() {
+  // Widths spread too far for the dictionary, so the save message runs
+  // to several kilobytes and must go out in parts.
+  std::vector<uint16_t> ticks(1, 2000);  // Idle gap before the frame
+  uint32_t seed = 1;
+  for (int i = 0; i < 2000; i++) {
+    seed = seed * 1103515245 + 12345;
+    ticks.push_back((8 + (seed >> 16) % 400) * 50 / kRawTick);
+  }
+  hostPublished().clear();
+  learnIR(0, "long");
+  for (int i = 0; i < 3; i++) {
+    hostCapture(ticks);
+    runFor(50);
+  }
+
+  std::vector<uint8_t> msg;
+  uint32_t id = 0, total = 0;
+  int parts = 0;
+  for (const HostMessage &m : hostPublished()) {
+    TEST_ASSERT_TRUE(m.topic != topicFor(kTopicSave));
+    if (m.topic != topicFor(kTopicSavePart)) continue;
+    const uint8_t *p = m.payload.data(), *end = p + m.payload.size();
+    uint32_t partId, offset;
+    TEST_ASSERT_EQUAL(kLibraryVersion, *p++);
+    TEST_ASSERT_TRUE(irReadVarint(p, end, partId) && irReadVarint(p, end, offset) &&
+                     irReadVarint(p, end, total));
+    if (parts++ == 0) id = partId;
+    TEST_ASSERT_EQUAL(id, partId);
+    TEST_ASSERT_EQUAL(msg.size(), offset);
+    msg.insert(msg.end(), p, end);
+  }
+  TEST_ASSERT_GREATER_THAN(1, parts);
+  TEST_ASSERT_EQUAL(total, msg.size());
+
+  const uint8_t *p = msg.data(), *end = p + msg.size();
+  TEST_ASSERT_EQUAL(kLibraryVersion, *p++);
+  LibraryRecord rec;
+  TEST_ASSERT_TRUE(readLibraryRecord(p, end, rec));
+  TEST_ASSERT_EQUAL_STRING_LEN("long", rec.name, rec.nameLen);
+  std::vector<uint16_t> frame;
+  TEST_ASSERT_TRUE(irDecode(rec.blob, rec.blobLen, frame));
+  TEST_ASSERT_EQUAL(ticks.size() - 1, frame.size());
+  TEST_ASSERT_EQUAL(2 + strlen(topicLibrary()), end - p);  // Confidence, library
+  TEST_ASSERT_EQUAL(strlen(topicLibrary()), p[1]);
+  TEST_ASSERT_EQUAL_STRING_LEN(topicLibrary(), (const char *)p + 2, p[1]);
+  const HostMessage &status = hostPublished().back();
+  TEST_ASSERT_EQUAL_STRING(topicFor(kTopicStatus), status.topic.c_str());
+  TEST_ASSERT_EQUAL(0, std::string(status.payload.begin(), status.payload.end()).find("Learned long"));
+}
+
+static size_t countPublished(Topic topic, const char *payload = nullptr) {
+  size_t n = 0;
+  for (const HostMessage &m : hostPublished()) {
+    if (m.topic == topicFor(topic) &&
+        (!payload || std::string(m.payload.begin(), m.payload.end()) == payload)) {
+      n++;
+    }
+  }
+  return n;
+}
+
+static void test_learn_long_frames() {
+  // Two frames 90 ms apart, in receiver ticks.
+  std::vector<uint16_t> ticks(1, 2000);
+  for (int copy = 0; copy < 2; copy++) {
+    if (copy) ticks.push_back(90000 / kRawTick);
+    for (uint16_t us : fixtureFrame(0xC0DE)) ticks.push_back(us / kRawTick);
+  }
+  TEST_ASSERT_EQUAL(0, hostReceivers());
+  hostPublished().clear();
+  learnIR(0, "two_frames");
+  runFor(10);
+  TEST_ASSERT_EQUAL(1, hostReceivers());  // Allocated for the session
+  for (int i = 0; i < 3; i++) {
+    hostCapture(ticks);
+    runFor(50);
+  }
+  TEST_ASSERT_EQUAL(0, hostReceivers());
+
+  TEST_ASSERT_EQUAL(1, countPublished(kTopicSave));
+  const HostMessage &save = *std::find_if(
+      hostPublished().begin(), hostPublished().end(),
+      [](const HostMessage &m) { return m.topic == topicFor(kTopicSave); });
+  const uint8_t *p = save.payload.data() + 1, *end = save.payload.data() + save.payload.size();
+  LibraryRecord rec;
+  TEST_ASSERT_TRUE(readLibraryRecord(p, end, rec));
+  std::vector<uint16_t> out;
+  TEST_ASSERT_TRUE(irDecode(rec.blob, rec.blobLen, out));
+  const uint16_t gap[] = {kLearnSplitUs, 0, 90000 - kLearnSplitUs};
+  TEST_ASSERT_EQUAL(2, out[0]);  // Repeat count, then one frame and the gap
+  TEST_ASSERT_EQUAL(1 + 67 + 3, out.size());
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(gap, out.data() + 1 + 67, 3);
+
+  // A capture that fills the buffer ends the session instead of saving.
+  hostPublished().clear();
+  learnIR(0, "too_long");
+  hostCapture(std::vector<uint16_t>(3000, 11));
+  runFor(50);
+  TEST_ASSERT_EQUAL(0, countPublished(kTopicSave) + countPublished(kTopicSavePart));
+  TEST_ASSERT_EQUAL(1, countPublished(kTopicStatus, "Error: Capture truncated at 2048 pulses"));
+  TEST_ASSERT_EQUAL(0, hostReceivers());
+}
+
+static void test_fast_boot_reuses_link() {
+  // main() booted with nothing cached, so it scanned and waited for DHCP.
+  TEST_ASSERT_GREATER_OR_EQUAL(WiFiClass::kHostScanMs + WiFiClass::kHostDhcpMs, bootReadyMs);
+
+  WiFi.disconnect();
+  wifiStart(true);
+  unsigned long start = millis();
+  while (WiFi.status() != WL_CONNECTED) {
+    loop();
+    hostAdvance(5);
+  }
+  unsigned long fastMs = millis() - start;
+  printf("\nboot to ready %lu ms, cached rejoin %lu ms\n", bootReadyMs, fastMs);
+  TEST_ASSERT_TRUE(WiFi.joined);
+  TEST_ASSERT_NOT_EQUAL(0, WiFi.staticIp);
+  TEST_ASSERT_LESS_THAN(300, fastMs);
+  runFor(100);
+  TEST_ASSERT_TRUE(client.connected());
+}
+
+static void test_reconnect_keeps_session() {
+  // The recorded session ended by erasing the library.
+  std::vector<uint8_t> delta = fixtureUpsert(libraryVersion + 1, {"on", fixtureFrame(0x10)});
+  hostDeliver(topicFor(kTopicDelta), delta.data(), delta.size());
+
+  uint32_t subscribes = hostSubscribes();
+  size_t tx = hostTransmitted().size();
+  hostPublished().clear();
+
+  // A request sent during a short outage waits in the session.
+  hostSetConnected(false);
+  runFor(500);
+  hostDeliver(topicFor(kTopicSend), "{\"name\":\"on\"}");
+  runFor(500);
+  hostSetConnected(true);
+  runFor(1500);
+  TEST_ASSERT_TRUE(client.connected());
+  TEST_ASSERT_EQUAL(subscribes, hostSubscribes());
+  TEST_ASSERT_EQUAL(1, countPublished(kTopicStatus, "Reconnected"));
+  TEST_ASSERT_EQUAL(0, countPublished(kTopicList));
+  TEST_ASSERT_EQUAL(tx + 1, hostTransmitted().size());
+}
+
+static void test_reconnect_backs_off() {
+  uint32_t connects = hostConnects();
+  size_t tx = hostTransmitted().size();
+
+  // A minute without the broker takes a handful of attempts, not one
+  // every couple of seconds, and what was queued meanwhile is dropped.
+  hostSetConnected(false);
+  runFor(1000);
+  hostDeliver(topicFor(kTopicSend), "{\"name\":\"on\"}");
+  runFor(59000);
+  uint32_t attempts = hostConnects() - connects;
+  printf("\n%u connect attempts in 60 s\n", attempts);
+  TEST_ASSERT_LESS_THAN(12, attempts);
+  hostSetConnected(true);
+  runFor(31000);  // Past the longest backoff
+  TEST_ASSERT_TRUE(client.connected());
+  TEST_ASSERT_EQUAL(tx, hostTransmitted().size());
+
+  hostDeliver(topicFor(kTopicSend), "{\"name\":\"on\"}");
+  runFor(100);
+  TEST_ASSERT_EQUAL(tx + 1, hostTransmitted().size());
+}
+
+static void test_reconnect_restores_lost_session() {
+  uint32_t subscribes = hostSubscribes();
+  hostPublished().clear();
+
+  hostSetConnected(false);
+  hostDropSession();
+  runFor(500);
+  hostSetConnected(true);
+  runFor(2000);  // Past the session probe
+  TEST_ASSERT_EQUAL(subscribes + kTopicSubscribed, hostSubscribes());
+  TEST_ASSERT_EQUAL(1, countPublished(kTopicList));
+}
+
+static void test_evicted_command_is_fetched() {
+  // About 800 bytes of timings each, more of them than the arena holds.
+  std::map<std::string, std::vector<uint16_t>> big;
+  uint32_t version = libraryVersion;
+  for (int i = 0; i < 70; i++) {
+    char name[8];
+    snprintf(name, sizeof(name), "big%02d", i);
+    FixtureCommand cmd(name, {});
+    for (int k = 0; k < 6; k++) {
+      std::vector<uint16_t> frame = fixtureFrame(i * 8 + k);
+      cmd.second.insert(cmd.second.end(), frame.begin(), frame.end());
+    }
+    std::vector<uint8_t> delta = fixtureUpsert(libraryVersion + 1, cmd, 10);
+    hostDeliver(topicFor(kTopicDelta), delta.data(), delta.size());
+    big[name] = cmd.second;
+  }
+  TEST_ASSERT_EQUAL(version + 70, libraryVersion);
+
+  auto evicted = []() {
+    CommandView view;
+    for (int i = 0; i < 70; i++) {
+      char name[8];
+      snprintf(name, sizeof(name), "big%02d", i);
+      if (!commandLibrary.live().find(name, strlen(name), view)) return std::string(name);
+    }
+    return std::string();
+  };
+  std::string name = evicted();
+  TEST_ASSERT_FALSE(name.empty());
+  TEST_ASSERT_TRUE(commandLibrary.live().known(name.data(), name.size()));
+
+  hostPublished().clear();
+  size_t tx = hostTransmitted().size();
+  hostDeliver(topicFor(kTopicSend), ("{\"name\":\"" + name + "\"}").c_str());
+  runFor(100);
+  TEST_ASSERT_EQUAL(tx, hostTransmitted().size());  // Waiting on the fetch
+  TEST_ASSERT_EQUAL(1, countPublished(kTopicFetch,
+                                      ("{\"name\":\"" + name + "\",\"library\":\"default\"}").c_str()));
+
+  std::vector<uint8_t> reply = fixtureUpsert(libraryVersion, FixtureCommand(name, big[name]), 10);
+  hostDeliver(topicFor(kTopicCommand), reply.data(), reply.size());
+  runFor(100);
+  TEST_ASSERT_EQUAL(tx + 1, hostTransmitted().size());
+  TEST_ASSERT_EQUAL_UINT16_ARRAY(big[name].data(), hostTransmitted().back().timings.data(),
+                                 big[name].size());
+  TEST_ASSERT_EQUAL(1, countPublished(kTopicStatus, ("Sent " + name).c_str()));
+
+  // Unanswered, the step fails once the fetch times out (kFetchTimeoutMs).
+  name = evicted();
+  hostDeliver(topicFor(kTopicSend), ("{\"name\":\"" + name + "\"}").c_str());
+  runFor(3100);
+  TEST_ASSERT_EQUAL(tx + 1, hostTransmitted().size());
+  TEST_ASSERT_EQUAL(1, countPublished(kTopicStatus,
+                                      ("Sent " + name + ": 0/1 (1 failed, 0 superseded)").c_str()));
+}
+
+static void test_send_rejects_out_of_range_steps() {
+  size_t tx = hostTransmitted().size();
+  hostPublished().clear();
+  hostDeliver(topicFor(kTopicSend),
+              "{\"id\":\"bad\",\"steps\":[{\"name\":\"on\",\"delay\":70000},"
+              "{\"name\":\"on\",\"repeat\":256},{\"name\":\"on\",\"repeat\":-1},"
+              "{\"name\":\"on\",\"delay\":1.5}]}");
+  runFor(100);
+  TEST_ASSERT_EQUAL(tx, hostTransmitted().size());
+  TEST_ASSERT_EQUAL(1, countPublished(kTopicStatus, "Sent bad: 0/4 (4 failed, 0 superseded)"));
+}
+
+static void test_bad_snapshot_keeps_library() {
+  uint32_t version = libraryVersion;
+  uint32_t count = commandLibrary.live().size();
+  std::vector<uint8_t> snap = fixtureSnapshot(version + 1, {{"stray", fixtureFrame(5)}});
+  std::vector<uint8_t> head;
+  snap[1 + irWriteVarint(head, version + 1)] ^= 1;  // Hash no longer matches
+
+  hostPublished().clear();
+  hostDeliver(topicFor(kTopicLibrary), snap.data(), snap.size());
+  TEST_ASSERT_EQUAL(version, libraryVersion);
+  TEST_ASSERT_EQUAL(count, commandLibrary.live().size());
+  TEST_ASSERT_FALSE(commandLibrary.live().known("stray", 5));
+
+  // Asked for again after kResyncMinMs, not straight away.
+  TEST_ASSERT_EQUAL(0, countPublished(kTopicList));
+  runFor(5100);
+  TEST_ASSERT_EQUAL(1, countPublished(kTopicList));
+}
+
+static void test_snapshot_arrives_in_parts() {
+  std::vector<FixtureCommand> commands;
+  for (int i = 0; i < 200; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "cmd_%03d", i);
+    commands.push_back({name, fixtureFrame(0x20DF0000 | i * 2654435761u)});
+  }
+  uint32_t version = libraryVersion + 1;
+  std::vector<uint8_t> snap = fixtureSnapshot(version, commands);
+  TEST_ASSERT_GREATER_THAN(client.bufferSize, snap.size());
+
+  // Whole, it never reaches the callback.
+  hostDeliver(topicFor(kTopicLibrary), snap.data(), snap.size());
+  TEST_ASSERT_NOT_EQUAL(version, libraryVersion);
+
+  // A lost part drops the transfer. The library is asked for again once
+  // the resync backoff passes, not straight away.
+  std::vector<std::vector<uint8_t>> parts = fixtureParts(snap, 1, 3072);
+  TEST_ASSERT_GREATER_THAN(2, parts.size());
+  hostPublished().clear();
+  for (size_t i = 0; i < parts.size(); i++) {
+    if (i != 1) hostDeliver(topicFor(kTopicLibraryPart), parts[i].data(), parts[i].size());
+  }
+  TEST_ASSERT_NOT_EQUAL(version, libraryVersion);
+  TEST_ASSERT_EQUAL(0, countPublished(kTopicList));
+  for (int i = 0; i < 60 && !countPublished(kTopicList); i++) runFor(1000);
+  TEST_ASSERT_EQUAL(1, countPublished(kTopicList));
+
+  // Parts are loaded as they come, so the heap holds a record at a time
+  // rather than the joined snapshot. The host's copy of each part stands
+  // for PubSubClient's buffer; the last part also writes the cache.
+  parts = fixtureParts(snap, 2, 3072);
+  hostResetPeak();
+  uint64_t base = hostAllocs().live;
+  for (size_t i = 0; i + 1 < parts.size(); i++) {
+    hostDeliver(topicFor(kTopicLibraryPart), parts[i].data(), parts[i].size());
+  }
+  TEST_ASSERT_LESS_THAN(parts[0].size() + 1024, hostAllocs().peak - base);
+  hostDeliver(topicFor(kTopicLibraryPart), parts.back().data(), parts.back().size());
+  TEST_ASSERT_EQUAL(version, libraryVersion);
+  TEST_ASSERT_EQUAL(200, commandLibrary.live().size());
+
+  // Compressed, split so matches straddle parts.
+  std::vector<uint8_t> lz = fixtureCompress(fixtureSnapshot(version + 1, commands));
+  for (auto &part : fixtureParts(lz, 3, 101)) {
+    hostDeliver(topicFor(kTopicLibraryPart), part.data(), part.size());
+  }
+  TEST_ASSERT_EQUAL(version + 1, libraryVersion);
+  TEST_ASSERT_EQUAL(200, commandLibrary.live().size());
+}
+
+static void test_library_too_large_reported_once() {
+  std::vector<FixtureCommand> commands;
+  for (int i = 0; i <= kStoreMaxCommands; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "big_%03d", i);
+    commands.push_back({name, fixtureFrame(i)});
+  }
+  uint32_t version = libraryVersion;
+  size_t count = commandLibrary.live().size();
+  std::vector<uint8_t> snap = fixtureSnapshot(version + 1, commands);
+
+  // Reported once, kept off the live copy, and not asked for again since
+  // the same snapshot would come back.
+  hostPublished().clear();
+  for (uint32_t transfer : {10, 11}) {
+    for (auto &part : fixtureParts(snap, transfer, 3072)) {
+      hostDeliver(topicFor(kTopicLibraryPart), part.data(), part.size());
+    }
+    runFor(10000);  // Past kResyncMinMs
+  }
+  TEST_ASSERT_EQUAL(version, libraryVersion);
+  TEST_ASSERT_EQUAL(count, commandLibrary.live().size());
+  char status[64];
+  snprintf(status, sizeof(status), "Error: Library too large (%u commands)", kStoreMaxCommands + 1);
+  TEST_ASSERT_EQUAL(1, countPublished(kTopicStatus, status));
+  TEST_ASSERT_EQUAL(0, countPublished(kTopicList));
+}
+
+int main() {
+  hostReset();
+  hostSerialEcho = getenv("AC_HOST_VERBOSE") != nullptr;
+  setup();
+  while (!client.connected()) {
+    loop();
+    hostAdvance(5);
+  }
+  bootReadyMs = millis();
+  runFor(100);  // Session probe
+
+  UNITY_BEGIN();
+  RUN_TEST(test_replay_session);
+  RUN_TEST(test_long_command_round_trip);
+  RUN_TEST(test_learn_streams_long_capture);
+  RUN_TEST(test_learn_long_frames);
+  RUN_TEST(test_fast_boot_reuses_link);
+  RUN_TEST(test_reconnect_keeps_session);
+  RUN_TEST(test_reconnect_backs_off);
+  RUN_TEST(test_reconnect_restores_lost_session);
+  RUN_TEST(test_evicted_command_is_fetched);
+  RUN_TEST(test_send_rejects_out_of_range_steps);
+  RUN_TEST(test_bad_snapshot_keeps_library);
+  RUN_TEST(test_snapshot_arrives_in_parts);
+  RUN_TEST(test_library_too_large_reported_once);
+  return UNITY_END();
+}
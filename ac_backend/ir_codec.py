@@ -0,0 +1,433 @@
+"""Binary IR timing codec shared with the ESP32 firmware (src/ir_codec.h)."""
+
+from collections import Counter
+from functools import reduce
+from math import gcd
+
+CODEC_VERSION = 1
+PROTOCOL_VERSION = 2
+REPEAT_VERSION = 3
+LIBRARY_VERSION = 1
+LIBRARY_LZ = 0x80 | LIBRARY_VERSION
+LZ_WINDOW = 1024
+LZ_MIN_MATCH = 3
+LZ_MAX_MATCH = LZ_MIN_MATCH + 63
+MAX_DICT = 15
+ESCAPE = 0x0F
+
+# The firmware's kLearnSplitUs. Longer gaps are stored as pieces of this
+# joined by zero-length marks: 90 ms is 65000, 0, 25000.
+LEARN_SPLIT_US = 65000
+
+# The firmware's MQTT_MAX_PACKET_SIZE. Messages longer than this, with
+# their topic and header, are dropped by the device's client unread.
+DEVICE_BUFFER = 4096
+PART_BYTES = 3072
+
+OP_UPSERT = ord("U")
+OP_DELETE = ord("D")
+OP_RENAME = ord("R")
+OP_ERASE = ord("E")
+
+
+def write_varint(out: bytearray, v: int):
+    while True:
+        b = v & 0x7F
+        v >>= 7
+        if v:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return
+
+
+def read_varint(data: bytes, pos: int):
+    v = shift = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        v |= (b & 0x7F) << shift
+        if not b & 0x80:
+            return v, pos
+        shift += 7
+
+
+def encode_protocol(cmd: dict) -> bytes:
+    out = bytearray([PROTOCOL_VERSION])
+    write_varint(out, cmd["protocol"])
+    write_varint(out, cmd["bits"])
+    out.append(len(cmd["state"]))
+    out += bytes(cmd["state"])
+    return bytes(out)
+
+
+def decode_protocol(blob: bytes) -> dict:
+    protocol, pos = read_varint(blob, 1)
+    bits, pos = read_varint(blob, pos)
+    n = blob[pos]
+    return {"protocol": protocol, "bits": bits, "state": list(blob[pos + 1:pos + 1 + n])}
+
+
+def protocol_words(cmd: dict) -> list:
+    """The u16 words the firmware stores for a protocol command."""
+    state = cmd["state"]
+    words = [cmd["protocol"], cmd["bits"], len(state)]
+    for i in range(0, len(state), 2):
+        words.append(state[i] | (state[i + 1] << 8 if i + 1 < len(state) else 0))
+    return words
+
+
+def command_words(command) -> list:
+    """The u16 words the firmware stores for any command."""
+    if isinstance(command, dict):
+        if "repeat" in command:
+            return [command["repeat"]] + command["timings"]
+        return protocol_words(command)
+    return command
+
+
+def expand(command) -> list:
+    """Full timing list of a raw command, repeated frames unrolled. The
+    last copy drops its trailing gap, every piece of a split one, as the
+    firmware does. Protocol commands have none.
+
+    >>> expand({"repeat": 2, "timings": [550, 1650, 65000, 0, 25000]})
+    [550, 1650, 65000, 0, 25000, 550, 1650]
+    >>> expand({"repeat": 2, "timings": [550, 1650, 9000]})
+    [550, 1650, 9000, 550, 1650]
+    """
+    if isinstance(command, dict):
+        if "repeat" not in command:
+            return []
+        frame = command["timings"]
+        last = len(frame) - 1
+        while last >= 2 and frame[last - 1] == 0 and frame[last - 2] == LEARN_SPLIT_US:
+            last -= 2
+        return frame * (command["repeat"] - 1) + frame[:last]
+    return command
+
+
+def encode_command(command) -> bytes:
+    """Stored commands are raw timing lists, repeated frames
+    ({"repeat", "timings"}) or protocol dicts."""
+    if isinstance(command, dict):
+        if "repeat" in command:
+            return encode(command["timings"], repeat=command["repeat"])
+        return encode_protocol(command)
+    return encode(command)
+
+
+def encode(timings: list, tick: int = None, repeat: int = 1) -> bytes:
+    """Encode pulse widths in microseconds. Without an explicit tick the
+    largest unit that divides every pulse is used, so the round trip is exact.
+    A repeat above one marks the timings as a frame sent that many times."""
+    if tick is None:
+        g = reduce(gcd, timings, 0) or 1
+        tick = next(d for d in range(min(g, 255), 0, -1) if g % d == 0)
+    tick = max(1, min(tick, 255))
+    # Zero widths join the pieces of a split long gap and stay zero
+    ticks = [t and max(1, (t + tick // 2) // tick) for t in timings]
+
+    common = [(n, v) for v, n in Counter(ticks).items() if n > 1]
+    common.sort(key=lambda f: -f[0])
+    widths = sorted(v for _, v in common[:MAX_DICT])
+    index = {v: i for i, v in enumerate(widths)}
+
+    out = bytearray([REPEAT_VERSION if repeat > 1 else CODEC_VERSION, tick])
+    write_varint(out, len(ticks))
+    if repeat > 1:
+        write_varint(out, repeat)
+    out.append(len(widths))
+    prev = 0
+    for w in widths:
+        write_varint(out, w - prev)
+        prev = w
+
+    symbols = bytearray((len(ticks) + 1) // 2)
+    literals = bytearray()
+    for i, t in enumerate(ticks):
+        sym = index.get(t, ESCAPE)
+        if sym == ESCAPE:
+            write_varint(literals, t)
+        symbols[i // 2] |= sym << 4 if i & 1 else sym
+    return bytes(out + symbols + literals)
+
+
+def decode(blob: bytes):
+    if blob[:1] == bytes([PROTOCOL_VERSION]):
+        return decode_protocol(blob)
+    if len(blob) < 2 or blob[0] not in (CODEC_VERSION, REPEAT_VERSION) or blob[1] == 0:
+        raise ValueError("unsupported timing blob")
+    tick = blob[1]
+    count, pos = read_varint(blob, 2)
+    repeat = 1
+    if blob[0] == REPEAT_VERSION:
+        repeat, pos = read_varint(blob, pos)
+    dict_size = blob[pos]
+    pos += 1
+    widths, prev = [], 0
+    for _ in range(dict_size):
+        delta, pos = read_varint(blob, pos)
+        prev += delta
+        widths.append(prev)
+
+    symbols = blob[pos:pos + (count + 1) // 2]
+    pos += (count + 1) // 2
+    timings = []
+    for i in range(count):
+        sym = (symbols[i // 2] >> (4 * (i & 1))) & 0x0F
+        if sym == ESCAPE:
+            t, pos = read_varint(blob, pos)
+        else:
+            t = widths[sym]
+        timings.append(min(t * tick, 0xFFFF))
+    if blob[0] == REPEAT_VERSION:
+        return {"repeat": repeat, "timings": timings}
+    return timings
+
+
+def write_name(out: bytearray, name: str):
+    raw = name.encode()[:255]
+    out.append(len(raw))
+    out += raw
+
+
+def write_record(out: bytearray, name: str, blob: bytes):
+    write_name(out, name)
+    write_varint(out, len(blob))
+    out += blob
+
+
+def read_record(data: bytes, pos: int):
+    n = data[pos]
+    name = data[pos + 1:pos + 1 + n].decode()
+    size, pos = read_varint(data, pos + 1 + n)
+    return name, data[pos:pos + size], pos + size
+
+
+def decode_save(payload: bytes):
+    """Return (name, command, confidence, library) from a binary
+    home/ac/save message. Confidence (0-100) and then the library the
+    device learned into trail the record; either is None when an older
+    firmware left it out."""
+    if not payload or payload[0] != LIBRARY_VERSION:
+        raise ValueError("unsupported save message")
+    name, blob, pos = read_record(payload, 1)
+    confidence = library = None
+    if pos < len(payload):
+        confidence = payload[pos]
+        pos += 1
+    if pos < len(payload):
+        end = pos + 1 + payload[pos]
+        if end > len(payload):
+            raise ValueError("truncated library name")
+        library = payload[pos + 1:end].decode()
+    return name, decode(blob), confidence, library
+
+
+class SaveAssembler:
+    """Joins the home/ac/dev/<device>/save/part messages of long save
+    messages. Each part is LIBRARY_VERSION, varint transfer id, varint
+    offset, varint total length and the save message bytes from offset on.
+    Transfer ids are only unique per device."""
+
+    def __init__(self):
+        self.transfers = {}
+
+    def add(self, part: bytes, device: str = ""):
+        """Return the whole save message once its last part arrived, else
+        None. A part out of order drops the transfer."""
+        if not part or part[0] != LIBRARY_VERSION:
+            raise ValueError("unsupported save part")
+        transfer, pos = read_varint(part, 1)
+        transfer = (device, transfer)
+        offset, pos = read_varint(part, pos)
+        total, pos = read_varint(part, pos)
+        if offset == 0:
+            self.transfers[transfer] = bytearray()
+        buf = self.transfers.get(transfer)
+        if buf is None or len(buf) != offset:
+            self.transfers.pop(transfer, None)
+            raise ValueError(f"save part at {offset} out of order")
+        buf += part[pos:]
+        if len(buf) < total:
+            return None
+        del self.transfers[transfer]
+        return bytes(buf[:total])
+
+
+def entry_hash(name: str, timings) -> int:
+    """FNV-1a of one command, matching libraryEntryHash() in the firmware."""
+    timings = command_words(timings)
+    h = 2166136261
+    data = name.encode()[:255] + b"\0"
+    data += b"".join(min(t, 0xFFFF).to_bytes(2, "little") for t in timings)
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def library_hash(commands: dict) -> int:
+    return sum(entry_hash(n, t) for n, t in commands.items()) & 0xFFFFFFFF
+
+
+def encode_library(commands: dict, version: int) -> bytes:
+    out = bytearray([LIBRARY_VERSION])
+    write_varint(out, version)
+    out += library_hash(commands).to_bytes(4, "little")
+    write_varint(out, len(commands))
+    for name, timings in commands.items():
+        write_record(out, name, encode_command(timings))
+    return bytes(out)
+
+
+def lz_compress(data: bytes, chain: int = 64) -> bytes:
+    """LZSS stream the firmware's LzDecoder reads, see lz.h: groups of a
+    flag byte and eight literals or (distance, length) matches. Greedy,
+    trying the `chain` latest positions with the same three bytes."""
+    out = bytearray()
+    heads = {}
+    flag_at, bit = 0, 8
+    i, n = 0, len(data)
+    while i < n:
+        if bit == 8:
+            flag_at, bit = len(out), 0
+            out.append(0)
+        best, distance = 0, 0
+        key = data[i:i + LZ_MIN_MATCH]
+        for j in reversed(heads.get(key, [])[-chain:]):
+            if i - j > LZ_WINDOW:
+                break
+            length = 0
+            while (length < LZ_MAX_MATCH and i + length < n
+                   and data[j + length] == data[i + length]):
+                length += 1
+            if length > best:
+                best, distance = length, i - j
+        step = best if best >= LZ_MIN_MATCH else 1
+        if step > 1:
+            token = (distance - 1) | ((best - LZ_MIN_MATCH) << 10)
+            out[flag_at] |= 1 << bit
+            out += token.to_bytes(2, "little")
+        else:
+            out.append(data[i])
+        for k in range(i, min(i + step, n - LZ_MIN_MATCH + 1)):
+            heads.setdefault(data[k:k + LZ_MIN_MATCH], []).append(k)
+        i += step
+        bit += 1
+    return bytes(out)
+
+
+def lz_decompress(data: bytes) -> bytes:
+    out = bytearray()
+    pos = 0
+    while pos < len(data):
+        flags, pos = data[pos], pos + 1
+        for bit in range(8):
+            if pos >= len(data):
+                break
+            if flags >> bit & 1:
+                token = int.from_bytes(data[pos:pos + 2], "little")
+                pos += 2
+                distance = (token & (LZ_WINDOW - 1)) + 1
+                for _ in range((token >> 10) + LZ_MIN_MATCH):
+                    out.append(out[-distance])
+            else:
+                out.append(data[pos])
+                pos += 1
+    return bytes(out)
+
+
+def compress_library(snapshot: bytes) -> bytes:
+    """The LIBRARY_LZ form of an encode_library() snapshot."""
+    out = bytearray([LIBRARY_LZ])
+    write_varint(out, len(snapshot))
+    return bytes(out + lz_compress(snapshot))
+
+
+def fits_device(topic: str, payload: bytes) -> bool:
+    """Whether the device's MQTT client accepts this message."""
+    return len(payload) + len(topic.encode()) + 7 <= DEVICE_BUFFER
+
+
+def split_parts(data: bytes, transfer: int, size: int = PART_BYTES) -> list:
+    """The home/ac/dev/<device>/library/part messages of a snapshot, in
+    the layout SaveAssembler joins."""
+    parts = []
+    for offset in range(0, len(data), size):
+        part = bytearray([LIBRARY_VERSION])
+        write_varint(part, transfer)
+        write_varint(part, offset)
+        write_varint(part, len(data))
+        parts.append(bytes(part + data[offset:offset + size]))
+    return parts
+
+
+def encode_delta(op: int, version: int, name: str = "", timings=None,
+                 new_name: str = "") -> bytes:
+    out = bytearray([LIBRARY_VERSION, op])
+    write_varint(out, version)
+    if op == OP_UPSERT:
+        write_record(out, name, encode_command(timings))
+    elif op in (OP_DELETE, OP_RENAME):
+        write_name(out, name)
+        if op == OP_RENAME:
+            write_name(out, new_name)
+    return bytes(out)
+
+
+METRICS_VERSION = 1
+METRIC_STAGES = ["mqtt", "parse", "lookup", "transmit", "end_to_end", "loop",
+                 "wifi", "reconnect", "ready", "fetch"]
+METRIC_COUNTERS = ["received", "reconnects", "dropped", "unknown", "publish_failed",
+                   "session_lost", "stale", "cache_hit", "cache_miss", "evicted"]
+
+
+def decode_metrics(payload: bytes) -> dict:
+    """Decode a home/ac/metrics report, see metrics.h in the firmware.
+    Histogram bucket i counts samples in [2**i, 2**(i+1)) microseconds."""
+    if not payload or payload[0] != METRICS_VERSION:
+        raise ValueError("unsupported metrics report")
+    pos = 1
+    fields = []
+    for _ in range(5):
+        v, pos = read_varint(payload, pos)
+        fields.append(v)
+    report = {"uptime_s": fields[0],
+              "heap": dict(zip(["free", "largest_block", "min_free", "min_largest_block"], fields[1:]))}
+
+    n, pos = payload[pos], pos + 1
+    counters = []
+    for _ in range(n):
+        v, pos = read_varint(payload, pos)
+        counters.append(v)
+    report["counters"] = dict(zip(METRIC_COUNTERS, counters))
+
+    n, pos = payload[pos], pos + 1
+    report["stages"] = {}
+    for i in range(n):
+        samples, pos = read_varint(payload, pos)
+        mean, pos = read_varint(payload, pos)
+        worst, pos = read_varint(payload, pos)
+        used, pos = payload[pos], pos + 1
+        buckets = []
+        for _ in range(used):
+            v, pos = read_varint(payload, pos)
+            buckets.append(v)
+        name = METRIC_STAGES[i] if i < len(METRIC_STAGES) else f"stage{i}"
+        report["stages"][name] = {"samples": samples, "mean_us": mean, "max_us": worst,
+                                  "buckets": buckets}
+    return report
+
+
+def histogram_percentile(buckets: list, q: float) -> int:
+    """Upper bound in microseconds of the bucket holding quantile q."""
+    total = sum(buckets)
+    if not total:
+        return 0
+    seen = 0
+    for i, n in enumerate(buckets):
+        seen += n
+        if seen >= q * total:
+            return 2 ** (i + 1)
+    return 2 ** len(buckets)
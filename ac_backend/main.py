@@ -7,10 +7,11 @@ from fastapi import FastAPI
 from dotenv import load_dotenv
 from paho.mqtt.client import Client
 from sqlalchemy.dialects.postgresql import insert as pg_insert
-from sqlalchemy import select, func
+from sqlalchemy import select, func, inspect, text
 from sqlalchemy.ext.asyncio import create_async_engine, async_sessionmaker
 from sqlalchemy.exc import SQLAlchemyError
-from models import Base, Command  # Ensure models.py has Command with `name`, `raw_timings`, `learned_at`
+from models import Base, Command, LibraryMeta  # Ensure models.py has Command with `name`, `raw_timings`, `learned_at`
+import ir_codec
 from fastapi.responses import JSONResponse
 
 # Load .env variables
@@ -29,6 +30,11 @@ loop = asyncio.get_event_loop()
 # Setup database
 engine = create_async_engine(DATABASE_URL, echo=True)
 SessionLocal = async_sessionmaker(engine, expire_on_commit=False)
+# Reads that pair commands with the library version they belong to. Under
+# READ COMMITTED a save landing between the two reads would stamp the
+# commands with a version they do not include yet.
+SnapshotSession = async_sessionmaker(
+    engine.execution_options(isolation_level="REPEATABLE READ"), expire_on_commit=False)
 
 # Setup MQTT client
 mqttc = Client("ir-backend")
@@ -37,37 +43,48 @@ mqttc.username_pw_set(MQTT_USER, MQTT_PASS)
 
 # ----- MQTT CALLBACKS -----
 
+DEFAULT_LIBRARY = "default"
+
+# Library each device last asked for on home/ac/dev/<device>/list.
+device_libraries = {}
+
+# Id of the last snapshot sent in parts
+snapshot_transfer = 0
+
+
 def on_connect(client, userdata, flags, rc):
     print("[MQTT] Connected with result code", rc)
-    topics = ["home/ac/save", "home/ac/list", "home/ac/erase_all","home/ac/delete_one", "home/ac/rename" ]
+    # Device topics are home/ac/dev/<device>/..., see topics.h in the firmware
+    topics = ["home/ac/dev/+/save", "home/ac/dev/+/save/part", "home/ac/dev/+/list",
+              "home/ac/dev/+/fetch", "home/ac/dev/+/metrics",
+              "home/ac/list", "home/ac/erase_all", "home/ac/delete_one", "home/ac/rename"]
     for topic in topics:
         client.subscribe(topic)
         print(f"[MQTT] Subscribed to: {topic}")
 
+def app_library(payload: bytes) -> str:
+    """The library an app request is about; payloads without one mean the
+    default library."""
+    data = json.loads(payload) if payload else {}
+    return data.get("library") or DEFAULT_LIBRARY
+
 def on_message(client, userdata, msg):
     try:
-        payload = msg.payload.decode()
         print(f"[MQTT DEBUG] Topic: {msg.topic}")
-        print(f"[MQTT DEBUG] Payload: {payload}")
-
-        if msg.topic == "home/ac/save":
-            data = json.loads(payload)
-            name = data["name"]
-            timings = data["timings"]
-
-            print(f"[MQTT] Received save command: {name}, timings length = {len(timings)}")
-            loop.create_task(store_command(name, timings))
-            loop.create_task(republish_commands())
+        print(f"[MQTT DEBUG] Payload: {len(msg.payload)} bytes")
 
+        if msg.topic.startswith("home/ac/dev/"):
+            device, _, kind = msg.topic[len("home/ac/dev/"):].partition("/")
+            handle_device_message(device, kind, msg.payload)
         elif msg.topic == "home/ac/list":
-            loop.create_task(republish_commands())
-
+            loop.create_task(republish_commands(app_library(msg.payload)))
         elif msg.topic == "home/ac/erase_all":
-            loop.create_task(erase_all_commands())
+            loop.create_task(erase_all_commands(app_library(msg.payload)))
         elif msg.topic == "home/ac/delete_one":
-            loop.create_task(delete_command(json.loads(payload)["name"]))
+            data = json.loads(msg.payload)
+            loop.create_task(delete_command(data.get("library") or DEFAULT_LIBRARY, data["name"]))
         elif msg.topic == "home/ac/rename":
-            loop.create_task(rename_command(json.loads(payload)))
+            loop.create_task(rename_command(json.loads(msg.payload)))
 
 
 
@@ -75,57 +92,249 @@ def on_message(client, userdata, msg):
         logging.error(f"[MQTT ERROR] Failed to process message: {e}")
 
 
+save_parts = ir_codec.SaveAssembler()
+
+
+def handle_device_message(device: str, kind: str, payload: bytes):
+    if kind == "list":
+        # Devices send their library name, version and hash
+        have = json.loads(payload)
+        library = have.get("library") or DEFAULT_LIBRARY
+        device_libraries[device] = library
+        loop.create_task(republish_commands(library, have, device))
+    elif kind == "fetch":
+        # One command the device evicted from its cache
+        req = json.loads(payload)
+        library = req.get("library") or DEFAULT_LIBRARY
+        loop.create_task(send_command(library, req["name"], device))
+    elif kind == "save":
+        handle_save(device, payload)
+    elif kind == "save/part":
+        payload = save_parts.add(payload, device)
+        if payload is not None:
+            handle_save(device, payload)
+    elif kind == "metrics":
+        log_metrics(device, ir_codec.decode_metrics(payload))
+
+
+def handle_save(device: str, payload: bytes):
+    if payload[:1] == b"{":
+        data = json.loads(payload)
+        name = data["name"]
+        timings = data["timings"]
+        library = data.get("library")
+    else:
+        name, timings, confidence, library = ir_codec.decode_save(payload)
+        if confidence is not None:
+            print(f"[MQTT] Learned from several captures, confidence {confidence}%")
+
+    if isinstance(timings, list):
+        kind = f"{len(timings)} timings"
+    elif "repeat" in timings:
+        kind = f"{len(timings['timings'])} timings x{timings['repeat']}"
+    else:
+        kind = f"protocol {timings['protocol']}"
+    # A command goes into the library the device learned it for. Older
+    # firmware leaves that out; the library it last asked for is the best
+    # guess then.
+    library = library or device_libraries.get(device, DEFAULT_LIBRARY)
+    print(f"[MQTT] Received save command from {device}: {library}/{name}, {kind}")
+    loop.create_task(store_command(library, name, timings))
+
+
+# Last report of each device
+latest_metrics = {}
+
+
+def log_metrics(device: str, report: dict):
+    latest_metrics[device] = report
+    heap = report["heap"]
+    print(f"[METRICS] {device} up {report['uptime_s']}s, heap {heap['free']} free "
+          f"(low {heap['min_free']}), largest block {heap['largest_block']} "
+          f"(low {heap['min_largest_block']}), {report['counters']}")
+    for name, st in report["stages"].items():
+        if st["samples"]:
+            p50 = ir_codec.histogram_percentile(st["buckets"], 0.5)
+            p99 = ir_codec.histogram_percentile(st["buckets"], 0.99)
+            print(f"[METRICS] {device} {name}: n={st['samples']} mean={st['mean_us']}us "
+                  f"p50<{p50}us p99<{p99}us max={st['max_us']}us")
+
+
 # ----- DATABASE ACTIONS -----
 
+# Tables from before libraries keyed commands by name alone and kept the
+# version in a single library_meta row with an integer id. Their rows move
+# to the default library.
+LIBRARY_MIGRATION = {
+    "commands": [
+        f"ALTER TABLE commands ADD COLUMN library VARCHAR NOT NULL DEFAULT '{DEFAULT_LIBRARY}'",
+        "ALTER TABLE commands DROP CONSTRAINT commands_pkey",
+        "ALTER TABLE commands ADD PRIMARY KEY (library, name)",
+    ],
+    "library_meta": [
+        "ALTER TABLE library_meta DROP CONSTRAINT library_meta_pkey",
+        "ALTER TABLE library_meta DROP COLUMN id",
+        f"ALTER TABLE library_meta ADD COLUMN library VARCHAR NOT NULL DEFAULT '{DEFAULT_LIBRARY}'",
+        "ALTER TABLE library_meta ALTER COLUMN library DROP DEFAULT",
+        "ALTER TABLE library_meta ADD PRIMARY KEY (library)",
+    ],
+}
+
+def tables_without_library(conn) -> list:
+    db = inspect(conn)
+    return [table for table in LIBRARY_MIGRATION if db.has_table(table)
+            and "library" not in {col["name"] for col in db.get_columns(table)}]
+
 async def init_db():
     async with engine.begin() as conn:
+        for table in await conn.run_sync(tables_without_library):
+            for statement in LIBRARY_MIGRATION[table]:
+                await conn.execute(text(statement))
+            print(f"[DB] Moved {table} to the {DEFAULT_LIBRARY} library")
         await conn.run_sync(Base.metadata.create_all)
         print("[DB] Initialized")
 
-async def store_command(name: str, timings: list):
+async def current_version(session, library: str) -> int:
+    meta = await session.get(LibraryMeta, library)
+    return meta.version if meta else 0
+
+async def bump_version(session, library: str) -> int:
+    stmt = pg_insert(LibraryMeta).values(library=library, version=1).on_conflict_do_update(
+        index_elements=["library"],
+        set_={"version": LibraryMeta.version + 1}
+    ).returning(LibraryMeta.version)
+    return (await session.execute(stmt)).scalar_one()
+
+def publish_delta(library: str, op: int, version: int, **fields):
+    """Only devices assigned the library subscribe to its delta topic. A
+    delta too long for them is left out; they see the version gap on the
+    next one and ask for a snapshot."""
+    delta = ir_codec.encode_delta(op, version, **fields)
+    topic = f"home/ac/lib/{library}/delta"
+    if not ir_codec.fits_device(topic, delta):
+        logging.warning(f"[MQTT] {library} delta v{version} too long ({len(delta)} bytes), skipped")
+        return
+    mqttc.publish(topic, delta, qos=1)
+    print(f"[MQTT] Published {library} delta '{chr(op)}' v{version} ({len(delta)} bytes)")
+
+async def library_commands(session, library: str) -> dict:
+    result = await session.execute(select(Command).where(Command.library == library))
+    return {cmd.name: cmd.raw_timings for cmd in result.scalars().all()}
+
+async def store_command(library: str, name: str, timings):
     try:
         async with SessionLocal() as session:
             async with session.begin():
                 stmt = pg_insert(Command).values(
+                    library=library,
                     name=name,
                     raw_timings=timings
                 ).on_conflict_do_update(
-                    index_elements=["name"],
+                    index_elements=["library", "name"],
                     set_={
                         "raw_timings": timings,
                         "learned_at": func.now()
                     }
                 )
                 await session.execute(stmt)
-                print(f"[DB] Stored/Updated command: {name}")
+                version = await bump_version(session, library)
+                print(f"[DB] Stored/Updated command: {library}/{name}")
+        publish_delta(library, ir_codec.OP_UPSERT, version, name=name, timings=timings)
+        await republish_commands(library)
     except SQLAlchemyError as e:
         logging.error(f"[DB ERROR] Failed to store command: {e}")
 
-async def republish_commands():
+async def republish_commands(library: str, have: dict = None, device: str = None):
+    """Publish the library's JSON view for the app, or for a device whose
+    version or hash is stale, the binary snapshot on that device's topic."""
     try:
-        async with SessionLocal() as session:
-            result = await session.execute(select(Command))
-            commands = result.scalars().all()
-            payload = {cmd.name: cmd.raw_timings for cmd in commands}
-            mqttc.publish("home/ac/available_cmds", json.dumps(payload))
-            print(f"[MQTT] Published {len(payload)} commands")
+        async with SnapshotSession() as session:
+            async with session.begin():
+                payload = await library_commands(session, library)
+                version = await current_version(session, library)
+        if device is None:
+            # The app wants flat timing lists; protocol commands have none
+            app_view = {n: ir_codec.expand(t) for n, t in payload.items()}
+            mqttc.publish(f"home/ac/lib/{library}/available_cmds", json.dumps(app_view))
+            print(f"[MQTT] Published {len(payload)} {library} commands")
+            return
+
+        if have.get("version") == version and have.get("hash") == ir_codec.library_hash(payload):
+            print(f"[MQTT] {device} already at {library} v{version}, snapshot skipped")
+            return
+        snapshot = ir_codec.encode_library(payload, version)
+        plain = len(snapshot)
+        # Devices list the encodings they decode, e.g. {"accept": "lz"}
+        if "lz" in have.get("accept", "").split(","):
+            packed = ir_codec.compress_library(snapshot)
+            if len(packed) < plain:
+                snapshot = packed
+        topic = f"home/ac/dev/{device}/library"
+        if ir_codec.fits_device(topic, snapshot):
+            mqttc.publish(topic, snapshot)
+            parts = 1
+        else:
+            global snapshot_transfer
+            snapshot_transfer += 1
+            parts = ir_codec.split_parts(snapshot, snapshot_transfer)
+            # QoS 1 from one client keeps the parts in order
+            for part in parts:
+                mqttc.publish(f"{topic}/part", part, qos=1)
+            parts = len(parts)
+        print(f"[MQTT] Published {library} v{version} snapshot to {device}, "
+              f"{len(payload)} commands ({len(snapshot)} of {plain} bytes, {parts} messages)")
     except Exception as e:
         logging.error(f"[MQTT ERROR] Failed to republish: {e}")
 
-async def erase_all_commands():
+async def send_command(library: str, name: str, device: str):
+    """Answer a device's fetch: an upsert at the current version, or a
+    delete when the library has no such command."""
+    try:
+        async with SnapshotSession() as session:
+            async with session.begin():
+                cmd = await session.get(Command, (library, name))
+                version = await current_version(session, library)
+        if cmd is None:
+            reply = ir_codec.encode_delta(ir_codec.OP_DELETE, version, name=name)
+        else:
+            reply = ir_codec.encode_delta(ir_codec.OP_UPSERT, version, name=name,
+                                          timings=cmd.raw_timings)
+        topic = f"home/ac/dev/{device}/command"
+        if not ir_codec.fits_device(topic, reply):
+            logging.error(f"[MQTT ERROR] {library}/{name} too long for {device} ({len(reply)} bytes)")
+            return
+        mqttc.publish(topic, reply, qos=1)
+        print(f"[MQTT] Sent {library}/{name} v{version} to {device} ({len(reply)} bytes)")
+    except Exception as e:
+        logging.error(f"[MQTT ERROR] Failed to send {name}: {e}")
+
+async def erase_all_commands(library: str):
     try:
         async with SessionLocal() as session:
             async with session.begin():
-                await session.execute(Command.__table__.delete())
-                print("[DB] ❌ All commands erased")
-            await republish_commands()
+                await session.execute(
+                    Command.__table__.delete().where(Command.library == library)
+                )
+                version = await bump_version(session, library)
+                print(f"[DB] ❌ All {library} commands erased")
+            publish_delta(library, ir_codec.OP_ERASE, version)
+            await republish_commands(library)
     except Exception as e:
         logging.error(f"[DB ERROR] Erase all failed: {e}")
 
+@app.get("/metrics")
+async def get_metrics(device: str = None):
+    """Last report of every device, or of one; also asks for fresh ones."""
+    for name in [device] if device else list(device_libraries):
+        mqttc.publish(f"home/ac/dev/{name}/metrics/get", "")
+    if device:
+        return JSONResponse(content=latest_metrics.get(device, {}))
+    return JSONResponse(content=latest_metrics)
+
 @app.get("/commands")
-async def get_all_commands():
+async def get_all_commands(library: str = DEFAULT_LIBRARY):
     async with SessionLocal() as session:
-        result = await session.execute(select(Command))
+        result = await session.execute(select(Command).where(Command.library == library))
         commands = result.scalars().all()
         return JSONResponse(content={
             "commands": [
@@ -133,27 +342,31 @@ async def get_all_commands():
                 for cmd in commands
             ]
         })
-async def delete_command(name: str):
+async def delete_command(library: str, name: str):
     try:
         async with SessionLocal() as session:
             async with session.begin():
                 await session.execute(
-                    Command.__table__.delete().where(Command.name == name)
+                    Command.__table__.delete().where(
+                        Command.library == library, Command.name == name)
                 )
-                print(f"[DB] Deleted command: {name}")
-        await republish_commands()
+                version = await bump_version(session, library)
+                print(f"[DB] Deleted command: {library}/{name}")
+        publish_delta(library, ir_codec.OP_DELETE, version, name=name)
+        await republish_commands(library)
     except Exception as e:
         logging.error(f"[DB ERROR] Failed to delete {name}: {e}")
 async def rename_command(data):
     try:
+        library = data.get("library") or DEFAULT_LIBRARY
         old_name = data["old_name"]
         new_name = data["new_name"]
-        
+
 
         async with SessionLocal() as session:
             async with session.begin():
                 # Fetch existing command
-                cmd = await session.get(Command, old_name)
+                cmd = await session.get(Command, (library, old_name))
                 if not cmd:
                     print(f"[DB] Command '{old_name}' not found for rename")
                     return
@@ -161,9 +374,11 @@ async def rename_command(data):
                 # Update name
                 cmd.name = new_name
                 await session.flush()
-                print(f"[DB] Renamed '{old_name}' → '{new_name}'")
+                version = await bump_version(session, library)
+                print(f"[DB] Renamed {library}/'{old_name}' → '{new_name}'")
 
-        await republish_commands()
+        publish_delta(library, ir_codec.OP_RENAME, version, name=old_name, new_name=new_name)
+        await republish_commands(library)
 
     except Exception as e:
         logging.error(f"[DB ERROR] Rename failed: {e}")
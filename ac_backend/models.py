@@ -1,4 +1,4 @@
-from sqlalchemy import Column, String, JSON, DateTime, func, TIMESTAMP
+from sqlalchemy import Column, String, JSON, DateTime, func, TIMESTAMP, Integer
 from sqlalchemy.ext.asyncio import AsyncAttrs, create_async_engine, async_sessionmaker
 from sqlalchemy.orm import declarative_base
 
@@ -7,7 +7,17 @@ Base = declarative_base()
 from sqlalchemy.dialects.postgresql import JSONB
 
 class Command(Base):
+    """One learned command of a library. Devices keep only the library
+    they are assigned."""
     __tablename__ = "commands"
+    library = Column(String, primary_key=True, default="default")
     name = Column(String, primary_key=True)
     raw_timings = Column(JSONB, nullable=False)
     learned_at = Column(DateTime(timezone=True), server_default=func.now(), onupdate=func.now())
+
+
+class LibraryMeta(Base):
+    """One row per library, holding the version devices sync against."""
+    __tablename__ = "library_meta"
+    library = Column(String, primary_key=True)
+    version = Column(Integer, nullable=False, default=0)
@@ -27,6 +27,10 @@ class _IRHomePageState extends State<IRHomePage> {
   String _status = 'Connecting…';
   List<String> _commandNames = [];
   Map<String, List<int>> _commandMap = {};
+  // Commands come from one library; requests go to the first device seen
+  // reporting status, see topics.h in the firmware.
+  final String _library = 'default';
+  String? _device;
  
 
   @override
@@ -62,8 +66,8 @@ class _IRHomePageState extends State<IRHomePage> {
   void _onConnected() {
     _client.updates?.listen(_onMessage);
     setState(() => _status = 'Connected');
-    _client.subscribe('home/ac/status', MqttQos.atLeastOnce);
-    _client.subscribe('home/ac/available_cmds', MqttQos.atLeastOnce);
+    _client.subscribe('home/ac/dev/+/status', MqttQos.atLeastOnce);
+    _client.subscribe('home/ac/lib/$_library/available_cmds', MqttQos.atLeastOnce);
     _requestList();
     
   }
@@ -86,12 +90,15 @@ void _onMessage(List<MqttReceivedMessage<MqttMessage>>? events) {
   final payloadString = MqttPublishPayload.bytesToStringAsString(payloadBytes);
   debugPrint('[MQTT] Received on ${rec.topic}: $payloadString');
 
-  if (rec.topic == 'home/ac/status') {
+  final parts = rec.topic.split('/');
+  if (parts.length == 5 && parts[2] == 'dev' && parts[4] == 'status') {
+    _device ??= parts[3];
+    if (parts[3] != _device) return;
     setState(() => _status = payloadString);
     if (payloadString.startsWith('Learned')) {
       Future.delayed(const Duration(milliseconds: 500), _requestList);
     }
-  } else if (rec.topic == 'home/ac/available_cmds') {
+  } else if (rec.topic == 'home/ac/lib/$_library/available_cmds') {
       try {
         final decoded = jsonDecode(payloadString);
         if (decoded is Map<String, dynamic>) {
@@ -109,24 +116,34 @@ void _onMessage(List<MqttReceivedMessage<MqttMessage>>? events) {
 
 
   void _requestList() {
-    final b = MqttClientPayloadBuilder()..addString('');
+    final b = MqttClientPayloadBuilder()
+      ..addString(jsonEncode({'library': _library}));
     _client.publishMessage('home/ac/list', MqttQos.atLeastOnce, b.payload!);
   }
 
   void _sendCommand(String name) {
+    if (_device == null) {
+      setState(() => _status = 'No device online yet');
+      return;
+    }
     final b = MqttClientPayloadBuilder()
       ..addString(jsonEncode({'name': name}));
-    _client.publishMessage('home/ac/send', MqttQos.atLeastOnce, b.payload!);
+    _client.publishMessage('home/ac/dev/$_device/send', MqttQos.atLeastOnce, b.payload!);
   }
 
   void _sendEraseAll() {
-    final b = MqttClientPayloadBuilder()..addString('');
+    final b = MqttClientPayloadBuilder()
+      ..addString(jsonEncode({'library': _library}));
     _client.publishMessage('home/ac/erase_all', MqttQos.atLeastOnce, b.payload!);
   }
 
   void _resetWiFi() {
+    if (_device == null) {
+      setState(() => _status = 'No device online yet');
+      return;
+    }
     final b = MqttClientPayloadBuilder()..addString('reset');
-    _client.publishMessage('home/ac/reset_wifi', MqttQos.atLeastOnce, b.payload!);
+    _client.publishMessage('home/ac/dev/$_device/reset_wifi', MqttQos.atLeastOnce, b.payload!);
     ScaffoldMessenger.of(context).showSnackBar(
       const SnackBar(content: Text('Reset command sent to ESP32')),
     );
@@ -161,6 +178,7 @@ void _onMessage(List<MqttReceivedMessage<MqttMessage>>? events) {
 
 void _renameCommand(String oldName, String newName) {
   final payload = jsonEncode({
+    "library": _library,
     "old_name": oldName,
     "new_name": newName
   });
@@ -197,7 +215,7 @@ void _confirmDelete(String name) {
 
 void _deleteCommand(String name) {
   final b = MqttClientPayloadBuilder()
-    ..addString(jsonEncode({"name": name}));
+    ..addString(jsonEncode({"library": _library, "name": name}));
   _client.publishMessage('home/ac/delete_one', MqttQos.atLeastOnce, b.payload!);
 }
 